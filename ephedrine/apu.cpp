@@ -1,7 +1,181 @@
 #include "apu.h"
+
+#include <algorithm>
+
+#include "bit_utility.h"
 #include "gb.h"
+#include "simd.h"
+
+namespace {
+// 8 steps of each duty cycle (12.5%, 25%, 50%, 75%)
+constexpr uint8_t kDutyPatterns[4] = {0x01, 0x81, 0x87, 0x7E};
+// Frame sequencer runs at 512Hz
+constexpr int kSequencerPeriod = kAudioClockRate / 512;
+// Enough room for a few frames of unread output per channel. Muted,
+// nothing is ever added
+constexpr int kBlipCapacity = 8192;
+constexpr int BlipCapacity(const APUMode mode) {
+  return mode == APUMode::kMuted ? 0 : kBlipCapacity;
+}
+// Bits that always read back as 1, 0xFF10 - 0xFF2F. Wave RAM reads as is
+constexpr uint8_t kReadMasks[0x20] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,  // NR10 - NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,  // unused, NR21 - NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,  // NR30 - NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,  // unused, NR41 - NR44
+    0x00, 0x00, 0x70,              // NR50 - NR52
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+constexpr int kNoiseDivisors[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+// Where mixed output levels end up once scaled to 16 bit
+constexpr float kOutputScale = 60.0F;
+// How quickly the high-pass settles on the DC offset
+constexpr float kHighPassRate = 0.0005F;
+
+int SquarePeriod(const SquareChannel &ch) { return (2048 - ch.frequency) * 4; }
+int WavePeriod(const WaveChannel &ch) { return (2048 - ch.frequency) * 2; }
+int NoisePeriod(const NoiseChannel &ch) {
+  return kNoiseDivisors[ch.divisor_code] << ch.clock_shift;
+}
+
+void ClockEnvelope(Envelope &envelope) {
+  if (envelope.period == 0) return;
+  if (--envelope.timer > 0) return;
+  envelope.timer = envelope.period;
+  if (envelope.increase && envelope.volume < 15) {
+    ++envelope.volume;
+  } else if (!envelope.increase && envelope.volume > 0) {
+    --envelope.volume;
+  }
+}
+
+/**
+ * Sum the channels enabled in mask (bit n for channel n + 1, ie. one side's
+ * half of NR51) for samples start to end, times volume. Disabled channels
+ * are masked out rather than branched on so it vectorises
+ */
+void MixChannels(const std::array<const float *, 4> &channels,
+                 const int mask, const int volume, const int start,
+                 const int end, float *out) {
+  int s = start;
+#ifdef EPHEDRINE_SSE2
+  __m128 enabled[4];
+  for (int i = 0; i < 4; ++i) {
+    enabled[i] = _mm_castsi128_ps(_mm_set1_epi32(bit_check(mask, i) ? -1 : 0));
+  }
+  const __m128 gain = _mm_set1_ps(static_cast<float>(volume));
+  for (; s + 4 <= end; s += 4) {
+    __m128 sum = _mm_and_ps(_mm_loadu_ps(channels[0] + s), enabled[0]);
+    for (int i = 1; i < 4; ++i) {
+      const __m128 channel = _mm_loadu_ps(channels[i] + s);
+      sum = _mm_add_ps(sum, _mm_and_ps(channel, enabled[i]));
+    }
+    _mm_storeu_ps(out + s, _mm_mul_ps(sum, gain));
+  }
+#endif
+  float enabled_gain[4];
+  for (int i = 0; i < 4; ++i) {
+    enabled_gain[i] = bit_check(mask, i) ? 1.0F : 0.0F;
+  }
+  for (; s < end; ++s) {
+    float sum = channels[0][s] * enabled_gain[0];
+    for (int i = 1; i < 4; ++i) sum += channels[i][s] * enabled_gain[i];
+    out[s] = sum * static_cast<float>(volume);
+  }
+}
+
+/**
+ * One pole high-pass, hp += (x - hp) * kHighPassRate, out = x - hp, then
+ * scaled to 16 bit levels. Every sample depends on the one before, so the
+ * SIMD version works 4 samples at a time from the closed form,
+ * hp[j] = r^(j + 1) * hp[-1] + k * sum(r^(j - i) * x[i]) where r = 1 - k,
+ * with the sum built up as a prefix scan. Left and right are independent
+ * chains and get interleaved to hide each other's latency
+ */
+void HighPass(float *left, float *right, const int count, float &left_state,
+              float &right_state) {
+  int s = 0;
+#ifdef EPHEDRINE_SSE2
+  constexpr float k = kHighPassRate;
+  constexpr float r = 1.0F - kHighPassRate;
+  const __m128 rate = _mm_set1_ps(k);
+  const __m128 r1 = _mm_set1_ps(r);
+  const __m128 r2 = _mm_set1_ps(r * r);
+  const __m128 decay = _mm_setr_ps(r, r * r, r * r * r, r * r * r * r);
+  const __m128 scale = _mm_set1_ps(kOutputScale);
+  const auto shift = [](const __m128 v, const int lanes) {
+    const __m128i bits = _mm_castps_si128(v);
+    return _mm_castsi128_ps(lanes == 1 ? _mm_slli_si128(bits, 4)
+                                       : _mm_slli_si128(bits, 8));
+  };
+  const auto step = [&](float *samples, __m128 &state) {
+    const __m128 x = _mm_loadu_ps(samples);
+    __m128 sum = _mm_mul_ps(x, rate);
+    sum = _mm_add_ps(sum, _mm_mul_ps(shift(sum, 1), r1));
+    sum = _mm_add_ps(sum, _mm_mul_ps(shift(sum, 2), r2));
+    const __m128 hp = _mm_add_ps(sum, _mm_mul_ps(state, decay));
+    _mm_storeu_ps(samples, _mm_mul_ps(_mm_sub_ps(x, hp), scale));
+    state = _mm_shuffle_ps(hp, hp, _MM_SHUFFLE(3, 3, 3, 3));
+  };
+  __m128 left_hp = _mm_set1_ps(left_state);
+  __m128 right_hp = _mm_set1_ps(right_state);
+  for (; s + 4 <= count; s += 4) {
+    step(left + s, left_hp);
+    step(right + s, right_hp);
+  }
+  left_state = _mm_cvtss_f32(left_hp);
+  right_state = _mm_cvtss_f32(right_hp);
+#endif
+  for (; s < count; ++s) {
+    left_state += (left[s] - left_state) * kHighPassRate;
+    right_state += (right[s] - right_state) * kHighPassRate;
+    left[s] = (left[s] - left_state) * kOutputScale;
+    right[s] = (right[s] - right_state) * kOutputScale;
+  }
+}
+
+// Round, saturate and interleave into left/right int16 pairs
+void Interleave(const float *left, const float *right, const int count,
+                int16_t *out) {
+  int s = 0;
+#ifdef EPHEDRINE_SSE2
+  for (; s + 4 <= count; s += 4) {
+    const __m128 l = _mm_loadu_ps(left + s);
+    const __m128 r = _mm_loadu_ps(right + s);
+    const __m128i low = _mm_cvtps_epi32(_mm_unpacklo_ps(l, r));
+    const __m128i high = _mm_cvtps_epi32(_mm_unpackhi_ps(l, r));
+    // packs saturates to int16 for us
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + s * 2),
+                     _mm_packs_epi32(low, high));
+  }
+#endif
+  const auto to_int16 = [](const float sample) {
+    const float clamped = std::clamp(sample, -32768.0F, 32767.0F);
+    return static_cast<int16_t>(clamped < 0 ? clamped - 0.5F
+                                            : clamped + 0.5F);
+  };
+  for (; s < count; ++s) {
+    out[s * 2] = to_int16(left[s]);
+    out[s * 2 + 1] = to_int16(right[s]);
+  }
+}
 
-APU::APU(MMU &mmu) : mmu_(mmu) {
+void LoadEnvelope(Envelope &envelope, const uint8_t value) {
+  envelope.volume = value >> 4;
+  envelope.increase = bit_check(value, 3);
+  envelope.period = value & 0x07;
+  envelope.timer = envelope.period;
+}
+}  // namespace
+
+APU::APU(MMU &mmu, const APUMode mode)
+    : mmu_(mmu),
+      mode_(mode),
+      blip_{BlipBuffer(BlipCapacity(mode)), BlipBuffer(BlipCapacity(mode)),
+            BlipBuffer(BlipCapacity(mode)), BlipBuffer(BlipCapacity(mode))} {
+  pending_writes_.reserve(kPendingWritesReserve);
+  for (BlipBuffer &blip : blip_) {
+    blip.SetRates(kAudioClockRate, kAudioSampleRate);
+  }
   // Initialize all the sound registers to their boot up values
   mmu_.SetRegister(NR10, 0x80);
   mmu_.SetRegister(NR11, 0xBF);
@@ -22,4 +196,551 @@ APU::APU(MMU &mmu) : mmu_(mmu) {
   mmu_.SetRegister(NR51, 0xF3);
   // DMG / GBP / CGB
   mmu_.SetRegister(NR52, 0xF1);
+  for (uint16_t address = NR10; address <= NR52; ++address) {
+    Register(address) = mmu_.GetRegister(address);
+  }
+  // the boot beep has long since faded out, but channel 1 is still on
+  square_[0].enabled = true;
+  square_[0].dac = true;
+  square_[0].duty = 2;
+  mix_nr50_ = Register(NR50);
+  mix_nr51_ = Register(NR51);
+}
+
+// The sound registers are already in mmu along with the rest of memory.
+// Steps not read out of the buffers yet come along too
+APU::APU(const APU &other, MMU &mmu)
+    : mmu_(mmu),
+      mode_(other.mode_),
+      registers_(other.registers_),
+      powered_(other.powered_),
+      square_(other.square_),
+      wave_(other.wave_),
+      noise_(other.noise_),
+      sequencer_step_(other.sequencer_step_),
+      sequencer_clock_(other.sequencer_clock_),
+      time_(other.time_),
+      run_time_(other.run_time_),
+      pending_writes_(other.pending_writes_),
+      output_rate_(other.output_rate_),
+      blip_(other.blip_),
+      output_(other.output_),
+      mix_changes_(other.mix_changes_),
+      mix_nr50_(other.mix_nr50_),
+      mix_nr51_(other.mix_nr51_),
+      high_pass_left_(other.high_pass_left_),
+      high_pass_right_(other.high_pass_right_) {
+  pending_writes_.reserve(kPendingWritesReserve);
+}
+
+void APU::Snapshot(APUState &state) const {
+  state.registers = registers_;
+  state.powered = powered_;
+  state.square = square_;
+  state.wave = wave_;
+  state.noise = noise_;
+  state.sequencer_step = sequencer_step_;
+  state.sequencer_clock = sequencer_clock_;
+  state.time = time_;
+  for (int i = 0; i < 4; ++i) blip_[i].SaveState(state.blip[i]);
+  state.output = output_;
+  // the mix as of the last sample available, and the changes after it
+  const int available = SamplesAvailable();
+  state.mix_nr50 = mix_nr50_;
+  state.mix_nr51 = mix_nr51_;
+  int pending = 0;
+  for (const MixChange &change : mix_changes_) {
+    if (change.sample <= available) {
+      state.mix_nr50 = change.nr50;
+      state.mix_nr51 = change.nr51;
+    } else {
+      const int slot =
+          std::min(pending++, APUState::kMaxPendingMixChanges - 1);
+      state.mix_changes[slot] = MixChange{change.sample - available,
+                                          change.nr50, change.nr51};
+    }
+  }
+  state.pending_mix_changes =
+      std::min(pending, APUState::kMaxPendingMixChanges);
+  state.high_pass_left = high_pass_left_;
+  state.high_pass_right = high_pass_right_;
+}
+
+void APU::Restore(const APUState &state) {
+  registers_ = state.registers;
+  powered_ = state.powered;
+  square_ = state.square;
+  wave_ = state.wave;
+  noise_ = state.noise;
+  sequencer_step_ = state.sequencer_step;
+  sequencer_clock_ = state.sequencer_clock;
+  time_ = state.time;
+  // writes queued up since belong to the timeline being left
+  pending_writes_.clear();
+  for (int i = 0; i < 4; ++i) blip_[i].RestoreState(state.blip[i]);
+  output_ = state.output;
+  mix_nr50_ = state.mix_nr50;
+  mix_nr51_ = state.mix_nr51;
+  mix_changes_.assign(state.mix_changes.begin(),
+                      state.mix_changes.begin() + state.pending_mix_changes);
+  high_pass_left_ = state.high_pass_left;
+  high_pass_right_ = state.high_pass_right;
+  run_time_ = time_;
+  // a snapshot taken muted has no output levels to carry on from
+  for (int i = 0; i < 4; ++i) UpdateOutput(i, time_);
+}
+
+uint8_t APU::ReadRegister(const uint16_t address) {
+  // reads are rare, so they just bring everything up to date (NR52's
+  // channel status needs the channels run up to now anyway)
+  Sync();
+  if (address >= 0xFF30) return Register(address);
+  if (address == NR52) {
+    uint8_t status = (powered_ << 7) | kReadMasks[NR52 - 0xFF10];
+    if (square_[0].enabled) bit_set(status, 0);
+    if (square_[1].enabled) bit_set(status, 1);
+    if (wave_.enabled) bit_set(status, 2);
+    if (noise_.enabled) bit_set(status, 3);
+    return status;
+  }
+  return Register(address) | kReadMasks[address - 0xFF10];
+}
+
+void APU::Sync() {
+  for (const RegisterWrite &write : pending_writes_) {
+    RunUntil(write.time);
+    ApplyWrite(write.address, write.value);
+  }
+  pending_writes_.clear();
+  RunUntil(time_);
+}
+
+void APU::ApplyWrite(const uint16_t address, const uint8_t value) {
+  // wave RAM is always accessible
+  if (address >= 0xFF30) {
+    Register(address) = value;
+    return;
+  }
+  if (address == NR52) {
+    const bool power = bit_check(value, 7);
+    if (powered_ && !power) {
+      PowerOff();
+    } else if (!powered_ && power) {
+      // the frame sequencer starts over
+      sequencer_step_ = 0;
+      sequencer_clock_ = run_time_ + kSequencerPeriod;
+    }
+    powered_ = power;
+    Register(NR52) = value & 0x80;
+    return;
+  }
+  // everything else is read only while the APU is off
+  if (!powered_) return;
+  Register(address) = value;
+
+  switch (address) {
+    case NR10: {
+      SquareChannel &ch = square_[0];
+      ch.sweep_period = (value >> 4) & 0x07;
+      ch.sweep_negate = bit_check(value, 3);
+      ch.sweep_shift = value & 0x07;
+      break;
+    }
+    case NR11:
+    case NR21: {
+      SquareChannel &ch = square_[address == NR11 ? 0 : 1];
+      ch.duty = value >> 6;
+      ch.length = 64 - (value & 0x3F);
+      break;
+    }
+    case NR12:
+    case NR22: {
+      SquareChannel &ch = square_[address == NR12 ? 0 : 1];
+      LoadEnvelope(ch.envelope, value);
+      ch.dac = (value & 0xF8) != 0;
+      if (!ch.dac) ch.enabled = false;
+      break;
+    }
+    case NR13:
+    case NR23: {
+      SquareChannel &ch = square_[address == NR13 ? 0 : 1];
+      ch.frequency = (ch.frequency & 0x700) | value;
+      break;
+    }
+    case NR14:
+    case NR24: {
+      const int index = address == NR14 ? 0 : 1;
+      SquareChannel &ch = square_[index];
+      ch.frequency = (ch.frequency & 0xFF) | ((value & 0x07) << 8);
+      ch.length_enabled = bit_check(value, 6);
+      if (bit_check(value, 7)) TriggerSquare(index);
+      break;
+    }
+    case NR30:
+      wave_.dac = bit_check(value, 7);
+      if (!wave_.dac) wave_.enabled = false;
+      break;
+    case NR31:
+      wave_.length = 256 - value;
+      break;
+    case NR32:
+      wave_.volume_code = (value >> 5) & 0x03;
+      break;
+    case NR33:
+      wave_.frequency = (wave_.frequency & 0x700) | value;
+      break;
+    case NR34:
+      wave_.frequency = (wave_.frequency & 0xFF) | ((value & 0x07) << 8);
+      wave_.length_enabled = bit_check(value, 6);
+      if (bit_check(value, 7)) TriggerWave();
+      break;
+    case NR41:
+      noise_.length = 64 - (value & 0x3F);
+      break;
+    case NR42:
+      LoadEnvelope(noise_.envelope, value);
+      noise_.dac = (value & 0xF8) != 0;
+      if (!noise_.dac) noise_.enabled = false;
+      break;
+    case NR43:
+      noise_.clock_shift = value >> 4;
+      noise_.width_mode = bit_check(value, 3);
+      noise_.divisor_code = value & 0x07;
+      break;
+    case NR44:
+      noise_.length_enabled = bit_check(value, 6);
+      if (bit_check(value, 7)) TriggerNoise();
+      break;
+    case NR50:
+    case NR51:
+      if (mode_ == APUMode::kMuted) break;
+      mix_changes_.push_back(MixChange{blip_[0].SampleIndex(run_time_),
+                                       Register(NR50), Register(NR51)});
+      break;
+    default:
+      break;
+  }
+  for (int i = 0; i < 4; ++i) UpdateOutput(i, run_time_);
+}
+
+void APU::PowerOff() {
+  for (uint16_t address = NR10; address < NR52; ++address) {
+    Register(address) = 0;
+  }
+  square_ = {};
+  wave_ = {};
+  noise_ = {};
+  mix_changes_.push_back(MixChange{blip_[0].SampleIndex(run_time_), 0, 0});
+  for (int i = 0; i < 4; ++i) UpdateOutput(i, run_time_);
+}
+
+void APU::TriggerSquare(const int index) {
+  SquareChannel &ch = square_[index];
+  ch.enabled = ch.dac;
+  if (ch.length == 0) ch.length = 64;
+  ch.next_clock = run_time_ + SquarePeriod(ch);
+  ch.envelope.volume = Register(index == 0 ? NR12 : NR22) >> 4;
+  ch.envelope.timer = ch.envelope.period;
+  if (index == 0) {
+    ch.shadow_frequency = ch.frequency;
+    ch.sweep_timer = ch.sweep_period ? ch.sweep_period : 8;
+    ch.sweep_enabled = ch.sweep_period || ch.sweep_shift;
+    // an immediate overflow check
+    if (ch.sweep_shift) CalculateSweep();
+  }
+}
+
+void APU::TriggerWave() {
+  wave_.enabled = wave_.dac;
+  if (wave_.length == 0) wave_.length = 256;
+  wave_.next_clock = run_time_ + WavePeriod(wave_);
+  wave_.position = 0;
+}
+
+void APU::TriggerNoise() {
+  noise_.enabled = noise_.dac;
+  if (noise_.length == 0) noise_.length = 64;
+  noise_.next_clock = run_time_ + NoisePeriod(noise_);
+  noise_.envelope.volume = Register(NR42) >> 4;
+  noise_.envelope.timer = noise_.envelope.period;
+  noise_.lfsr = 0x7FFF;
+}
+
+/**
+ * Frequency the sweep would move channel 1 to next. Going past 2047
+ * switches the channel off
+ */
+int APU::CalculateSweep() {
+  SquareChannel &ch = square_[0];
+  int frequency = ch.shadow_frequency >> ch.sweep_shift;
+  frequency = ch.sweep_negate ? ch.shadow_frequency - frequency
+                              : ch.shadow_frequency + frequency;
+  if (frequency > 2047) ch.enabled = false;
+  return frequency;
+}
+
+/**
+ * Bring the channels and frame sequencer up to clock end
+ */
+void APU::RunUntil(const int end) {
+  // muted, only the frame sequencer can change anything the game can see
+  const bool synthesize = mode_ == APUMode::kSynthesize;
+  while (sequencer_clock_ <= end) {
+    if (synthesize) {
+      RunSquare(0, sequencer_clock_);
+      RunSquare(1, sequencer_clock_);
+      RunWave(sequencer_clock_);
+      RunNoise(sequencer_clock_);
+    }
+    if (powered_) {
+      ClockSequencer();
+      for (int i = 0; i < 4; ++i) UpdateOutput(i, sequencer_clock_);
+    }
+    sequencer_clock_ += kSequencerPeriod;
+  }
+  if (synthesize) {
+    RunSquare(0, end);
+    RunSquare(1, end);
+    RunWave(end);
+    RunNoise(end);
+  }
+  run_time_ = end;
+}
+
+void APU::RunSquare(const int index, const int end) {
+  SquareChannel &ch = square_[index];
+  if (!ch.enabled) {
+    ch.next_clock = std::max(ch.next_clock, end);
+    return;
+  }
+  while (ch.next_clock < end) {
+    ch.duty_step = (ch.duty_step + 1) & 7;
+    UpdateOutput(index, ch.next_clock);
+    ch.next_clock += SquarePeriod(ch);
+  }
+}
+
+void APU::RunWave(const int end) {
+  if (!wave_.enabled) {
+    wave_.next_clock = std::max(wave_.next_clock, end);
+    return;
+  }
+  while (wave_.next_clock < end) {
+    wave_.position = (wave_.position + 1) & 31;
+    const uint8_t byte = Register(0xFF30 + wave_.position / 2);
+    wave_.sample = wave_.position & 1 ? byte & 0x0F : byte >> 4;
+    UpdateOutput(2, wave_.next_clock);
+    wave_.next_clock += WavePeriod(wave_);
+  }
+}
+
+void APU::RunNoise(const int end) {
+  // shifts of 14 and 15 stop the LFSR being clocked at all
+  if (!noise_.enabled || noise_.clock_shift >= 14) {
+    noise_.next_clock = std::max(noise_.next_clock, end);
+    return;
+  }
+  while (noise_.next_clock < end) {
+    const uint16_t bit = (noise_.lfsr ^ (noise_.lfsr >> 1)) & 1U;
+    noise_.lfsr = (noise_.lfsr >> 1) | (bit << 14);
+    if (noise_.width_mode) {
+      noise_.lfsr = (noise_.lfsr & ~(1U << 6)) | (bit << 6);
+    }
+    UpdateOutput(3, noise_.next_clock);
+    noise_.next_clock += NoisePeriod(noise_);
+  }
+}
+
+/**
+ * Step  Length  Envelope  Sweep
+ *  0     Clock     -        -
+ *  2     Clock     -      Clock
+ *  4     Clock     -        -
+ *  6     Clock     -      Clock
+ *  7       -     Clock      -
+ */
+void APU::ClockSequencer() {
+  if (sequencer_step_ % 2 == 0) ClockLength();
+  if (sequencer_step_ == 2 || sequencer_step_ == 6) ClockSweep();
+  if (sequencer_step_ == 7) ClockEnvelopes();
+  sequencer_step_ = (sequencer_step_ + 1) & 7;
+}
+
+void APU::ClockLength() {
+  for (SquareChannel &ch : square_) {
+    if (ch.length_enabled && ch.length > 0 && --ch.length == 0) {
+      ch.enabled = false;
+    }
+  }
+  if (wave_.length_enabled && wave_.length > 0 && --wave_.length == 0) {
+    wave_.enabled = false;
+  }
+  if (noise_.length_enabled && noise_.length > 0 && --noise_.length == 0) {
+    noise_.enabled = false;
+  }
+}
+
+void APU::ClockEnvelopes() {
+  ClockEnvelope(square_[0].envelope);
+  ClockEnvelope(square_[1].envelope);
+  ClockEnvelope(noise_.envelope);
+}
+
+void APU::ClockSweep() {
+  SquareChannel &ch = square_[0];
+  if (--ch.sweep_timer > 0) return;
+  ch.sweep_timer = ch.sweep_period ? ch.sweep_period : 8;
+  if (!ch.sweep_enabled || ch.sweep_period == 0) return;
+  const int frequency = CalculateSweep();
+  if (frequency <= 2047 && ch.sweep_shift) {
+    ch.frequency = frequency;
+    ch.shadow_frequency = frequency;
+    Register(NR13) = frequency & 0xFF;
+    Register(NR14) = (Register(NR14) & 0xF8) | (frequency >> 8);
+    // and again with the new frequency, just for the overflow check
+    CalculateSweep();
+  }
+}
+
+/**
+ * Current digital output (0-15) of a channel
+ */
+int APU::Amplitude(const int index) const {
+  switch (index) {
+    case 0:
+    case 1: {
+      const SquareChannel &ch = square_[index];
+      if (!ch.enabled) return 0;
+      const bool high = (kDutyPatterns[ch.duty] >> (7 - ch.duty_step)) & 1U;
+      return high ? ch.envelope.volume : 0;
+    }
+    case 2: {
+      if (!wave_.enabled || wave_.volume_code == 0) return 0;
+      return wave_.sample >> (wave_.volume_code - 1);
+    }
+    case 3:
+      if (!noise_.enabled) return 0;
+      return noise_.lfsr & 1U ? 0 : noise_.envelope.volume;
+    default:
+      return 0;
+  }
+}
+
+void APU::UpdateOutput(const int index, const int time) {
+  if (mode_ == APUMode::kMuted) return;
+  const int amplitude = Amplitude(index);
+  if (amplitude == output_[index]) return;
+  blip_[index].AddDelta(time, static_cast<float>(amplitude - output_[index]));
+  output_[index] = amplitude;
+}
+
+void APU::EndFrame() {
+  Sync();
+  if (mode_ == APUMode::kSynthesize) {
+    for (BlipBuffer &blip : blip_) {
+      blip.EndFrame(time_);
+      // the next frame's steps land according to the (possibly new) rate
+      blip.SetRates(kAudioClockRate, output_rate_);
+    }
+  }
+  // times are all relative to the frame start. Muted, the frequency timers
+  // never run and just stay due, so a state saved muted still plays
+  const auto rebase = [this](int &clock) {
+    clock = std::max(clock - time_, 0);
+  };
+  for (SquareChannel &ch : square_) rebase(ch.next_clock);
+  rebase(wave_.next_clock);
+  rebase(noise_.next_clock);
+  sequencer_clock_ -= time_;
+  time_ = 0;
+  run_time_ = 0;
+  // nobody's listening (or not fast enough), keep the latest output
+  if (SamplesAvailable() > kMaxBufferedSamples) {
+    DiscardSamples(SamplesAvailable() - kMaxBufferedSamples);
+  }
+}
+
+int APU::ReadSamples(int16_t *out, int frames) {
+  frames = std::min(frames, SamplesAvailable());
+  // scratch space, left until something actually reads
+  if (mix_left_.size() < static_cast<size_t>(frames)) {
+    for (std::vector<float> &samples : channel_samples_) {
+      samples.resize(kBlipCapacity);
+    }
+    mix_left_.resize(kBlipCapacity);
+    mix_right_.resize(kBlipCapacity);
+  }
+  for (int i = 0; i < 4; ++i) {
+    blip_[i].ReadSamples(channel_samples_[i].data(), frames);
+  }
+  const std::array<const float *, 4> channels = {
+      channel_samples_[0].data(), channel_samples_[1].data(),
+      channel_samples_[2].data(), channel_samples_[3].data()};
+  size_t change = 0;
+  int start = 0;
+  while (start < frames) {
+    // NR50/NR51 as of this sample
+    while (change < mix_changes_.size() &&
+           mix_changes_[change].sample <= start) {
+      mix_nr50_ = mix_changes_[change].nr50;
+      mix_nr51_ = mix_changes_[change].nr51;
+      ++change;
+    }
+    const int end = change < mix_changes_.size()
+                        ? std::min(frames, mix_changes_[change].sample)
+                        : frames;
+    // NR51 picks which side(s) each channel goes to, NR50 the volume of
+    // each side (1-8)
+    MixChannels(channels, mix_nr51_ >> 4, ((mix_nr50_ >> 4) & 0x07) + 1,
+                start, end, mix_left_.data());
+    MixChannels(channels, mix_nr51_ & 0x0F, (mix_nr50_ & 0x07) + 1, start,
+                end, mix_right_.data());
+    start = end;
+  }
+  // the output capacitor, filters out any DC offset
+  HighPass(mix_left_.data(), mix_right_.data(), frames, high_pass_left_,
+           high_pass_right_);
+  Interleave(mix_left_.data(), mix_right_.data(), frames, out);
+  // later changes are now relative to the new read position
+  mix_changes_.erase(mix_changes_.begin(), mix_changes_.begin() + change);
+  for (MixChange &c : mix_changes_) c.sample -= frames;
+  return frames;
+}
+
+void APU::DiscardSamples(int count) {
+  for (BlipBuffer &blip : blip_) blip.RemoveSamples(count);
+  size_t change = 0;
+  while (change < mix_changes_.size() && mix_changes_[change].sample <= count) {
+    mix_nr50_ = mix_changes_[change].nr50;
+    mix_nr51_ = mix_changes_[change].nr51;
+    ++change;
+  }
+  mix_changes_.erase(mix_changes_.begin(), mix_changes_.begin() + change);
+  for (MixChange &c : mix_changes_) c.sample -= count;
+}
+
+void APU::ResetFromMemory() {
+  for (uint16_t address = NR10; address <= 0xFF3F; ++address) {
+    Register(address) = mmu_.GetRegister(address);
+  }
+  powered_ = bit_check(Register(NR52), 7);
+  square_ = {};
+  wave_ = {};
+  noise_ = {};
+  sequencer_step_ = 0;
+  sequencer_clock_ = kSequencerPeriod;
+  time_ = 0;
+  run_time_ = 0;
+}
+
+void APU::ClearSamples() {
+  // writes queued up before a state was loaded belong to the old timeline
+  pending_writes_.clear();
+  for (BlipBuffer &blip : blip_) blip.Clear();
+  mix_changes_.clear();
+  mix_nr50_ = Register(NR50);
+  mix_nr51_ = Register(NR51);
+  output_.fill(0);
+  run_time_ = time_;
+  for (int i = 0; i < 4; ++i) UpdateOutput(i, time_);
 }
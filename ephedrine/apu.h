@@ -2,13 +2,241 @@
 #ifndef APU_H
 #define APU_H
 
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "blip_buffer.h"
 #include "mmu.h"
 
+// Rate the mixed stereo samples come out at
+constexpr int kAudioSampleRate = 48000;
+// The APU is clocked (and timed) at the 4MHz master clock
+constexpr int kAudioClockRate = 4194304;
+
+enum class APUMode {
+  kSynthesize,  // generate and mix the actual audio
+  kMuted        // only keep what the game can observe, no samples at all
+};
+
+struct Envelope {
+  int volume = 0;
+  int period = 0;
+  int timer = 0;
+  bool increase = false;
+  template <class Archive>
+  void serialize(Archive &archive) {
+    archive(volume, period, timer, increase);
+  }
+};
+
+// Channels 1 and 2, channel 2 just never has its sweep set up
+struct SquareChannel {
+  bool enabled = false;
+  bool dac = false;
+  int duty = 0;
+  int duty_step = 0;
+  int frequency = 0;
+  // clock (relative to the frame start) the frequency timer next expires
+  int next_clock = 0;
+  int length = 0;
+  bool length_enabled = false;
+  Envelope envelope{};
+  int sweep_period = 0;
+  int sweep_timer = 0;
+  int sweep_shift = 0;
+  bool sweep_negate = false;
+  bool sweep_enabled = false;
+  int shadow_frequency = 0;
+  template <class Archive>
+  void serialize(Archive &archive) {
+    archive(enabled, dac, duty, duty_step, frequency, next_clock, length,
+            length_enabled, envelope, sweep_period, sweep_timer, sweep_shift,
+            sweep_negate, sweep_enabled, shadow_frequency);
+  }
+};
+
+struct WaveChannel {
+  bool enabled = false;
+  bool dac = false;
+  int frequency = 0;
+  int next_clock = 0;
+  int length = 0;
+  bool length_enabled = false;
+  int volume_code = 0;
+  int position = 0;
+  uint8_t sample = 0;
+  template <class Archive>
+  void serialize(Archive &archive) {
+    archive(enabled, dac, frequency, next_clock, length, length_enabled,
+            volume_code, position, sample);
+  }
+};
+
+struct NoiseChannel {
+  bool enabled = false;
+  bool dac = false;
+  int next_clock = 0;
+  int length = 0;
+  bool length_enabled = false;
+  Envelope envelope{};
+  int clock_shift = 0;
+  int divisor_code = 0;
+  bool width_mode = false;
+  uint16_t lfsr = 0x7FFF;
+  template <class Archive>
+  void serialize(Archive &archive) {
+    archive(enabled, dac, next_clock, length, length_enabled, envelope,
+            clock_shift, divisor_code, width_mode, lfsr);
+  }
+};
+
+// An NR50/NR51 write, taking effect from sample on
+struct MixChange {
+  int sample;
+  uint8_t nr50;
+  uint8_t nr51;
+};
+
+// Everything serialize() covers, as plain data for Gameboy::Snapshot(), and
+// where the sound output was so it carries on seamlessly after a restore
+struct APUState {
+  // mix changes in the part of the frame not available to read yet, only
+  // when snapshotting mid frame. More than this and the last ones merge
+  static constexpr int kMaxPendingMixChanges = 4;
+  std::array<uint8_t, 0x30> registers;
+  bool powered;
+  std::array<SquareChannel, 2> square;
+  WaveChannel wave;
+  NoiseChannel noise;
+  int sequencer_step;
+  int sequencer_clock;
+  int time;
+  std::array<BlipBuffer::State, 4> blip;
+  std::array<int, 4> output;
+  uint8_t mix_nr50;
+  uint8_t mix_nr51;
+  int pending_mix_changes;
+  std::array<MixChange, kMaxPendingMixChanges> mix_changes;
+  float high_pass_left;
+  float high_pass_right;
+};
+
+/**
+ * The four sound channels, the frame sequencer driving their length
+ * counters, envelopes and sweep, and the NR50/NR51 mixer.
+ *
+ * The APU is run lazily. AddCycles() just moves time on, and register
+ * writes are only queued up along with the clock they happened at. The
+ * whole frame's audio is then generated in one go at the end of the frame,
+ * replaying the writes at the right times, or earlier if a register read
+ * needs things up to date. Running a channel only does work when its
+ * frequency timer expires, and only changes in its output level are
+ * recorded, as steps into the channel's BlipBuffer.
+ *
+ * Muted, nothing is generated. Register writes, length counters, sweep,
+ * envelopes, the channel enable bits and wave RAM all still behave, as a
+ * game can see those (eg. polling NR52 to wait for a sound to finish), but
+ * the frequency timers never run and ReadSamples() never has anything.
+ */
 class APU {
  public:
-  APU(MMU& mmu);
+  explicit APU(MMU &mmu, APUMode mode = APUMode::kSynthesize);
+  // A copy of other that runs on mmu instead, see Gameboy::Clone()
+  APU(const APU &other, MMU &mmu);
+  void AddCycles(int cycles) { time_ += cycles; }
+  // Sound registers and wave RAM (0xFF10 - 0xFF3F) as the CPU sees them
+  uint8_t ReadRegister(uint16_t address);
+  void WriteRegister(uint16_t address, uint8_t value) {
+    pending_writes_.push_back(RegisterWrite{time_, address, value});
+  }
+  // Apply any queued writes and run the channels up to now
+  void Sync();
+  // Catch up and make everything generated so far available to read
+  void EndFrame();
+  int SamplesAvailable() const { return blip_[0].SamplesAvailable(); }
+  // Nudge the rate samples are generated at (nominally kAudioSampleRate),
+  // eg. to keep a host audio buffer from draining or filling up. Takes
+  // effect from the next frame on
+  void SetOutputRate(double sample_rate) { output_rate_ = sample_rate; }
+  // Mix up to frames stereo sample pairs into out (interleaved left/right),
+  // returns how many were read
+  int ReadSamples(int16_t *out, int frames);
+  // Drop anything generated but not read yet (or still queued up), eg. after
+  // loading a state
+  void ClearSamples();
+  APUMode GetMode() const { return mode_; }
+  // For a state from before there was an APU: the registers as mmu has
+  // them, and every channel silent until it's triggered again
+  void ResetFromMemory();
+  // Call Sync() first, queued writes aren't part of the state
+  void Snapshot(APUState &state) const;
+  // Anything generated but not read yet is dropped, what comes after it
+  // carries on from the snapshot as if nothing happened
+  void Restore(const APUState &state);
+  template <class Archive>
+  void serialize(Archive &archive) {
+    archive(registers_, powered_, square_, wave_, noise_, sequencer_step_,
+            sequencer_clock_, time_);
+  }
 
  private:
-  MMU& mmu_;
+  // Anything left unread gets dropped past this many samples
+  static constexpr int kMaxBufferedSamples = 4096;
+  // Music drivers write in bursts, there's rarely more than this a frame
+  static constexpr size_t kPendingWritesReserve = 512;
+  struct RegisterWrite {
+    int time;
+    uint16_t address;
+    uint8_t value;
+  };
+  MMU &mmu_;
+  const APUMode mode_;
+  uint8_t &Register(uint16_t address) { return registers_[address - 0xFF10]; }
+  void ApplyWrite(uint16_t address, uint8_t value);
+  void RunUntil(int end);
+  void RunSquare(int index, int end);
+  void RunWave(int end);
+  void RunNoise(int end);
+  void ClockSequencer();
+  void ClockLength();
+  void ClockEnvelopes();
+  void ClockSweep();
+  int CalculateSweep();
+  void TriggerSquare(int index);
+  void TriggerWave();
+  void TriggerNoise();
+  void PowerOff();
+  // Record a channel's new output level, if it's changed
+  void UpdateOutput(int index, int time);
+  int Amplitude(int index) const;
+  void DiscardSamples(int count);
+  // 0xFF10 - 0xFF3F
+  std::array<uint8_t, 0x30> registers_{};
+  bool powered_ = true;
+  std::array<SquareChannel, 2> square_{};
+  WaveChannel wave_{};
+  NoiseChannel noise_{};
+  // 512Hz frame sequencer
+  int sequencer_step_ = 0;
+  int sequencer_clock_ = 0;
+  // clocks since the start of the current frame, and how far the channels
+  // have actually been run
+  int time_ = 0;
+  int run_time_ = 0;
+  // written since the channels were last run, in order
+  std::vector<RegisterWrite> pending_writes_{};
+  // output
+  double output_rate_ = kAudioSampleRate;
+  std::array<BlipBuffer, 4> blip_;
+  std::array<int, 4> output_{};
+  std::array<std::vector<float>, 4> channel_samples_{};
+  std::vector<float> mix_left_{};
+  std::vector<float> mix_right_{};
+  std::vector<MixChange> mix_changes_{};
+  uint8_t mix_nr50_ = 0;
+  uint8_t mix_nr51_ = 0;
+  float high_pass_left_ = 0;
+  float high_pass_right_ = 0;
 };
 #endif
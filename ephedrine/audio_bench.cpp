@@ -0,0 +1,245 @@
+#include "audio_bench.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <limits>
+#include <string>
+
+#include "gb.h"
+#include "simd.h"
+
+namespace {
+// Runs of each, the best counts. Anything else running only ever slows one
+// down
+constexpr int kRuns = 5;
+// Gameboy::max_cycles_per_vertical_refresh
+constexpr double kFrameCycles = 70224;
+
+// Seconds to run frames of cart in mode, rendering nothing
+double TimeFrames(std::vector<uint8_t> &cart, const APUMode mode,
+                  const int frames) {
+  // unnamed, so there's no battery RAM written
+  Gameboy gb(cart, std::string{}, mode);
+  gb.ppu.SetRenderInterval(0);
+  std::vector<int16_t> samples(16384 * 2);
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < frames; ++i) {
+    gb.Tick(gb.max_cycles_per_vertical_refresh);
+    gb.apu.ReadSamples(samples.data(), 16384);
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+constexpr double kPi = 3.14159265358979323846;
+// Samples the spectrum's taken over, after skipping the first few frames
+constexpr size_t kSpectrumSize = 65536;
+constexpr size_t kSpectrumSkip = 8192;
+// Frames of the standalone APU timed for throughput
+constexpr int kSynthesisFrames = 20000;
+// Square wave frequency registers: 1049, 4096 and 16384 Hz
+constexpr std::array<int, 3> kTestFrequencies = {1923, 2016, 2040};
+constexpr std::array<double, 2> kTestRates = {48000, 44100};
+
+// In place radix 2 FFT, size a power of two
+void FFT(std::vector<std::complex<double>> &a) {
+  const size_t n = a.size();
+  for (size_t i = 1, j = 0; i < n; ++i) {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) std::swap(a[i], a[j]);
+  }
+  for (size_t length = 2; length <= n; length <<= 1) {
+    const double angle = -2 * kPi / static_cast<double>(length);
+    const std::complex<double> step(std::cos(angle), std::sin(angle));
+    for (size_t i = 0; i < n; i += length) {
+      std::complex<double> w(1);
+      for (size_t j = 0; j < length / 2; ++j) {
+        const std::complex<double> u = a[i + j];
+        const std::complex<double> v = a[i + j + length / 2] * w;
+        a[i + j] = u + v;
+        a[i + j + length / 2] = u - v;
+        w *= step;
+      }
+    }
+  }
+}
+
+// Energy that isn't at a harmonic of f0 relative to the energy that is, in
+// dB, over a Hann windowed stretch of samples
+double AliasDb(const std::vector<double> &samples, const double f0,
+               const double rate) {
+  std::vector<std::complex<double>> spectrum(kSpectrumSize);
+  for (size_t i = 0; i < kSpectrumSize; ++i) {
+    const double window =
+        0.5 - 0.5 * std::cos(2 * kPi * static_cast<double>(i) /
+                             (kSpectrumSize - 1));
+    spectrum[i] = samples[kSpectrumSkip + i] * window;
+  }
+  FFT(spectrum);
+  const double bin_hz = rate / kSpectrumSize;
+  double harmonics = 0;
+  double aliases = 0;
+  // the first few bins are DC, and the window's leakage from it
+  for (size_t k = 4; k < kSpectrumSize / 2; ++k) {
+    const double frequency = static_cast<double>(k) * bin_hz;
+    const double harmonic = frequency / f0;
+    const double power = std::norm(spectrum[k]);
+    if (std::abs(harmonic - std::round(harmonic)) * f0 < 4 * bin_hz) {
+      harmonics += power;
+    } else {
+      aliases += power;
+    }
+  }
+  return 10 * std::log10(aliases / harmonics);
+}
+
+// Left channel of a 50% square from channel 2, synthesised at rate
+std::vector<double> SynthesizeSquare(const int frequency, const double rate) {
+  MMU mmu;
+  APU apu(mmu);
+  apu.SetOutputRate(rate);
+  apu.EndFrame();
+  apu.WriteRegister(NR52, 0x80);
+  apu.WriteRegister(NR50, 0x77);
+  apu.WriteRegister(NR51, 0x22);
+  apu.WriteRegister(NR21, 0x80);
+  apu.WriteRegister(NR22, 0xF0);
+  apu.WriteRegister(NR23, frequency & 0xFF);
+  apu.WriteRegister(NR24, 0x80 | (frequency >> 8));
+  std::vector<int16_t> buffer(16384);
+  std::vector<double> left;
+  while (left.size() < kSpectrumSkip + kSpectrumSize) {
+    apu.AddCycles(static_cast<int>(kFrameCycles));
+    apu.EndFrame();
+    const int count = apu.ReadSamples(buffer.data(), 8192);
+    for (int i = 0; i < count; ++i) left.push_back(buffer[i * 2]);
+  }
+  return left;
+}
+
+// The same square point sampled, what it'd sound like without the blip
+// buffers
+std::vector<double> PointSampleSquare(const double f0, const double rate) {
+  std::vector<double> samples(kSpectrumSkip + kSpectrumSize);
+  for (size_t i = 0; i < samples.size(); ++i) {
+    const double phase =
+        std::fmod(static_cast<double>(i) * f0 / rate, 1.0);
+    samples[i] = phase < 0.5 ? 1 : -1;
+  }
+  return samples;
+}
+
+// Seconds to synthesise and mix kSynthesisFrames frames
+double TimeSynthesis(APU &apu, std::vector<int16_t> &buffer) {
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kSynthesisFrames; ++i) {
+    apu.AddCycles(static_cast<int>(kFrameCycles));
+    apu.EndFrame();
+    apu.ReadSamples(buffer.data(), 8192);
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+}  // namespace
+
+bool BenchAudio(std::vector<uint8_t> &cart, const int frames) {
+  if (frames <= 0) return false;
+  double muted = std::numeric_limits<double>::max();
+  double synthesized = std::numeric_limits<double>::max();
+  // interleaved, so they see the same machine
+  for (int run = 0; run < kRuns; ++run) {
+    muted = std::min(muted, TimeFrames(cart, APUMode::kMuted, frames));
+    synthesized = std::min(synthesized,
+                           TimeFrames(cart, APUMode::kSynthesize, frames));
+  }
+  const double muted_us = muted / frames * 1e6;
+  const double synthesized_us = synthesized / frames * 1e6;
+  const double audio_us = std::max(synthesized_us - muted_us, 0.0);
+  const double frame_us = 1e6 * kFrameCycles / kAudioClockRate;
+  const double percent = audio_us / frame_us * 100;
+  std::printf(
+      "audio muted %.1f us/frame synthesized %.1f us/frame: sound %.1f "
+      "us/frame, %.1f%% of emulating a frame, %.2f%% of a frame at full "
+      "speed\n",
+      muted_us, synthesized_us, audio_us, audio_us / muted_us * 100,
+      percent);
+  return percent <= kAudioBudgetPercent;
+}
+
+bool BenchSynthesis() {
+#ifdef EPHEDRINE_SSE2
+  const char *const mixer = "SSE2";
+#else
+  const char *const mixer = "plain C++";
+#endif
+  MMU mmu;
+  APU apu(mmu);
+  std::vector<int16_t> buffer(16384);
+  // every channel as busy as it gets: high pitched squares, wave and noise
+  apu.WriteRegister(NR52, 0x80);
+  apu.WriteRegister(NR50, 0x77);
+  apu.WriteRegister(NR51, 0xFF);
+  apu.WriteRegister(NR11, 0x80);
+  apu.WriteRegister(NR12, 0xF0);
+  apu.WriteRegister(NR13, 0xF0);
+  apu.WriteRegister(NR14, 0x87);
+  apu.WriteRegister(NR21, 0x80);
+  apu.WriteRegister(NR22, 0xF0);
+  apu.WriteRegister(NR23, 0xE0);
+  apu.WriteRegister(NR24, 0x87);
+  apu.WriteRegister(NR30, 0x80);
+  apu.WriteRegister(NR32, 0x20);
+  apu.WriteRegister(NR33, 0x80);
+  apu.WriteRegister(NR34, 0x87);
+  for (int i = 0; i < 16; ++i) {
+    apu.WriteRegister(static_cast<uint16_t>(0xFF30 + i), (i * 0x11) ^ 0x5A);
+  }
+  apu.WriteRegister(NR42, 0xF0);
+  apu.WriteRegister(NR43, 0x10);
+  apu.WriteRegister(NR44, 0x80);
+  const double busy = TimeSynthesis(apu, buffer);
+  // powered off and on again, every channel's silent
+  apu.WriteRegister(NR52, 0x00);
+  apu.WriteRegister(NR52, 0x80);
+  apu.WriteRegister(NR51, 0xFF);
+  const double silent = TimeSynthesis(apu, buffer);
+  const double busy_us = busy / kSynthesisFrames * 1e6;
+  std::printf(
+      "synthesis (%s mixer): all channels %.1f us/frame, %.0fx full speed, "
+      "%.1f Msamples/s; mixing only %.1f us/frame\n",
+      mixer, busy_us, kSynthesisFrames * kFrameCycles / kAudioClockRate / busy,
+      kSynthesisFrames * kAudioSampleRate * kFrameCycles / kAudioClockRate /
+          busy / 1e6,
+      silent / kSynthesisFrames * 1e6);
+
+  bool passed = true;
+  std::printf("%-27s", "alias energy, 50% square");
+  for (const int frequency : kTestFrequencies) {
+    std::printf("%6.0f Hz", 131072.0 / (2048 - frequency));
+  }
+  std::printf("\n");
+  for (const double rate : kTestRates) {
+    std::printf("  %5.0f Hz %-16s", rate, "band-limited");
+    for (const int frequency : kTestFrequencies) {
+      const double f0 = 131072.0 / (2048 - frequency);
+      const double db = AliasDb(SynthesizeSquare(frequency, rate), f0, rate);
+      passed = passed && db <= kMaxAliasDb;
+      std::printf("%6.1f dB", db);
+    }
+    std::printf("\n  %5.0f Hz %-16s", rate, "point sampled");
+    for (const int frequency : kTestFrequencies) {
+      const double f0 = 131072.0 / (2048 - frequency);
+      std::printf("%6.1f dB", AliasDb(PointSampleSquare(f0, rate), f0, rate));
+    }
+    std::printf("\n");
+  }
+  return passed;
+}
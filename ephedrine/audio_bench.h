@@ -0,0 +1,31 @@
+#ifndef AUDIO_BENCH_H
+#define AUDIO_BENCH_H
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * What sound costs, for ephedrine-headless --bench-audio. Not part of the
+ * core, nothing but the headless frontend needs it.
+ */
+
+// The most synthesising and mixing a frame's sound may take, as a
+// percentage of the time a frame lasts at full speed (1/59.73 s)
+constexpr double kAudioBudgetPercent = 2.0;
+
+// Runs cart for frames frames muted and then synthesising (reading the
+// samples every frame like a frontend would), best of a few runs each, and
+// prints the difference. false if it's over kAudioBudgetPercent
+bool BenchAudio(std::vector<uint8_t> &cart, int frames);
+
+// How much worse than the harmonics aliasing may get, see BenchSynthesis()
+constexpr double kMaxAliasDb = -30.0;
+
+// The APU on its own, no game: how fast it synthesises with all four
+// channels busy and with them all silent (so just mixing), and how much
+// aliasing a square wave gets at 48 and 44.1kHz, against point sampling.
+// Says which mixer it's timing, so the SSE2 and plain builds can be
+// compared. false if aliasing's over kMaxAliasDb anywhere
+bool BenchSynthesis();
+
+#endif  // !AUDIO_BENCH_H
@@ -0,0 +1,46 @@
+#include "audio_ring.h"
+
+#include <algorithm>
+
+namespace {
+size_t RoundUpToPowerOfTwo(const size_t value) {
+  size_t result = 1;
+  while (result < value) result <<= 1;
+  return result;
+}
+}  // namespace
+
+AudioRing::AudioRing(const size_t frames)
+    : mask_(RoundUpToPowerOfTwo(frames) - 1), samples_((mask_ + 1) * 2, 0) {}
+
+size_t AudioRing::Write(const int16_t *samples, size_t frames) {
+  const size_t write = write_.load(std::memory_order_relaxed);
+  const size_t read = read_.load(std::memory_order_acquire);
+  frames = std::min(frames, Capacity() - (write - read));
+  // in at most two pieces, up to the end of the buffer then from the start
+  const size_t start = write & mask_;
+  const size_t first = std::min(frames, Capacity() - start);
+  std::copy(samples, samples + first * 2, samples_.begin() + start * 2);
+  std::copy(samples + first * 2, samples + frames * 2, samples_.begin());
+  write_.store(write + frames, std::memory_order_release);
+  return frames;
+}
+
+size_t AudioRing::Read(int16_t *samples, size_t frames) {
+  const size_t read = read_.load(std::memory_order_relaxed);
+  const size_t write = write_.load(std::memory_order_acquire);
+  frames = std::min(frames, write - read);
+  const size_t start = read & mask_;
+  const size_t first = std::min(frames, Capacity() - start);
+  std::copy(samples_.begin() + start * 2,
+            samples_.begin() + (start + first) * 2, samples);
+  std::copy(samples_.begin(), samples_.begin() + (frames - first) * 2,
+            samples + first * 2);
+  read_.store(read + frames, std::memory_order_release);
+  return frames;
+}
+
+size_t AudioRing::Fill() const {
+  return write_.load(std::memory_order_acquire) -
+         read_.load(std::memory_order_acquire);
+}
@@ -0,0 +1,39 @@
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Single producer, single consumer ring of interleaved stereo samples, for
+ * handing the APU's output from the emulation thread to the audio callback.
+ * Neither side ever blocks or takes a lock: the producer only moves the
+ * write position and the consumer only the read position, so both calls are
+ * wait-free. Positions just count up and get wrapped with a mask, which is
+ * why the capacity is rounded up to a power of two.
+ */
+class AudioRing {
+ public:
+  explicit AudioRing(size_t frames);
+  AudioRing(const AudioRing &) = delete;
+  AudioRing &operator=(const AudioRing &) = delete;
+  // Producer: copy in up to frames stereo pairs, returns how many fit
+  size_t Write(const int16_t *samples, size_t frames);
+  // Consumer: copy out up to frames stereo pairs, returns how many there were
+  size_t Read(int16_t *samples, size_t frames);
+  // Stereo pairs waiting to be read, the other side may have moved on by
+  // the time it returns
+  size_t Fill() const;
+  size_t Capacity() const { return mask_ + 1; }
+
+ private:
+  size_t mask_;
+  std::vector<int16_t> samples_;
+  // kept on separate cache lines so the two threads don't fight over them
+  alignas(64) std::atomic<size_t> read_{0};
+  alignas(64) std::atomic<size_t> write_{0};
+};
+
+#endif  // !AUDIO_RING_H
@@ -0,0 +1,263 @@
+#include "batch_runner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#include "lockstep_batch.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+namespace {
+// Frames a session is stepped for each time it comes round. Long enough
+// that taking it from the queue costs nothing, short enough that a worker
+// left holding the last few sessions doesn't keep the rest waiting long
+constexpr int kSliceFrames = 16;
+
+void PinToCore(std::thread &thread, const int core) {
+#if defined(__linux__)
+  cpu_set_t cores;
+  CPU_ZERO(&cores);
+  CPU_SET(core % CPU_SETSIZE, &cores);
+  pthread_setaffinity_np(thread.native_handle(), sizeof(cores), &cores);
+#elif defined(_WIN32)
+  SetThreadAffinityMask(thread.native_handle(), DWORD_PTR{1} << (core % 64));
+#else
+  // eg. macOS, which only takes hints about this
+  (void)thread;
+  (void)core;
+#endif
+}
+}  // namespace
+
+BatchRunner::BatchRunner(int threads, const bool pin_threads,
+                         const bool lockstep)
+    : lockstep_(lockstep) {
+  const int cores =
+      std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+  if (threads <= 0) threads = cores;
+  for (int i = 0; i < threads; ++i) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  for (int i = 0; i < threads; ++i) {
+    threads_.emplace_back(&BatchRunner::Work, this, i);
+    if (pin_threads) PinToCore(threads_.back(), i % cores);
+  }
+}
+
+BatchRunner::~BatchRunner() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  start_cv_.notify_all();
+  for (std::thread &thread : threads_) thread.join();
+}
+
+int BatchRunner::Add(std::unique_ptr<Gameboy> gb, InputFeed input,
+                     OutputSink output, const int thread) {
+  Session session;
+  session.gb = std::move(gb);
+  session.input = std::move(input);
+  session.output = std::move(output);
+  session.thread = thread < 0 ? kAnyThread : thread % Threads();
+  sessions_.push_back(std::move(session));
+  return Sessions() - 1;
+}
+
+BatchStats BatchRunner::Run(const int frames) {
+  const auto start = std::chrono::steady_clock::now();
+  frames_ = 0;
+  instructions_ = 0;
+  vectorized_ = 0;
+  int queued = 0;
+  int leader = -1;
+  for (int i = 0; i < Sessions(); ++i) {
+    Session &session = sessions_[i];
+    session.group.clear();
+    if (session.stopped || frames <= 0) continue;
+    session.target = session.frames_run + frames;
+    if (lockstep_ && session.thread == kAnyThread) {
+      // only the leader's queued, it runs the rest
+      if (leader >= 0 && static_cast<int>(sessions_[leader].group.size()) <
+                             LockstepBatch::kLanes) {
+        sessions_[leader].group.push_back(i);
+        continue;
+      }
+      leader = i;
+      session.group.push_back(i);
+    }
+    if (session.thread == kAnyThread) {
+      Queue(next_worker_, i);
+      next_worker_ = (next_worker_ + 1) % Threads();
+    } else {
+      Queue(session.thread, i);
+    }
+    ++queued;
+  }
+  if (queued == 0) return {};
+  remaining_ = queued;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    busy_workers_ = Threads();
+    ++generation_;
+  }
+  start_cv_.notify_all();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return busy_workers_ == 0; });
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return {frames_.load(), std::chrono::duration<double>(end - start).count(),
+          instructions_.load(), vectorized_.load()};
+}
+
+void BatchRunner::Work(const int worker) {
+  uint64_t generation = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    start_cv_.wait(lock,
+                   [&] { return quit_ || generation_ != generation; });
+    if (quit_) return;
+    generation = generation_;
+    lock.unlock();
+    int session = 0;
+    while (remaining_.load(std::memory_order_acquire) > 0) {
+      // read first, so a session queued after Take() has looked is noticed
+      const uint64_t queued = work_queued_.load(std::memory_order_acquire);
+      if (!Take(worker, session)) {
+        // whatever's left is being run (or is pinned) elsewhere, sleep
+        // until some comes free or it's all done
+        std::unique_lock<std::mutex> idle(idle_mutex_);
+        work_cv_.wait(idle, [&] {
+          return work_queued_.load(std::memory_order_acquire) != queued ||
+                 remaining_.load(std::memory_order_acquire) == 0;
+        });
+        continue;
+      }
+      if (!Step(sessions_[session])) {
+        Queue(worker, session);
+      } else if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::lock_guard<std::mutex> idle(idle_mutex_);
+        work_cv_.notify_all();
+      }
+    }
+    lock.lock();
+    if (--busy_workers_ == 0) done_cv_.notify_all();
+  }
+}
+
+bool BatchRunner::Take(const int worker, int &session) {
+  {
+    Worker &own = *workers_[worker];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    for (std::deque<int> *queue : {&own.pinned, &own.shared}) {
+      if (!queue->empty()) {
+        session = queue->front();
+        queue->pop_front();
+        return true;
+      }
+    }
+  }
+  // steal, starting from the next worker along so thieves spread out
+  for (int i = 1; i < Threads(); ++i) {
+    Worker &victim = *workers_[(worker + i) % Threads()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.shared.empty()) {
+      session = victim.shared.back();
+      victim.shared.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void BatchRunner::Queue(const int worker, const int session) {
+  Worker &owner = *workers_[worker];
+  bool stealable = false;
+  {
+    std::lock_guard<std::mutex> lock(owner.mutex);
+    if (sessions_[session].thread == kAnyThread) {
+      owner.shared.push_back(session);
+    } else {
+      owner.pinned.push_back(session);
+    }
+    // a worker putting back the one session it's running takes it straight
+    // back out, there's only something for anybody else if there's more
+    stealable = !owner.shared.empty() &&
+                owner.shared.size() + owner.pinned.size() > 1;
+  }
+  if (!stealable) return;
+  {
+    std::lock_guard<std::mutex> idle(idle_mutex_);
+    work_queued_.fetch_add(1, std::memory_order_release);
+  }
+  work_cv_.notify_one();
+}
+
+bool BatchRunner::Step(Session &session) {
+  if (!session.group.empty()) return StepLockstep(session);
+  Gameboy &gb = *session.gb;
+  int ran = 0;
+  while (ran < kSliceFrames && session.frames_run < session.target) {
+    const int frame = session.frames_run;
+    if (session.input) gb.HandleInput(session.input(frame));
+    gb.Tick(gb.max_cycles_per_vertical_refresh);
+    ++session.frames_run;
+    ++ran;
+    if (session.output && !session.output(gb, frame)) {
+      session.stopped = true;
+      break;
+    }
+  }
+  frames_.fetch_add(ran, std::memory_order_relaxed);
+  return session.stopped || session.frames_run >= session.target;
+}
+
+bool BatchRunner::StepLockstep(Session &leader) {
+  std::vector<Gameboy *> lanes;
+  std::vector<Session *> running;
+  int ran = 0;
+  int64_t instructions = 0;
+  int64_t vectorized = 0;
+  for (int slice = 0; slice < kSliceFrames; ++slice) {
+    lanes.clear();
+    running.clear();
+    for (const int i : leader.group) {
+      Session &session = sessions_[i];
+      if (session.stopped || session.frames_run >= session.target) continue;
+      if (session.input) {
+        session.gb->HandleInput(session.input(session.frames_run));
+      }
+      lanes.push_back(session.gb.get());
+      running.push_back(&session);
+    }
+    if (running.empty()) break;
+    LockstepBatch batch(lanes);
+    batch.RunFrame();
+    instructions += batch.Stats().instructions;
+    vectorized += batch.Stats().vectorized;
+    for (Session *session : running) {
+      const int frame = session->frames_run++;
+      ++ran;
+      if (session->output && !session->output(*session->gb, frame)) {
+        session->stopped = true;
+      }
+    }
+  }
+  frames_.fetch_add(ran, std::memory_order_relaxed);
+  instructions_.fetch_add(instructions, std::memory_order_relaxed);
+  vectorized_.fetch_add(vectorized, std::memory_order_relaxed);
+  for (const int i : leader.group) {
+    const Session &session = sessions_[i];
+    if (!session.stopped && session.frames_run < session.target) return false;
+  }
+  return true;
+}
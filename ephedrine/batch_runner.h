@@ -0,0 +1,136 @@
+#ifndef BATCH_RUNNER_H
+#define BATCH_RUNNER_H
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gb.h"
+
+struct BatchStats {
+  // frames run across every session, and how long it took
+  int64_t frames = 0;
+  double seconds = 0;
+  // lockstep only: instructions run, and how many of those ran across
+  // sessions at once
+  int64_t instructions = 0;
+  int64_t vectorized = 0;
+  double FramesPerSecond() const {
+    return seconds > 0 ? static_cast<double>(frames) / seconds : 0;
+  }
+};
+
+/**
+ * Runs lots of independent consoles (sessions) at once across a pool of
+ * worker threads, eg. for replaying regression movies or automated play
+ * testing. Each worker keeps a queue of the sessions it's running and steps
+ * them round robin, a few frames at a time. A worker that runs out steals
+ * from the back of somebody else's queue, so the load evens out on its own
+ * however long each session ends up running for. Sessions can be pinned to
+ * a worker, and workers to a core, for anyone who wants to control exactly
+ * where everything runs.
+ * Nothing is shared between sessions, every one owns its Gameboy outright.
+ *
+ * Experimental: with lockstep, unpinned sessions are run in groups of up to
+ * LockstepBatch::kLanes, a frame at a time, with whatever instructions they
+ * run together run across them at once (see LockstepBatch). Each ends up
+ * exactly where it would have anyway.
+ */
+class BatchRunner {
+ public:
+  // Buttons to hold for a session's next frame, as passed to HandleInput()
+  using InputFeed = std::function<std::array<uint8_t, 2>(int frame)>;
+  // Called after each frame a session runs, on whichever worker ran it.
+  // Return false to stop that session for good. Sessions that synthesize
+  // sound should read it here, the APU only buffers a few frames
+  using OutputSink = std::function<bool(Gameboy &gb, int frame)>;
+  static constexpr int kAnyThread = -1;
+
+  // threads <= 0 starts one per hardware thread. With pin_threads worker n
+  // only runs on core n (wrapping round), where the platform allows it
+  explicit BatchRunner(int threads = 0, bool pin_threads = false,
+                       bool lockstep = false);
+  BatchRunner(const BatchRunner &) = delete;
+  BatchRunner &operator=(const BatchRunner &) = delete;
+  ~BatchRunner();
+  // Returns the session's index. thread pins it to one worker (wrapping
+  // round), otherwise it starts on the next worker in turn and can be
+  // stolen. Not to be called while Run() is going
+  int Add(std::unique_ptr<Gameboy> gb, InputFeed input = nullptr,
+          OutputSink output = nullptr, int thread = kAnyThread);
+  // Run every session that hasn't stopped for up to frames more frames,
+  // blocking until they're all done
+  BatchStats Run(int frames);
+  Gameboy &Get(const int session) { return *sessions_[session].gb; }
+  int FramesRun(const int session) const {
+    return sessions_[session].frames_run;
+  }
+  // Whether the session's output sink has stopped it
+  bool Stopped(const int session) const { return sessions_[session].stopped; }
+  int Sessions() const { return static_cast<int>(sessions_.size()); }
+  int Threads() const { return static_cast<int>(threads_.size()); }
+
+ private:
+  // Cache line aligned, they're written by whichever worker is running them
+  struct alignas(64) Session {
+    std::unique_ptr<Gameboy> gb;
+    InputFeed input;
+    OutputSink output;
+    int thread = kAnyThread;
+    int frames_run = 0;
+    // frames_run to stop at in the current Run()
+    int target = 0;
+    bool stopped = false;
+    // the sessions this one leads in lockstep, itself included, for this
+    // Run(). Empty when it runs on its own (or someone else leads it)
+    std::vector<int> group;
+  };
+  // Each worker's queue. Pinned sessions are kept apart so nobody else can
+  // steal them
+  struct Worker {
+    std::mutex mutex;
+    std::deque<int> pinned;
+    std::deque<int> shared;
+  };
+  void Work(int worker);
+  // Next session for worker to step, its own first and then anybody's
+  bool Take(int worker, int &session);
+  // Wakes an idle worker if the session's one the owner can't get to
+  // straight away
+  void Queue(int worker, int session);
+  // Step up to kSliceFrames frames, true once the session's done for now
+  bool Step(Session &session);
+  bool StepLockstep(Session &leader);
+  std::vector<Session> sessions_{};
+  std::vector<std::unique_ptr<Worker>> workers_{};
+  std::vector<std::thread> threads_{};
+  int next_worker_ = 0;
+  bool lockstep_ = false;
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  // bumped to start each Run()
+  uint64_t generation_ = 0;
+  int busy_workers_ = 0;
+  bool quit_ = false;
+  // Workers with nothing to take wait here for a session to come free or
+  // the Run() to finish, rather than going round every queue again.
+  // work_queued_ is bumped (under idle_mutex_) whenever one does come free
+  std::mutex idle_mutex_;
+  std::condition_variable work_cv_;
+  std::atomic<uint64_t> work_queued_{0};
+  // sessions still to finish in this Run()
+  std::atomic<int> remaining_{0};
+  std::atomic<int64_t> frames_{0};
+  std::atomic<int64_t> instructions_{0};
+  std::atomic<int64_t> vectorized_{0};
+};
+
+#endif  // !BATCH_RUNNER_H
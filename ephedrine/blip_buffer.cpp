@@ -0,0 +1,132 @@
+#include "blip_buffer.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+namespace {
+constexpr double kPi = 3.14159265358979323846;
+// Cutoff as a fraction of the output rate, a little under Nyquist
+constexpr double kCutoff = 0.45;
+
+/**
+ * Impulse response of the band-limiting filter, a Blackman windowed sinc.
+ * x is in output samples relative to the step
+ */
+double Impulse(const double x) {
+  constexpr double half_width = BlipBuffer::kTaps / 2 - 0.5;
+  if (std::abs(x) >= half_width) return 0;
+  const double window = 0.42 + 0.5 * std::cos(kPi * x / half_width) +
+                        0.08 * std::cos(2 * kPi * x / half_width);
+  const double y = 2 * kCutoff * x;
+  const double sinc = y == 0 ? 1 : std::sin(kPi * y) / (kPi * y);
+  return 2 * kCutoff * sinc * window;
+}
+
+/**
+ * For a step landing phase / kPhases of the way into a sample, how much of
+ * it each of the kTaps output samples gets. The buffer is integrated on the
+ * way out, so these are the differences of the band-limited step, ie. the
+ * filter response integrated over each output sample. The step itself is
+ * centred kTaps / 2 samples in
+ */
+std::array<float, BlipBuffer::kPhases * BlipBuffer::kTaps> BuildKernels() {
+  constexpr int kSteps = 32;  // Simpson's rule intervals per sample
+  std::array<float, BlipBuffer::kPhases * BlipBuffer::kTaps> kernels{};
+  for (int phase = 0; phase < BlipBuffer::kPhases; ++phase) {
+    const double fraction = static_cast<double>(phase) / BlipBuffer::kPhases;
+    double taps[BlipBuffer::kTaps];
+    double total = 0;
+    for (int i = 0; i < BlipBuffer::kTaps; ++i) {
+      const double end = i - BlipBuffer::kTaps / 2 - fraction + 1;
+      const double start = end - 1;
+      const double h = 1.0 / kSteps;
+      double sum = Impulse(start) + Impulse(end);
+      for (int k = 1; k < kSteps; ++k) {
+        sum += Impulse(start + k * h) * (k % 2 ? 4 : 2);
+      }
+      taps[i] = sum * h / 3;
+      total += taps[i];
+    }
+    // every step has to add up to exactly its delta once integrated
+    for (int i = 0; i < BlipBuffer::kTaps; ++i) {
+      kernels[phase * BlipBuffer::kTaps + i] =
+          static_cast<float>(taps[i] / total);
+    }
+  }
+  return kernels;
+}
+}  // namespace
+
+BlipBuffer::BlipBuffer(const int max_samples)
+    : buffer_(max_samples + kTaps, 0.0F) {
+  static const auto kernels = BuildKernels();
+  kernels_ = kernels.data();
+}
+
+void BlipBuffer::SetRates(const double clock_rate, const double sample_rate) {
+  factor_ = static_cast<uint64_t>(
+      std::llround(sample_rate / clock_rate * 4294967296.0));
+}
+
+void BlipBuffer::EndFrame(const uint32_t time) {
+  offset_ += time * factor_;
+  // nobody's reading, keep the newest samples rather than overflowing
+  const int overflow = SamplesAvailable() + kTaps -
+                       static_cast<int>(buffer_.size());
+  if (overflow > 0) RemoveSamples(overflow);
+}
+
+int BlipBuffer::ReadSamples(float *out, int count) {
+  count = std::min(count, SamplesAvailable());
+  double sum = integrator_;
+  for (int i = 0; i < count; ++i) {
+    sum += buffer_[i];
+    out[i] = static_cast<float>(sum);
+  }
+  integrator_ = sum;
+  Shift(count);
+  return count;
+}
+
+int BlipBuffer::RemoveSamples(int count) {
+  count = std::min(count, SamplesAvailable());
+  // the level still has to carry on from where the removed samples leave it
+  for (int i = 0; i < count; ++i) integrator_ += buffer_[i];
+  Shift(count);
+  return count;
+}
+
+void BlipBuffer::Shift(const int count) {
+  if (count <= 0) return;
+  const int remaining = SamplesAvailable() - count + kTaps;
+  std::copy(buffer_.begin() + count, buffer_.begin() + count + remaining,
+            buffer_.begin());
+  std::fill(buffer_.begin() + remaining, buffer_.begin() + remaining + count,
+            0.0F);
+  offset_ -= static_cast<uint64_t>(count) << 32;
+}
+
+void BlipBuffer::SaveState(State &state) const {
+  const int available = SamplesAvailable();
+  // summed in the same order ReadSamples() would, so it comes out the same
+  double level = integrator_;
+  for (int i = 0; i < available; ++i) level += buffer_[i];
+  state.level = level;
+  state.phase = static_cast<uint32_t>(offset_);
+  std::copy_n(buffer_.begin() + available, kTaps, state.tail.begin());
+}
+
+void BlipBuffer::RestoreState(const State &state) {
+  // nothing past the tail of the last frame has been touched
+  std::fill_n(buffer_.begin(), SamplesAvailable() + kTaps, 0.0F);
+  std::copy(state.tail.begin(), state.tail.end(), buffer_.begin());
+  offset_ = state.phase;
+  integrator_ = state.level;
+}
+
+void BlipBuffer::Clear() {
+  offset_ &= 0xFFFFFFFF;
+  integrator_ = 0;
+  std::fill(buffer_.begin(), buffer_.end(), 0.0F);
+}
@@ -0,0 +1,86 @@
+#ifndef BLIP_BUFFER_H
+#define BLIP_BUFFER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "simd.h"
+
+/**
+ * Band-limited step buffer. Rather than generating a sample for every clock,
+ * the channels only report the clock at which their amplitude changes and by
+ * how much. Each change is added as a band-limited step (a windowed sinc
+ * kernel, picked by where between two output samples it lands), and the
+ * output samples are produced by integrating the buffer when read. Takes
+ * care of resampling from the clock rate to the output rate at the same
+ * time.
+ */
+class BlipBuffer {
+ public:
+  // Number of output samples a single step is spread over
+  static constexpr int kTaps = 16;  // a multiple of 4 for the SIMD path
+  // Sub-sample positions the step kernel is available at
+  static constexpr int kPhaseBits = 5;
+  static constexpr int kPhases = 1 << kPhaseBits;
+
+  explicit BlipBuffer(int max_samples);
+  void SetRates(double clock_rate, double sample_rate);
+  // Add an amplitude change at clock time (relative to the frame start)
+  void AddDelta(uint32_t time, float delta) {
+    const uint64_t fixed = offset_ + time * factor_;
+    const size_t pos = fixed >> 32;
+    const int phase = (fixed >> (32 - kPhaseBits)) & (kPhases - 1);
+    if (pos + kTaps > buffer_.size()) return;
+    const float *kernel = kernels_ + phase * kTaps;
+    float *out = &buffer_[pos];
+#ifdef EPHEDRINE_SSE2
+    const __m128 scale = _mm_set1_ps(delta);
+    for (int i = 0; i < kTaps; i += 4) {
+      const __m128 step = _mm_mul_ps(_mm_loadu_ps(kernel + i), scale);
+      _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), step));
+    }
+#else
+    for (int i = 0; i < kTaps; ++i) out[i] += kernel[i] * delta;
+#endif
+  }
+  // Sample index (from the read position) that clock time lands on
+  int SampleIndex(uint32_t time) const {
+    return static_cast<int>((offset_ + time * factor_) >> 32);
+  }
+  // End the frame at clock time. Everything before it can be read, and the
+  // next frame's times are relative to it
+  void EndFrame(uint32_t time);
+  int SamplesAvailable() const { return static_cast<int>(offset_ >> 32); }
+  // Integrate and remove up to count samples, returns how many were read
+  int ReadSamples(float *out, int count);
+  // Throw away up to count samples without reading them
+  int RemoveSamples(int count);
+  void Clear();
+  // What the buffer holds past the samples available to read: the level
+  // reading them would leave it at, where the frame starts between two
+  // samples and the ends of steps that spill into later samples
+  struct State {
+    double level;
+    uint32_t phase;
+    std::array<float, kTaps> tail;
+  };
+  void SaveState(State &state) const;
+  // Carry on from state without a click, dropping anything available
+  void RestoreState(const State &state);
+
+ private:
+  // drop count samples from the front, they've been accounted for
+  void Shift(int count);
+  // kPhases kernels of kTaps each, shared by every buffer
+  const float *kernels_;
+  // output samples per clock, 32.32 fixed point
+  uint64_t factor_ = 0;
+  // position of the frame start in output samples, 32.32 fixed point
+  uint64_t offset_ = 0;
+  double integrator_ = 0;
+  std::vector<float> buffer_{};
+};
+
+#endif  // !BLIP_BUFFER_H
@@ -15,9 +15,45 @@ CPU::CPU(MMU &mmu) : sp_(0xFFFE), mmu_(mmu) {
   cycles = 0;
 }
 
+CPU::CPU(const CPU &other, MMU &mmu)
+    : cycles(other.cycles),
+      registers_(other.registers_),
+      flags_(other.flags_),
+      sp_(other.sp_),
+      pc_(other.pc_),
+      ime_(other.ime_),
+      halted_(other.halted_),
+      mmu_(mmu),
+      halt_bug_occurred_(other.halt_bug_occurred_),
+      executed_instructions_(other.executed_instructions_) {}
+
+void CPU::Snapshot(CPUState &state) const {
+  state.cycles = cycles;
+  state.registers = registers_;
+  state.flags = flags_;
+  state.sp = sp_;
+  state.pc = pc_;
+  state.ime = ime_;
+  state.halted = halted_;
+  state.halt_bug_occurred = halt_bug_occurred_;
+}
+
+void CPU::Restore(const CPUState &state) {
+  cycles = state.cycles;
+  registers_ = state.registers;
+  flags_ = state.flags;
+  sp_ = state.sp;
+  pc_ = state.pc;
+  ime_ = state.ime;
+  halted_ = state.halted;
+  halt_bug_occurred_ = state.halt_bug_occurred;
+}
+
 void CPU::HandleInterrupts() {
-  uint8_t if_reg = mmu_.ReadByte(IF);
-  const uint8_t ie_reg = mmu_.ReadByte(IE);
+  // checked after every instruction, so straight from the registers. IF's
+  // unused upper bits read as 1 through ReadByte, do the same here
+  uint8_t if_reg = mmu_.GetRegister(IF) | 0xE0;
+  const uint8_t ie_reg = mmu_.GetRegister(IE);
 
   if (!ime_ || (if_reg & 0x1F) == 0 || (ie_reg & 0x1F) == 0)
     return; // interrupts globally disabled or nothing to handle
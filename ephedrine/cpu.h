@@ -44,12 +44,26 @@ struct Registers {
   };
 };
 
+// Everything serialize() covers, as plain data for Gameboy::Snapshot()
+struct CPUState {
+  int cycles;
+  Registers registers;
+  Flags flags;
+  uint16_t sp;
+  uint16_t pc;
+  bool ime;
+  bool halted;
+  bool halt_bug_occurred;
+};
+
 class CPU {
  public:
   // fetch decode execute
   // talk to mmu_ for memory_ access
   // returns previous opcode
   CPU(MMU& mmu);
+  // A copy of other that runs on mmu instead, see Gameboy::Clone()
+  CPU(const CPU& other, MMU& mmu);
   DecodedInstruction Execute();
   void HandleInterrupts();
   int cycles;
@@ -63,6 +77,8 @@ class CPU {
   Flags GetFlags() const { return flags_; }
   uint16_t GetPC() const { return pc_; }
   uint16_t GetSP() const { return sp_; }
+  void Snapshot(CPUState& state) const;
+  void Restore(const CPUState& state);
   template <class Archive>
   void serialize(Archive& archive) {
     archive(cycles, registers_.af, registers_.bc, registers_.de, registers_.hl,
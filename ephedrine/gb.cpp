@@ -12,25 +12,45 @@
 #include "mmu.h"
 #include "ppu.h"
 
-uint16_t Gameboy::divider_ = 0;
-std::array<uint8_t, 2> Gameboy::joypad{{0xf, 0xf}};
-
-Gameboy::Gameboy() : cpu(mmu), ppu(mmu), apu(mmu) {
+Gameboy::Gameboy(const APUMode audio) : cpu(mmu), ppu(mmu), apu(mmu, audio) {
   // no game
+  mmu.AttachPPU(&ppu);
+  mmu.AttachAPU(&apu);
 }
 
-Gameboy::Gameboy(std::vector<uint8_t> &cart, std::string game)
-    : mmu(cart), cpu(mmu), ppu(mmu), apu(mmu), game_(std::move(game)) {
-  std::ifstream ifs{game_ + ".sav", std::ios::binary};
+Gameboy::Gameboy(std::vector<uint8_t> &cart, std::string game,
+                 const APUMode audio)
+    : mmu(cart), cpu(mmu), ppu(mmu), apu(mmu, audio), game_(std::move(game)) {
+  mmu.AttachPPU(&ppu);
+  mmu.AttachAPU(&apu);
+  // a game without a name has nowhere to keep its battery RAM
+  if (game_.empty()) return;
   spdlog::get("stdout")->info("Loading {0}", game_);
+  std::ifstream ifs{game_ + ".sav", std::ios::binary};
   if (ifs) {
     mmu.LoadBufferedRAM(ifs);
   }
 }
 
+Gameboy::Gameboy(const CloneOf clone_of)
+    : mmu(clone_of.source.mmu),
+      cpu(clone_of.source.cpu, mmu),
+      ppu(clone_of.source.ppu, mmu),
+      apu(clone_of.source.apu, mmu),
+      current_screen_cycles_(clone_of.source.current_screen_cycles_),
+      timer_ticks_(clone_of.source.timer_ticks_),
+      divider_tick_cycles_(clone_of.source.divider_tick_cycles_) {
+  mmu.AttachPPU(&ppu);
+  mmu.AttachAPU(&apu);
+}
+
+std::unique_ptr<Gameboy> Gameboy::Clone() {
+  return std::unique_ptr<Gameboy>(new Gameboy(CloneOf{*this}));
+}
+
 Gameboy::~Gameboy() noexcept {
   // save the "battery buffered" external ram to disk
-  if (mmu.cart_ram_modified) {
+  if (mmu.cart_ram_modified && !game_.empty()) {
     std::ofstream ofs{game_ + ".sav", std::ios::binary};
     if (ofs) {
       mmu.SaveBufferedRAM(ofs);
@@ -52,9 +72,11 @@ void Gameboy::SaveState() {
     spdlog::get("stdout")->error("Error saving state");
     return;
   }
+  // queued sound register writes aren't part of the state
+  apu.Sync();
   cereal::BinaryOutputArchive oarchive(ofs);
-  oarchive(mmu, cpu, ppu, joypad, current_screen_cycles_, game_, divider_,
-           timer_ticks_);
+  oarchive(kStateFormat, mmu, cpu, ppu, apu, mmu.joypad,
+           current_screen_cycles_, game_, mmu.divider, timer_ticks_);
 }
 
 void Gameboy::LoadState() {
@@ -63,9 +85,89 @@ void Gameboy::LoadState() {
     spdlog::get("stdout")->error("Error loading state");
     return;
   }
-  cereal::BinaryInputArchive iarchive(ifs);
-  iarchive(mmu, cpu, ppu, joypad, current_screen_cycles_, game_, divider_,
-           timer_ticks_);
+  // read into a copy, so a state that turns out not to be readable leaves
+  // this one as it was
+  std::unique_ptr<Gameboy> loaded = Clone();
+  int format = 0;
+  ifs.read(reinterpret_cast<char *>(&format), sizeof(format));
+  bool read = false;
+  if (format == kStateFormat) {
+    read = loaded->ReadState(ifs, true);
+  } else {
+    // untagged, most likely from before the APU
+    ifs.clear();
+    ifs.seekg(0);
+    read = loaded->ReadState(ifs, false);
+    if (!read) {
+      loaded = Clone();
+      ifs.clear();
+      ifs.seekg(0);
+      read = loaded->ReadState(ifs, true);
+    }
+  }
+  StateSnapshot state;
+  if (read) {
+    loaded->Snapshot(state);
+    read = Restore(state);
+  }
+  if (!read) {
+    spdlog::get("stdout")->error("Incompatible state, not loaded");
+    return;
+  }
+  ppu.CatchUp();
+}
+
+bool Gameboy::ReadState(std::istream &is, const bool with_apu) {
+  // the copy stays unnamed, it mustn't write the battery save
+  std::string game;
+  try {
+    cereal::BinaryInputArchive iarchive(is);
+    iarchive(mmu, cpu, ppu);
+    if (with_apu) iarchive(apu);
+    iarchive(mmu.joypad, current_screen_cycles_, game, mmu.divider,
+             timer_ticks_);
+  } catch (const std::exception &) {
+    // ran out of file, or read a length from the wrong place that's too
+    // big to allocate
+    return false;
+  }
+  // read with the wrong layout, it's very unlikely to end right at the end
+  if (is.peek() != std::char_traits<char>::eof()) return false;
+  if (!with_apu) apu.ResetFromMemory();
+  // queued sound register writes belong to the state being replaced
+  apu.ClearSamples();
+  return true;
+}
+
+void Gameboy::Snapshot(StateSnapshot &snapshot) {
+  // queued sound register writes aren't part of the state
+  apu.Sync();
+  MachineState &machine = snapshot.machine;
+  cpu.Snapshot(machine.cpu);
+  ppu.Snapshot(machine.ppu);
+  apu.Snapshot(machine.apu);
+  mmu.Snapshot(machine.mmu, snapshot.ram_banks);
+  machine.current_screen_cycles = current_screen_cycles_;
+  machine.timer_ticks = timer_ticks_;
+  machine.divider_tick_cycles = divider_tick_cycles_;
+}
+
+bool Gameboy::Restore(const StateSnapshot &snapshot) {
+  const MachineState &machine = snapshot.machine;
+  if (!mmu.Restore(machine.mmu, snapshot.ram_banks)) {
+    spdlog::get("stdout")->error("Snapshot is of a different game");
+    return false;
+  }
+  cpu.Restore(machine.cpu);
+  ppu.Restore(machine.ppu);
+  apu.Restore(machine.apu);
+  current_screen_cycles_ = machine.current_screen_cycles;
+  timer_ticks_ = machine.timer_ticks;
+  divider_tick_cycles_ = machine.divider_tick_cycles;
+  // anything caching VRAM or OAM has to start over
+  mmu.InvalidateVram();
+  mmu.InvalidateOam();
+  return true;
 }
 
 void Gameboy::TimerTick(int cycles) {
@@ -74,18 +176,20 @@ void Gameboy::TimerTick(int cycles) {
   cycles *= 4; // convert our machine cycle to cpu cycle
   divider_tick_cycles_ += cycles;
   if (divider_tick_cycles_ >= 256) {
-    ++divider_;
+    ++mmu.divider;
     divider_tick_cycles_ = 0;
   }
-  mmu.SetRegister(DIV, divider_ >> 8);
-  const uint8_t timer_ctrl = mmu.ReadByte(TAC);
+  mmu.SetRegister(DIV, mmu.divider >> 8);
+  // the timer registers read back as they are, skip ReadByte's checks as
+  // this runs after every instruction
+  const uint8_t timer_ctrl = mmu.GetRegister(TAC);
 
   if (!bit_check(timer_ctrl, 2))
     return;
 
   // timer enabled
-  const uint8_t timer_modulo = mmu.ReadByte(TMA);
-  uint8_t timer_counter = mmu.ReadByte(TIMA);
+  const uint8_t timer_modulo = mmu.GetRegister(TMA);
+  uint8_t timer_counter = mmu.GetRegister(TIMA);
   if (timer_ticks_ <= clocks_[timer_ctrl & 0x03]) {
     timer_ticks_ += cycles;
   } else {
@@ -109,9 +213,9 @@ void Gameboy::TimerTick(int cycles) {
 void Gameboy::HandleInput(const std::array<uint8_t, 2> jp) {
   // std::lock_guard<std::mutex> lg(mutex);
   // update our internal joypad
-  joypad = jp;
+  mmu.joypad = jp;
   // only request joypad int if there's a button pressed
-  if (joypad[0] < 0x0F || joypad[1] < 0x0F) {
+  if (jp[0] < 0x0F || jp[1] < 0x0F) {
     uint8_t int_flag = mmu.ReadByte(IF);
     // bit 4 is joypad interrupt request - remove magic number usage here
     // TODO
@@ -125,7 +229,7 @@ int Gameboy::Tick(int ticks) {
   // mode) : 59, 7275 Hz
   int current_screen_cycles = 0;
   while (!ppu.finished_current_screen) {
-    auto prev_inst = cpu.Execute();
+    cpu.Execute();
     // handle interrupts
     // if we're on the HALT opcode, need to handle interrupts
     // a little differently
@@ -133,12 +237,17 @@ int Gameboy::Tick(int ticks) {
       cpu.HandleInterrupts();
     }
     TimerTick(cpu.cycles);
-    ppu.Update(cpu.cycles);
+    ppu.AddCycles(cpu.cycles);
+    apu.AddCycles(cpu.cycles);
     current_screen_cycles += cpu.cycles;
     if (--ticks <= 0) {
       break;
     }
   }
+  // leave the PPU fully up to date for whoever looks at it between ticks,
+  // and make the frame's audio available
+  ppu.CatchUp();
+  apu.EndFrame();
   ppu.finished_current_screen = false;
   return current_screen_cycles;
 }
@@ -2,6 +2,10 @@
 #define GB_H
 
 #include <cereal/archives/binary.hpp>
+#include <istream>
+#include <memory>
+#include <type_traits>
+#include <vector>
 #include "apu.h"
 #include "cpu.h"
 #include "mmu.h"
@@ -66,43 +70,84 @@ inline constexpr uint16_t NR50 = 0xFF24;  // Channel Control / On-Off / Volume
 inline constexpr uint16_t NR51 = 0xFF25;  // Sound Output Terminal Select
 inline constexpr uint16_t NR52 = 0xFF26;  // Sound on/off
 
+// The whole machine, laid out flat so a snapshot is a handful of memcpys
+struct MachineState {
+  CPUState cpu;
+  PPUState ppu;
+  APUState apu;
+  MMUState mmu;
+  int current_screen_cycles;
+  int timer_ticks;
+  int divider_tick_cycles;
+};
+static_assert(std::is_trivially_copyable_v<MachineState>);
+
+// An in memory save state, see Gameboy::Snapshot(). Reuse one rather than
+// making a new one each time, then taking a snapshot allocates nothing
+struct StateSnapshot {
+  // zeroed, padding included, so equal states are equal bytes
+  MachineState machine{};
+  // the cart's RAM banks, as many as it has. Shared with the MMU rather
+  // than copied, nothing ever writes to a bank in place (it's swapped for a
+  // new one), so a bank nobody's touched since costs nothing
+  std::vector<SharedPage> ram_banks;
+};
+
 class Gameboy {
  public:
-  Gameboy();
-  Gameboy(std::vector<uint8_t> &cart, std::string game);
+  explicit Gameboy(APUMode audio = APUMode::kSynthesize);
+  Gameboy(std::vector<uint8_t> &cart, std::string game,
+          APUMode audio = APUMode::kSynthesize);
   Gameboy(const Gameboy &) = delete;             // copy ctor
   Gameboy(Gameboy &&) = delete;                  // move ctor
   Gameboy &operator=(Gameboy const &) = delete;  // copy assignment
   Gameboy &operator=(Gameboy &&) = delete;       // move assignment
   ~Gameboy() noexcept;
+  // Fork the console as it is right now. Memory and the cart are shared
+  // copy on write, so this costs a few microseconds and each page only gets
+  // copied once either side writes to it. The clone is unnamed (so never
+  // writes the battery save) and has no render threads. Can be run on a
+  // different thread to this one, but not cloned from while this runs
+  std::unique_ptr<Gameboy> Clone();
   void Reset();
   void HandleInput(std::array<uint8_t, 2> jp);
   int Tick(int ticks);
   void TickUntil(uint16_t pc);
   void Load(std::vector<uint8_t> cart);
-  static void SetTimer(const uint16_t t) { divider_ = t; }
-  static uint16_t GetTimer() { return divider_; }
   void TimerTick(int cycles);
   MMU mmu;
   CPU cpu;
   PPU ppu;
   APU apu;
   const int max_cycles_per_vertical_refresh = 70224;
-  static std::array<uint8_t, 2> joypad;
+  // A state that can't be read (eg. from a build with a different layout)
+  // is reported and changes nothing
   void SaveState();
   void LoadState();
-  template <class Archive>
-  void serialize(Archive &archive) {
-    archive(mmu, cpu, ppu, joypad, current_screen_cycles_, game_, divider_,
-            timer_ticks_);
-  }
+  // What the battery save and save states are named after, empty if unnamed
+  const std::string &Game() const { return game_; }
+  // Save states in memory, no files or serialization. A snapshot can be
+  // restored to any Gameboy running the same game, Restore() returns false
+  // (and changes nothing) otherwise. The screen and any sound not read yet
+  // aren't part of it, restoring drops the sound
+  void Snapshot(StateSnapshot &snapshot);
+  bool Restore(const StateSnapshot &snapshot);
 
  private:
+  struct CloneOf {
+    Gameboy &source;
+  };
+  explicit Gameboy(CloneOf clone_of);
+  // First in a state saved by SaveState(). Older ones start with the MMU's
+  // (rom_banks or MMU::kSlimState), and the first of those have no APU
+  static constexpr int kStateFormat = -2;
+  // Everything in a state after kStateFormat, with_apu false for one from
+  // before there was an APU. false if it doesn't read as that
+  bool ReadState(std::istream &is, bool with_apu);
   // a vert refresh after this many cycles
   int current_screen_cycles_ = 0;
   std::string game_{};
   // Timer/Divider
-  static uint16_t divider_;
   int timer_ticks_ = 0;
   int divider_tick_cycles_ = 0;
   const int clocks_[4] = {1024, 16, 64, 256};
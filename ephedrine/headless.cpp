@@ -0,0 +1,526 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "audio_bench.h"
+#include "batch_runner.h"
+#include "gb.h"
+#include "movie.h"
+#include "run_ahead.h"
+#include "snapshot_codec.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
+#include "spdlog/spdlog.h"
+
+/* Runs a game with no window, audio device or UI at all, as fast as it'll
+ * go. For CI and batch jobs on machines without a display, the only
+ * dependencies are the core and spdlog/cereal (both header only)
+ */
+namespace {
+struct Options {
+  std::string rom{};
+  int frames = 600;
+  // stop early once the byte at until_address reads until_value
+  std::optional<uint16_t> until_address{};
+  uint8_t until_value = 0;
+  // write every nth frame to <frames_prefix>_<frame>.ppm
+  std::string frames_prefix{};
+  int frames_interval = 1;
+  // the last frame run, as a .ppm
+  std::string screenshot{};
+  std::string audio{};
+  bool load_state = false;
+  bool save_state = false;
+  bool quiet = false;
+  // more than one runs that many copies at once, see RunBatch()
+  int instances = 1;
+  int threads = 0;
+  bool pin_threads = false;
+  // run them with a LockstepBatch, and/or each on its own made up input so
+  // they don't all do exactly the same thing
+  bool lockstep = false;
+  bool vary_input = false;
+  // time this many in memory snapshots/restores once the frames are run
+  int bench_snapshots = 0;
+  // time the frames muted and synthesising instead of running them once
+  bool bench_audio = false;
+  int run_ahead = 0;
+  // record the run as an input movie, or play one back instead
+  std::string record_movie{};
+  std::string play_movie{};
+  int hash_interval = MovieRecorder::kDefaultHashInterval;
+  int keyframe_interval = MovieRecorder::kDefaultKeyframeInterval;
+  // where to start playing the movie from
+  int seek = 0;
+};
+
+// What a snapshot plus a restore has to come in under, see BenchSnapshots()
+constexpr double kSnapshotBudgetMicros = 5.0;
+
+void PrintUsage() {
+  std::printf(
+      "usage: ephedrine-headless <rom> [options]\n"
+      "  --frames N            run at most N frames (default 600)\n"
+      "  --until ADDR=VALUE    stop once memory at ADDR (hex) reads VALUE\n"
+      "                        (hex), exits with 2 if it never does\n"
+      "  --dump-frames PREFIX  write frames to PREFIX_<frame>.ppm\n"
+      "  --dump-interval N     only dump every nth frame (default 1)\n"
+      "  --screenshot FILE     write the last frame run to FILE (.ppm)\n"
+      "  --dump-audio FILE     write the sound to FILE (.wav, 16 bit stereo)\n"
+      "  --load-state          start from <rom name>.st8\n"
+      "  --save-state          save <rom name>.st8 when done\n"
+      "  --quiet               only log errors\n"
+      "  --instances N         run N copies at once, reporting the total\n"
+      "                        frame rate (no dumps or states)\n"
+      "  --threads N           threads to run them on (default one per\n"
+      "                        hardware thread)\n"
+      "  --pin-threads         keep each thread on its own core\n"
+      "  --lockstep            run them in lockstep (experimental)\n"
+      "  --vary-input          give each its own random input\n"
+      "  --run-ahead N         frames drawn are from N (up to 4) ahead\n"
+      "  --record-movie FILE   record the run as an input movie\n"
+      "  --hash-interval N     with a state hash every N frames (default 60)\n"
+      "  --keyframe-interval N and a keyframe every N frames (default 60)\n"
+      "  --play-movie FILE     play a movie back instead, exits with 4 if it\n"
+      "                        doesn't come out the same\n"
+      "  --seek FRAME          from this frame on, timing how long getting\n"
+      "                        there took\n"
+      "  --bench-snapshots N   then time N in memory snapshots and restores,\n"
+      "                        exits with 3 if they take over 5 us a pair\n"
+      "                        or a damaged packed one isn't rejected\n"
+      "  --bench-audio         time the frames muted and with sound instead,\n"
+      "                        then the APU's synthesis and aliasing on\n"
+      "                        its own. Exits with 3 if sound takes over\n"
+      "                        2%% of a frame at full speed or aliasing's\n"
+      "                        over -30 dB\n");
+}
+
+// The whole of text as a number, false if it's anything else or too big
+template <typename T>
+bool ParseNumber(const std::string &text, T &value, const int base = 10) {
+  const char *const end = text.data() + text.size();
+  const auto result = std::from_chars(text.data(), end, value, base);
+  return !text.empty() && result.ec == std::errc{} && result.ptr == end;
+}
+
+bool ParseOptions(const int argc, char **argv, Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    // everything but the flags takes a value
+    const bool has_value = i + 1 < argc;
+    if (arg == "--frames" && has_value) {
+      if (!ParseNumber(argv[++i], options.frames)) return false;
+    } else if (arg == "--until" && has_value) {
+      const std::string condition = argv[++i];
+      const auto equals = condition.find('=');
+      if (equals == std::string::npos) return false;
+      uint16_t address = 0;
+      if (!ParseNumber(condition.substr(0, equals), address, 16) ||
+          !ParseNumber(condition.substr(equals + 1), options.until_value,
+                       16)) {
+        return false;
+      }
+      options.until_address = address;
+    } else if (arg == "--dump-frames" && has_value) {
+      options.frames_prefix = argv[++i];
+    } else if (arg == "--dump-interval" && has_value) {
+      if (!ParseNumber(argv[++i], options.frames_interval)) return false;
+      options.frames_interval = std::max(options.frames_interval, 1);
+    } else if (arg == "--screenshot" && has_value) {
+      options.screenshot = argv[++i];
+    } else if (arg == "--dump-audio" && has_value) {
+      options.audio = argv[++i];
+    } else if (arg == "--load-state") {
+      options.load_state = true;
+    } else if (arg == "--save-state") {
+      options.save_state = true;
+    } else if (arg == "--quiet") {
+      options.quiet = true;
+    } else if (arg == "--instances" && has_value) {
+      if (!ParseNumber(argv[++i], options.instances)) return false;
+      options.instances = std::max(options.instances, 1);
+    } else if (arg == "--threads" && has_value) {
+      if (!ParseNumber(argv[++i], options.threads)) return false;
+    } else if (arg == "--pin-threads") {
+      options.pin_threads = true;
+    } else if (arg == "--lockstep") {
+      options.lockstep = true;
+    } else if (arg == "--vary-input") {
+      options.vary_input = true;
+    } else if (arg == "--run-ahead" && has_value) {
+      if (!ParseNumber(argv[++i], options.run_ahead)) return false;
+    } else if (arg == "--record-movie" && has_value) {
+      options.record_movie = argv[++i];
+    } else if (arg == "--hash-interval" && has_value) {
+      if (!ParseNumber(argv[++i], options.hash_interval)) return false;
+      options.hash_interval = std::max(options.hash_interval, 1);
+    } else if (arg == "--keyframe-interval" && has_value) {
+      if (!ParseNumber(argv[++i], options.keyframe_interval)) return false;
+      options.keyframe_interval = std::max(options.keyframe_interval, 0);
+    } else if (arg == "--seek" && has_value) {
+      if (!ParseNumber(argv[++i], options.seek)) return false;
+      options.seek = std::max(options.seek, 0);
+    } else if (arg == "--play-movie" && has_value) {
+      options.play_movie = argv[++i];
+    } else if (arg == "--bench-snapshots" && has_value) {
+      if (!ParseNumber(argv[++i], options.bench_snapshots)) return false;
+      options.bench_snapshots = std::max(options.bench_snapshots, 0);
+    } else if (arg == "--bench-audio") {
+      options.bench_audio = true;
+    } else if (arg[0] != '-' && options.rom.empty()) {
+      options.rom = arg;
+    } else {
+      return false;
+    }
+  }
+  const bool batch_only_options = options.frames_prefix.empty() &&
+                                  options.screenshot.empty() &&
+                                  options.audio.empty() &&
+                                  !options.load_state && !options.save_state &&
+                                  options.run_ahead == 0 &&
+                                  options.record_movie.empty() &&
+                                  options.play_movie.empty();
+  return !options.rom.empty() &&
+         (options.instances == 1 || batch_only_options);
+}
+
+std::unique_ptr<std::vector<uint8_t>> Load(std::ifstream &rom) {
+  return std::make_unique<std::vector<uint8_t>>(
+      std::istreambuf_iterator<char>(rom), std::istreambuf_iterator<char>());
+}
+
+// Binary PPM, the alpha channel gets dropped
+bool WritePPM(const std::string &path, const std::vector<uint8_t> &pixels) {
+  std::ofstream ofs{path, std::ios::binary};
+  if (!ofs) return false;
+  ofs << "P6\n" << kScreenWidth << ' ' << kScreenHeight << "\n255\n";
+  for (size_t i = 0; i < pixels.size(); i += 4) {
+    ofs.write(reinterpret_cast<const char *>(&pixels[i]), 3);
+  }
+  return static_cast<bool>(ofs);
+}
+
+void WriteLE(std::ofstream &ofs, const uint32_t value, const int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    ofs.put(static_cast<char>((value >> (i * 8)) & 0xFF));
+  }
+}
+
+bool WriteWAV(const std::string &path, const std::vector<int16_t> &samples) {
+  std::ofstream ofs{path, std::ios::binary};
+  if (!ofs) return false;
+  const auto data_size = static_cast<uint32_t>(samples.size() * 2);
+  ofs.write("RIFF", 4);
+  WriteLE(ofs, 36 + data_size, 4);
+  ofs.write("WAVEfmt ", 8);
+  WriteLE(ofs, 16, 4);                     // fmt chunk size
+  WriteLE(ofs, 1, 2);                      // PCM
+  WriteLE(ofs, 2, 2);                      // channels
+  WriteLE(ofs, kAudioSampleRate, 4);       // sample rate
+  WriteLE(ofs, kAudioSampleRate * 4, 4);   // byte rate
+  WriteLE(ofs, 4, 2);                      // block align
+  WriteLE(ofs, 16, 2);                     // bits per sample
+  ofs.write("data", 4);
+  WriteLE(ofs, data_size, 4);
+  for (const int16_t sample : samples) {
+    WriteLE(ofs, static_cast<uint16_t>(sample), 2);
+  }
+  return static_cast<bool>(ofs);
+}
+
+// FNV-1a, so CI can compare runs without keeping the frames around
+uint64_t Hash(const std::vector<uint8_t> &bytes) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const uint8_t byte : bytes) {
+    hash = (hash ^ byte) * 1099511628211ULL;
+  }
+  return hash;
+}
+/* Damaged packed snapshots have to be turned away, not crash or allocate
+ * whatever their header says: cut short anywhere (every length up to a few
+ * hundred bytes, then a few hundred more spread over the rest), claiming
+ * more RAM banks than a cart can have, or with a bit flipped. The
+ * undamaged one has to unpack
+ */
+bool RejectsDamagedSnapshots(const std::vector<uint8_t> &packed) {
+  SnapshotCodec codec;
+  StateSnapshot snapshot;
+  const size_t stride = std::max<size_t>(packed.size() / 256, 1);
+  for (size_t size = 0; size < packed.size();
+       size += size < 256 ? 1 : stride) {
+    if (codec.Unpack(packed.data(), size, snapshot)) return false;
+  }
+  // ram_banks, the third field of the header
+  std::vector<uint8_t> banks = packed;
+  const uint32_t too_many = 0xFFFFFFFF;
+  std::memcpy(banks.data() + 8, &too_many, sizeof(too_many));
+  if (codec.Unpack(banks.data(), banks.size(), snapshot)) return false;
+  std::vector<uint8_t> flipped = packed;
+  flipped[flipped.size() / 2] ^= 0x10;
+  if (codec.Unpack(flipped.data(), flipped.size(), snapshot)) return false;
+  return codec.Unpack(packed.data(), packed.size(), snapshot);
+}
+
+/* Times Gameboy::Snapshot() and Restore() from wherever the game got to.
+ * Restoring the same snapshot over and over is what rewind and run-ahead
+ * do, and it's checked to have actually put everything back
+ */
+bool BenchSnapshots(Gameboy &gb, const int count) {
+  using Clock = std::chrono::steady_clock;
+  StateSnapshot snapshot;
+  StateSnapshot check;
+  gb.Snapshot(snapshot);
+  const auto start = Clock::now();
+  for (int i = 0; i < count; ++i) gb.Snapshot(snapshot);
+  const auto snapshotted = Clock::now();
+  for (int i = 0; i < count; ++i) gb.Restore(snapshot);
+  const auto restored = Clock::now();
+  gb.Snapshot(check);
+  const bool same =
+      std::memcmp(&snapshot.machine, &check.machine, sizeof(MachineState)) ==
+          0 &&
+      std::equal(snapshot.ram_banks.begin(), snapshot.ram_banks.end(),
+                 check.ram_banks.begin(), check.ram_banks.end(),
+                 [](const SharedPage &a, const SharedPage &b) {
+                   return *a == *b;
+                 });
+  const auto micros = [count](const Clock::duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count() / count;
+  };
+  const double snapshot_us = micros(snapshotted - start);
+  const double restore_us = micros(restored - snapshotted);
+  const size_t bytes =
+      sizeof(MachineState) + snapshot.ram_banks.size() * sizeof(MemoryPage);
+  SnapshotCodec codec;
+  std::vector<uint8_t> packed;
+  codec.Pack(snapshot, packed);
+  const bool rejects_damage = RejectsDamagedSnapshots(packed);
+  std::printf(
+      "snapshot %.2f us restore %.2f us size %zu bytes (%zu packed)%s%s\n",
+      snapshot_us, restore_us, bytes, packed.size(), same ? "" : " MISMATCH",
+      rejects_damage ? "" : " DAMAGE NOT REJECTED");
+  return same && rejects_damage &&
+         snapshot_us + restore_us <= kSnapshotBudgetMicros;
+}
+
+/* Throughput testing and bulk runs: every copy runs muted and without
+ * rendering on a BatchRunner, and gets checked for the --until condition
+ * after each frame
+ */
+int RunBatch(const Options &options, std::vector<uint8_t> &cart) {
+  BatchRunner runner(options.threads, options.pin_threads,
+                     options.lockstep);
+  // unnamed, so there's no battery RAM for them all to fight over
+  const std::string game{};
+  std::vector<uint8_t> met(options.instances, 0);
+  for (int i = 0; i < options.instances; ++i) {
+    auto gb = std::make_unique<Gameboy>(cart, game, APUMode::kMuted);
+    gb->ppu.SetRenderInterval(0);
+    BatchRunner::OutputSink output = nullptr;
+    if (options.until_address) {
+      output = [&options, &met, i](Gameboy &gb, int) {
+        met[i] = gb.mmu.ReadByte(*options.until_address) == options.until_value;
+        return !met[i];
+      };
+    }
+    BatchRunner::InputFeed input = nullptr;
+    if (options.vary_input) {
+      // a new random set of buttons every 8 frames
+      input = [i](const int frame) {
+        uint32_t x = static_cast<uint32_t>(frame / 8) * 2654435761u +
+                     static_cast<uint32_t>(i) * 40503u;
+        x ^= x >> 13;
+        return std::array<uint8_t, 2>{static_cast<uint8_t>(x & 0x0F),
+                                      static_cast<uint8_t>(x >> 4 & 0x0F)};
+      };
+    }
+    runner.Add(std::move(gb), std::move(input), std::move(output));
+  }
+  const BatchStats stats = runner.Run(options.frames);
+  spdlog::get("stdout")->info("{0} instances on {1} threads: {2} frames in "
+                              "{3:.3f} s",
+                              options.instances, runner.Threads(),
+                              stats.frames, stats.seconds);
+  int met_count = 0;
+  for (const uint8_t instance_met : met) met_count += instance_met;
+  std::printf("instances %d frames %lld fps %.0f", options.instances,
+              static_cast<long long>(stats.frames), stats.FramesPerSecond());
+  if (options.until_address) std::printf(" met %d", met_count);
+  if (options.lockstep && stats.instructions > 0) {
+    std::printf(" vectorized %.1f%%",
+                100.0 * static_cast<double>(stats.vectorized) /
+                    static_cast<double>(stats.instructions));
+  }
+  std::printf("\n");
+  if (options.until_address && met_count < options.instances) return 2;
+  return 0;
+}
+
+/* Plays a movie back as fast as it'll go, nothing drawn or heard, stopping
+ * at the first state hash that doesn't match the recording. From
+ * options.seek on if given, the seek's timed
+ */
+int PlayMovie(const Options &options, std::vector<uint8_t> &cart) {
+  MoviePlayer player;
+  if (!player.Open(options.play_movie)) return 1;
+  // unnamed, power on movies bring their own battery RAM and the real one
+  // shouldn't get overwritten
+  Gameboy gb(cart, std::string{}, APUMode::kMuted);
+  gb.ppu.SetRenderInterval(0);
+  if (!player.Start(gb)) return 1;
+  if (options.seek > 0) {
+    const auto seek_start = std::chrono::steady_clock::now();
+    if (!player.Seek(gb, static_cast<uint32_t>(options.seek))) {
+      spdlog::get("stdout")->error("Couldn't seek to frame {0} of {1}",
+                                   options.seek, player.Frames());
+      return 1;
+    }
+    const double millis = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - seek_start)
+                              .count();
+    std::printf("seek to frame %u of %u (%zu keyframes) in %.1f ms\n",
+                player.Frame(), player.Frames(), player.Keyframes(), millis);
+  }
+  const auto start = std::chrono::steady_clock::now();
+  MoviePlayer::Status status = MoviePlayer::Status::kPlaying;
+  while (status == MoviePlayer::Status::kPlaying) {
+    status = player.RunFrame(gb);
+  }
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  const uint32_t played = player.Frame() - static_cast<uint32_t>(options.seek);
+  spdlog::get("stdout")->info("{0} frames in {1:.3f} s, {2:.0f} fps", played,
+                              seconds, played / std::max(seconds, 1e-9));
+  if (status == MoviePlayer::Status::kDamaged) return 1;
+  if (status == MoviePlayer::Status::kDiverged) {
+    std::printf("movie diverged at frame %u expected %016llx got %016llx\n",
+                player.Frame(),
+                static_cast<unsigned long long>(player.Expected()),
+                static_cast<unsigned long long>(player.Got()));
+    return 4;
+  }
+  std::printf("movie frames %u matched\n", player.Frame());
+  return 0;
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    PrintUsage();
+    return 1;
+  }
+  auto logger = spdlog::stdout_color_mt("stdout");
+  logger->set_level(options.quiet ? spdlog::level::err : spdlog::level::info);
+  // the CPU traces to this one in the full frontend, nothing to see here
+  spdlog::stdout_color_mt("file logger")->set_level(spdlog::level::off);
+
+  auto file = std::ifstream{options.rom, std::ios::binary};
+  if (!file) {
+    logger->error("Couldn't open {0}", options.rom);
+    return 1;
+  }
+  auto cart = Load(file);
+  if (options.instances > 1) return RunBatch(options, *cart);
+  if (!options.play_movie.empty()) return PlayMovie(options, *cart);
+  if (options.bench_audio) {
+    const bool audio_passed = BenchAudio(*cart, options.frames);
+    const bool synthesis_passed = BenchSynthesis();
+    return audio_passed && synthesis_passed ? 0 : 3;
+  }
+  // nothing listens to the sound unless it's being dumped, so don't make it
+  const APUMode audio_mode =
+      options.audio.empty() ? APUMode::kMuted : APUMode::kSynthesize;
+  Gameboy gb(*cart, std::filesystem::path(options.rom).stem().string(),
+             audio_mode);
+  if (options.load_state) gb.LoadState();
+  RunAhead run_ahead;
+  run_ahead.SetFrames(options.run_ahead);
+  MovieRecorder recorder;
+  // nothing's run yet, unless a state was loaded
+  if (!options.record_movie.empty() &&
+      !recorder.Start(options.record_movie, gb, !options.load_state,
+                      options.hash_interval, options.keyframe_interval)) {
+    return 1;
+  }
+
+  const bool dump_frames = !options.frames_prefix.empty();
+  // only draw the frames somebody is going to look at. Which frame the
+  // screenshot is of isn't known up front when running until a condition
+  const bool screenshot_any_frame =
+      !options.screenshot.empty() && options.until_address;
+  if (dump_frames) {
+    gb.ppu.SetRenderInterval(options.frames_interval);
+  } else {
+    gb.ppu.SetRenderInterval(screenshot_any_frame ? 1 : 0);
+  }
+  std::vector<uint8_t> pixels(kScreenWidth * kScreenHeight * 4);
+  std::vector<int16_t> samples;
+  std::vector<int16_t> frame_samples(16384 * 2);
+
+  const auto start = std::chrono::steady_clock::now();
+  int frame = 0;
+  bool condition_met = false;
+  while (frame < options.frames && !condition_met) {
+    // the screenshot is the only frame that gets drawn
+    if (frame + 1 == options.frames && !options.screenshot.empty() &&
+        !dump_frames) {
+      gb.ppu.SetRenderInterval(1);
+    }
+    run_ahead.RunFrame(gb, [&](Gameboy &gb) {
+      recorder.FrameDone(gb);
+      if (options.audio.empty()) return;
+      const int count = gb.apu.ReadSamples(frame_samples.data(), 16384);
+      samples.insert(samples.end(), frame_samples.begin(),
+                     frame_samples.begin() + count * 2);
+    });
+    if (dump_frames && frame % options.frames_interval == 0) {
+      gb.ppu.Render(pixels.data());
+      const std::string path =
+          options.frames_prefix + "_" + std::to_string(frame) + ".ppm";
+      if (!WritePPM(path, pixels)) logger->error("Error writing {0}", path);
+    }
+    if (options.until_address) {
+      condition_met =
+          gb.mmu.ReadByte(*options.until_address) == options.until_value;
+    }
+    ++frame;
+  }
+  const auto end = std::chrono::steady_clock::now();
+
+  // whatever was last rendered, which is the last frame run if anything is
+  if (!options.screenshot.empty()) {
+    gb.ppu.Render(pixels.data());
+    if (!WritePPM(options.screenshot, pixels)) {
+      logger->error("Error writing {0}", options.screenshot);
+    }
+  }
+  if (!options.audio.empty() && !WriteWAV(options.audio, samples)) {
+    logger->error("Error writing {0}", options.audio);
+  }
+  if (options.save_state) gb.SaveState();
+  recorder.Stop(gb);
+  const bool bench_passed =
+      options.bench_snapshots == 0 ||
+      BenchSnapshots(gb, options.bench_snapshots);
+
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  const auto memory = gb.mmu.DebugShowMemory(0, 0xFFFF);
+  logger->info("{0} frames in {1:.3f} s, {2:.0f} fps", frame, seconds,
+               frame / std::max(seconds, 1e-9));
+  // always printed, it's what scripts compare
+  std::printf("frames %d pc %04x memory %016llx\n", frame, gb.cpu.GetPC(),
+              static_cast<unsigned long long>(Hash(*memory)));
+  if (options.until_address && !condition_met) return 2;
+  if (!bench_passed) return 3;
+  return 0;
+}
@@ -4,7 +4,7 @@
 #define INSTRUCTIONS_H
 #include <cstdint>
 #include <optional>
-#include <string>
+#include <string_view>
 #include <variant>
 
 enum class AddressingMode {
@@ -17,7 +17,8 @@ enum class AddressingMode {
 
 struct DecodedInstruction {
   uint8_t opcode;
-  std::string name;
+  // always one of the literals below, so copying an instruction is cheap
+  std::string_view name;
   AddressingMode mode;
   // source?
   // dest?
@@ -29,7 +30,7 @@ struct DecodedInstruction {
 };
 
 class Instructions {
-  inline static DecodedInstruction instructions_[]{
+  inline static const DecodedInstruction instructions_[]{
       {0x00, "NOP", AddressingMode::kNone, 1, 4},
       {0x01, "LD BC, d16", AddressingMode::kDirect, 3, 12},
       {0x02, "LD (BC), A", AddressingMode::kNone, 1, 8},
@@ -293,7 +294,7 @@ class Instructions {
       {0xFE, "CP d8", AddressingMode::kImmediate, 2, 8},
       {0xFF, "RST 38h", AddressingMode::kNone, 1, 16}};
 
-  inline static DecodedInstruction cb_instructions_[]{
+  inline static const DecodedInstruction cb_instructions_[]{
       {0x00, "RLC B", AddressingMode::kNone, 2, 8},
       {0x01, "RLC C", AddressingMode::kNone, 2, 8},
       {0x02, "RLC D", AddressingMode::kNone, 2, 8},
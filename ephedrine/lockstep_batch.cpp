@@ -0,0 +1,450 @@
+#include "lockstep_batch.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "simd.h"
+
+namespace {
+
+// What RunVector() does with an opcode, kNone for everything it can't
+enum class LaneOp : uint8_t {
+  kNone,
+  kNop,
+  kLoad,
+  kLoadImmediate,
+  kAlu,
+  kAluImmediate,
+  kIncrement,
+  kDecrement,
+  kIncrementPair,
+  kDecrementPair,
+};
+
+constexpr std::array<LaneOp, 256> MakeLaneOps() {
+  std::array<LaneOp, 256> ops{};
+  ops[0x00] = LaneOp::kNop;
+  for (int opcode = 0; opcode < 0x100; ++opcode) {
+    // destination (or ALU op) and source, 6 being (HL)
+    const int x = opcode >> 3 & 7;
+    const int y = opcode & 7;
+    if (opcode < 0x40 && x != 6) {
+      if (y == 4) ops[opcode] = LaneOp::kIncrement;
+      if (y == 5) ops[opcode] = LaneOp::kDecrement;
+      if (y == 6) ops[opcode] = LaneOp::kLoadImmediate;
+    }
+    if (opcode < 0x40 && (opcode & 0x0F) == 0x03) {
+      ops[opcode] = LaneOp::kIncrementPair;
+    }
+    if (opcode < 0x40 && (opcode & 0x0F) == 0x0B) {
+      ops[opcode] = LaneOp::kDecrementPair;
+    }
+    if (opcode >= 0x40 && opcode < 0x80 && x != 6 && y != 6) {
+      ops[opcode] = LaneOp::kLoad;
+    }
+    if (opcode >= 0x80 && opcode < 0xC0 && y != 6) ops[opcode] = LaneOp::kAlu;
+    if (opcode >= 0xC0 && y == 6) ops[opcode] = LaneOp::kAluImmediate;
+  }
+  return ops;
+}
+
+constexpr std::array<LaneOp, 256> kLaneOps = MakeLaneOps();
+
+int LaneCount(uint32_t lanes) {
+  int count = 0;
+  for (; lanes; lanes &= lanes - 1) ++count;
+  return count;
+}
+
+int FirstLane(const uint32_t lanes) {
+  int lane = 0;
+  while (lane < LockstepBatch::kLanes && !(lanes >> lane & 1)) ++lane;
+  return lane;
+}
+
+using Lane = std::array<uint8_t, LockstepBatch::kLanes>;
+
+// The handful of byte wise operations RunVector() needs, on all lanes at
+// once. Comparisons give 0xFF for true, like the flags
+#ifdef EPHEDRINE_SSE2
+using Bytes = __m128i;
+inline Bytes Load(const Lane &lane) {
+  return _mm_load_si128(reinterpret_cast<const __m128i *>(lane.data()));
+}
+inline void Store(Lane &lane, const Bytes value) {
+  _mm_store_si128(reinterpret_cast<__m128i *>(lane.data()), value);
+}
+inline Bytes Splat(const uint8_t value) {
+  return _mm_set1_epi8(static_cast<char>(value));
+}
+inline Bytes Add(const Bytes a, const Bytes b) { return _mm_add_epi8(a, b); }
+inline Bytes Sub(const Bytes a, const Bytes b) { return _mm_sub_epi8(a, b); }
+// saturating, so it only differs from Add() where that carried
+inline Bytes AddSaturate(const Bytes a, const Bytes b) {
+  return _mm_adds_epu8(a, b);
+}
+inline Bytes Max(const Bytes a, const Bytes b) { return _mm_max_epu8(a, b); }
+inline Bytes And(const Bytes a, const Bytes b) { return _mm_and_si128(a, b); }
+inline Bytes Or(const Bytes a, const Bytes b) { return _mm_or_si128(a, b); }
+inline Bytes Xor(const Bytes a, const Bytes b) { return _mm_xor_si128(a, b); }
+inline Bytes Equal(const Bytes a, const Bytes b) {
+  return _mm_cmpeq_epi8(a, b);
+}
+// a where mask, otherwise b
+inline Bytes Select(const Bytes mask, const Bytes a, const Bytes b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+#else
+struct Bytes {
+  Lane v;
+};
+template <class Op>
+inline Bytes Map(const Bytes &a, const Bytes &b, Op op) {
+  Bytes result;
+  for (int i = 0; i < LockstepBatch::kLanes; ++i) {
+    result.v[i] = static_cast<uint8_t>(op(a.v[i], b.v[i]));
+  }
+  return result;
+}
+inline Bytes Load(const Lane &lane) { return Bytes{lane}; }
+inline void Store(Lane &lane, const Bytes &value) { lane = value.v; }
+inline Bytes Splat(const uint8_t value) {
+  Bytes result;
+  result.v.fill(value);
+  return result;
+}
+inline Bytes Add(const Bytes &a, const Bytes &b) {
+  return Map(a, b, [](int x, int y) { return x + y; });
+}
+inline Bytes Sub(const Bytes &a, const Bytes &b) {
+  return Map(a, b, [](int x, int y) { return x - y; });
+}
+inline Bytes AddSaturate(const Bytes &a, const Bytes &b) {
+  return Map(a, b, [](int x, int y) { return std::min(x + y, 0xFF); });
+}
+inline Bytes Max(const Bytes &a, const Bytes &b) {
+  return Map(a, b, [](int x, int y) { return std::max(x, y); });
+}
+inline Bytes And(const Bytes &a, const Bytes &b) {
+  return Map(a, b, [](int x, int y) { return x & y; });
+}
+inline Bytes Or(const Bytes &a, const Bytes &b) {
+  return Map(a, b, [](int x, int y) { return x | y; });
+}
+inline Bytes Xor(const Bytes &a, const Bytes &b) {
+  return Map(a, b, [](int x, int y) { return x ^ y; });
+}
+inline Bytes Equal(const Bytes &a, const Bytes &b) {
+  return Map(a, b, [](int x, int y) { return x == y ? 0xFF : 0; });
+}
+inline Bytes Select(const Bytes &mask, const Bytes &a, const Bytes &b) {
+  return Or(And(mask, a), Map(mask, b, [](int m, int y) { return ~m & y; }));
+}
+#endif
+
+inline Bytes Not(const Bytes &a) { return Xor(a, Splat(0xFF)); }
+// the half carry, from a ^ operand ^ result
+inline Bytes HalfCarry(const Bytes &x) {
+  const Bytes bit = Splat(0x10);
+  return Equal(And(x, bit), bit);
+}
+
+}  // namespace
+
+LockstepBatch::LockstepBatch(std::vector<Gameboy *> lanes)
+    : lanes_(std::move(lanes)) {
+  if (lanes_.size() > kLanes) lanes_.resize(kLanes);
+}
+
+void LockstepBatch::RunFrame() {
+  const int count = static_cast<int>(lanes_.size());
+  running_ = (1u << count) - 1;
+  for (int i = 0; i < count; ++i) {
+    ticks_[i] = lanes_[i]->max_cycles_per_vertical_refresh;
+    pc_[i] = lanes_[i]->cpu.GetPC();
+  }
+  while (running_) {
+    // only code in ROM, reading the opcode anywhere else might not be
+    // something to do twice
+    uint32_t group = 0;
+    uint8_t opcode = 0;
+    const uint32_t candidates = CommonestPc(running_);
+    const int leader = FirstLane(candidates);
+    if (LaneCount(candidates) >= 2 && pc_[leader] < 0x7FFF) {
+      opcode = lanes_[leader]->mmu.ReadByte(pc_[leader]);
+      if (kLaneOps[opcode] != LaneOp::kNone) group = candidates;
+    }
+    // the same PC can still be different code, in another ROM bank
+    for (int i = 0; i < count; ++i) {
+      if (!(group >> i & 1)) continue;
+      if (lanes_[i]->mmu.ReadByte(pc_[i]) != opcode ||
+          (!(packed_ >> i & 1) && !Pack(i))) {
+        group &= ~(1u << i);
+      }
+    }
+    if (LaneCount(group) < 2) group = 0;
+    const uint32_t scalar = running_ & ~group;
+
+    if (group) {
+      const LaneOp op = kLaneOps[opcode];
+      const bool immediate =
+          op == LaneOp::kLoadImmediate || op == LaneOp::kAluImmediate;
+      const bool wide = immediate || op == LaneOp::kIncrementPair ||
+                        op == LaneOp::kDecrementPair;
+      const int cycles = wide ? 8 : 4;
+      for (int i = 0; immediate && i < count; ++i) {
+        if (group >> i & 1) {
+          registers_.operand[i] = lanes_[i]->mmu.ReadByte(pc_[i] + 1);
+        }
+      }
+      RunVector(opcode, group);
+      for (int i = 0; i < count; ++i) {
+        if (!(group >> i & 1)) continue;
+        Gameboy &gb = *lanes_[i];
+        pc_[i] += immediate ? 2 : 1;
+        cpu_[i].cycles = cycles;
+        // HandleInterrupts() would do nothing otherwise, and a lane that
+        // takes one has to be back in its CPU to
+        if (cpu_[i].ime &&
+            (gb.mmu.GetRegister(IF) & gb.mmu.GetRegister(IE) & 0x1F)) {
+          Unpack(i);
+          gb.cpu.HandleInterrupts();
+          pc_[i] = gb.cpu.GetPC();
+        }
+        Finish(i, cycles);
+      }
+      const int lanes = LaneCount(group);
+      stats_.instructions += lanes;
+      stats_.vectorized += lanes;
+      ++stats_.vector_steps;
+    }
+    for (int i = 0; i < count; ++i) {
+      if (scalar >> i & 1) RunScalar(i);
+    }
+  }
+}
+
+uint32_t LockstepBatch::CommonestPc(const uint32_t lanes) const {
+  // usually they're all together
+  const int first = FirstLane(lanes);
+  uint32_t together = 0;
+  for (int i = first; i < kLanes; ++i) {
+    if ((lanes >> i & 1) && pc_[i] == pc_[first]) together |= 1u << i;
+  }
+  if (together == lanes) return lanes;
+  uint32_t best = 0;
+  int best_count = 0;
+  uint32_t left = lanes;
+  for (int i = 0; left && best_count * 2 <= LaneCount(lanes); ++i) {
+    if (!(left >> i & 1)) continue;
+    uint32_t same = 0;
+    for (int j = i; j < kLanes; ++j) {
+      if ((left >> j & 1) && pc_[j] == pc_[i]) same |= 1u << j;
+    }
+    left &= ~same;
+    if (LaneCount(same) > best_count) {
+      best = same;
+      best_count = LaneCount(same);
+    }
+  }
+  return best;
+}
+
+bool LockstepBatch::Pack(const int lane) {
+  Gameboy &gb = *lanes_[lane];
+  if (gb.cpu.IsHalted()) return false;
+  CPUState &cpu = cpu_[lane];
+  gb.cpu.Snapshot(cpu);
+  if (cpu.halt_bug_occurred) return false;
+  const Registers &r = cpu.registers;
+  registers_.r[0][lane] = r.b;
+  registers_.r[1][lane] = r.c;
+  registers_.r[2][lane] = r.d;
+  registers_.r[3][lane] = r.e;
+  registers_.r[4][lane] = r.h;
+  registers_.r[5][lane] = r.l;
+  registers_.r[7][lane] = r.a;
+  registers_.z[lane] = cpu.flags.z ? 0xFF : 0x00;
+  registers_.n[lane] = cpu.flags.n ? 0xFF : 0x00;
+  registers_.h[lane] = cpu.flags.h ? 0xFF : 0x00;
+  registers_.c[lane] = cpu.flags.c ? 0xFF : 0x00;
+  sp_[lane] = cpu.sp;
+  pc_[lane] = cpu.pc;
+  packed_ |= 1u << lane;
+  return true;
+}
+
+void LockstepBatch::Unpack(const int lane) {
+  CPUState &cpu = cpu_[lane];
+  Registers &r = cpu.registers;
+  r.b = registers_.r[0][lane];
+  r.c = registers_.r[1][lane];
+  r.d = registers_.r[2][lane];
+  r.e = registers_.r[3][lane];
+  r.h = registers_.r[4][lane];
+  r.l = registers_.r[5][lane];
+  r.a = registers_.r[7][lane];
+  cpu.flags = Flags{registers_.z[lane] != 0, registers_.n[lane] != 0,
+                    registers_.h[lane] != 0, registers_.c[lane] != 0};
+  // with F's upper bits following the flags, as Execute() leaves them
+  r.f = (r.f & 0x0F) | (registers_.z[lane] & 0x80) |
+        (registers_.n[lane] & 0x40) | (registers_.h[lane] & 0x20) |
+        (registers_.c[lane] & 0x10);
+  cpu.sp = sp_[lane];
+  cpu.pc = pc_[lane];
+  lanes_[lane]->cpu.Restore(cpu);
+  packed_ &= ~(1u << lane);
+}
+
+void LockstepBatch::RunVector(const uint8_t opcode, const uint32_t lanes) {
+  alignas(16) Lane lane_mask{};
+  for (int i = 0; i < kLanes; ++i) lane_mask[i] = lanes >> i & 1 ? 0xFF : 0;
+  const Bytes mask = Load(lane_mask);
+  const Bytes zero = Splat(0x00);
+  const Bytes one = Splat(0x01);
+  const Bytes ones = Splat(0xFF);
+  // only ever write to the lanes running this
+  const auto update = [&mask](Lane &lane, const Bytes &value) {
+    Store(lane, Select(mask, value, Load(lane)));
+  };
+  auto &r = registers_.r;
+  const int x = opcode >> 3 & 7;
+  const int y = opcode & 7;
+
+  switch (kLaneOps[opcode]) {
+  case LaneOp::kNone:
+  case LaneOp::kNop:
+    break;
+  case LaneOp::kLoad:
+    update(r[x], Load(r[y]));
+    break;
+  case LaneOp::kLoadImmediate:
+    update(r[x], Load(registers_.operand));
+    break;
+  case LaneOp::kIncrement:
+  case LaneOp::kDecrement: {
+    const bool increment = kLaneOps[opcode] == LaneOp::kIncrement;
+    const Bytes value = Load(r[x]);
+    const Bytes result = increment ? Add(value, one) : Sub(value, one);
+    update(r[x], result);
+    update(registers_.z, Equal(result, zero));
+    update(registers_.n, increment ? zero : ones);
+    update(registers_.h, HalfCarry(Xor(Xor(value, one), result)));
+    break;
+  }
+  case LaneOp::kIncrementPair:
+  case LaneOp::kDecrementPair: {
+    const bool increment = kLaneOps[opcode] == LaneOp::kIncrementPair;
+    const int pair = opcode >> 4 & 3;
+    if (pair == 3) {
+      for (int i = 0; i < kLanes; ++i) {
+        if (lanes >> i & 1) sp_[i] += increment ? 1 : -1;
+      }
+      break;
+    }
+    // the high byte takes the carry out of the low one, which Equal() gives
+    // as 0xFF, ie. -1
+    const Bytes low = Load(r[pair * 2 + 1]);
+    const Bytes high = Load(r[pair * 2]);
+    if (increment) {
+      const Bytes result = Add(low, one);
+      update(r[pair * 2 + 1], result);
+      update(r[pair * 2], Sub(high, Equal(result, zero)));
+    } else {
+      update(r[pair * 2 + 1], Sub(low, one));
+      update(r[pair * 2], Add(high, Equal(low, zero)));
+    }
+    break;
+  }
+  case LaneOp::kAlu:
+  case LaneOp::kAluImmediate: {
+    const Bytes a = Load(r[7]);
+    const Bytes operand = Load(
+        kLaneOps[opcode] == LaneOp::kAlu ? r[y] : registers_.operand);
+    const Bytes carry_in = Load(registers_.c);
+    Bytes result, carry, half, subtract;
+    switch (x) {
+    case 0:  // ADD
+      result = Add(a, operand);
+      carry = Not(Equal(AddSaturate(a, operand), result));
+      half = HalfCarry(Xor(Xor(a, operand), result));
+      subtract = zero;
+      break;
+    case 1: {  // ADC, carrying out of either addition
+      const Bytes sum = Add(a, operand);
+      const Bytes first = Not(Equal(AddSaturate(a, operand), sum));
+      const Bytes bit = And(carry_in, one);
+      result = Add(sum, bit);
+      carry = Or(first, Not(Equal(AddSaturate(sum, bit), result)));
+      half = HalfCarry(Xor(Xor(a, operand), result));
+      subtract = zero;
+      break;
+    }
+    case 2:  // SUB
+    case 7:  // CP
+      result = Sub(a, operand);
+      carry = Not(Equal(Max(a, operand), a));
+      half = HalfCarry(Xor(Xor(a, operand), result));
+      subtract = ones;
+      break;
+    case 3: {  // SBC, borrowing when operand + carry > a
+      const Bytes larger = Max(a, operand);
+      result = Sub(Sub(a, operand), And(carry_in, one));
+      carry =
+          Select(carry_in, Equal(larger, operand), Not(Equal(larger, a)));
+      half = HalfCarry(Xor(Xor(a, operand), result));
+      subtract = ones;
+      break;
+    }
+    case 4:  // AND
+      result = And(a, operand);
+      carry = zero;
+      half = ones;
+      subtract = zero;
+      break;
+    case 5:  // XOR
+      result = Xor(a, operand);
+      carry = zero;
+      half = zero;
+      subtract = zero;
+      break;
+    default:  // OR
+      result = Or(a, operand);
+      carry = zero;
+      half = zero;
+      subtract = zero;
+      break;
+    }
+    if (x != 7) update(r[7], result);
+    update(registers_.z, Equal(result, zero));
+    update(registers_.n, subtract);
+    update(registers_.h, half);
+    update(registers_.c, carry);
+    break;
+  }
+  }
+}
+
+void LockstepBatch::RunScalar(const int lane) {
+  if (packed_ >> lane & 1) Unpack(lane);
+  Gameboy &gb = *lanes_[lane];
+  gb.cpu.Execute();
+  if (!gb.cpu.IsHalted()) gb.cpu.HandleInterrupts();
+  pc_[lane] = gb.cpu.GetPC();
+  ++stats_.instructions;
+  Finish(lane, gb.cpu.cycles);
+}
+
+void LockstepBatch::Finish(const int lane, const int cycles) {
+  Gameboy &gb = *lanes_[lane];
+  gb.TimerTick(cycles);
+  gb.ppu.AddCycles(cycles);
+  gb.apu.AddCycles(cycles);
+  if (!gb.ppu.finished_current_screen && --ticks_[lane] > 0) return;
+  // the end of the frame, as Tick() leaves it
+  if (packed_ >> lane & 1) Unpack(lane);
+  gb.ppu.CatchUp();
+  gb.apu.EndFrame();
+  gb.ppu.finished_current_screen = false;
+  running_ &= ~(1u << lane);
+}
@@ -0,0 +1,78 @@
+#ifndef LOCKSTEP_BATCH_H
+#define LOCKSTEP_BATCH_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "cpu.h"
+#include "gb.h"
+
+struct LockstepStats {
+  // instructions run across every lane, how many of those were run across
+  // lanes at once, and in how many goes
+  int64_t instructions = 0;
+  int64_t vectorized = 0;
+  int64_t vector_steps = 0;
+};
+
+/**
+ * Experimental: up to kLanes consoles of the same game stepped in
+ * lockstep, one instruction per lane at a time. Lanes at the same PC about
+ * to run the same register only instruction (loads between registers or
+ * from an immediate, 8 bit ALU ops, INC/DEC of a register or pair) run it
+ * together, on registers kept structure of arrays, with SSE2 where there is
+ * any (see simd.h). Anything else, and any lane that's wandered off
+ * elsewhere, is peeled off to run CPU::Execute() on its own. The timer, PPU
+ * and APU are stepped per lane whichever way an instruction ran, just as
+ * Gameboy::Tick() does, so every lane ends each frame exactly as Tick()
+ * would have left it (bar the debugger's instruction history).
+ * So far it's slower than running the lanes one after another: only about a
+ * third of instructions are ones it can run together, and what it saves on
+ * those goes on moving registers in and out of the arrays and on the per
+ * lane timer/PPU/APU work, which it can't do anything about.
+ */
+class LockstepBatch {
+ public:
+  static constexpr int kLanes = 16;
+  // At most kLanes, ideally all running the same game
+  explicit LockstepBatch(std::vector<Gameboy *> lanes);
+  // Tick(max_cycles_per_vertical_refresh) on every lane
+  void RunFrame();
+  const LockstepStats &Stats() const { return stats_; }
+
+ private:
+  // The register file, indexed the way opcodes encode registers (B, C, D,
+  // E, H, L, (HL), A), with the (HL) row unused. Flags are 0x00 or 0xFF
+  struct alignas(16) LaneRegisters {
+    std::array<std::array<uint8_t, kLanes>, 8> r;
+    std::array<uint8_t, kLanes> z;
+    std::array<uint8_t, kLanes> n;
+    std::array<uint8_t, kLanes> h;
+    std::array<uint8_t, kLanes> c;
+    std::array<uint8_t, kLanes> operand;
+  };
+  // Lanes at the PC most of them are at
+  uint32_t CommonestPc(uint32_t lanes) const;
+  // Move a lane's registers in to (false if it's halted, or about to skip
+  // a PC increment for the halt bug) and out of the arrays
+  bool Pack(int lane);
+  void Unpack(int lane);
+  void RunVector(uint8_t opcode, uint32_t lanes);
+  void RunScalar(int lane);
+  // What Tick() does after each instruction but the interrupt check
+  void Finish(int lane, int cycles);
+  std::vector<Gameboy *> lanes_;
+  LaneRegisters registers_{};
+  std::array<uint16_t, kLanes> pc_{};
+  std::array<uint16_t, kLanes> sp_{};
+  // the rest of a packed lane's CPU
+  std::array<CPUState, kLanes> cpu_{};
+  // instructions left before Tick() would give up on the frame
+  std::array<int, kLanes> ticks_{};
+  uint32_t packed_ = 0;
+  uint32_t running_ = 0;
+  LockstepStats stats_{};
+};
+
+#endif  // !LOCKSTEP_BATCH_H
@@ -1,5 +1,6 @@
 #include <SDL.h>
 #include <SDL_opengl.h>
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <filesystem>
@@ -13,12 +14,18 @@
 #include <vector>
 // Testing
 #include "SDL_video.h"
+#include "audio_ring.h"
 #include "bit_utility.h"
 // #include "catch.hpp"
 #include "gb.h"
+#include "movie.h"
+#include "rewind_buffer.h"
+#include "run_ahead.h"
 #include "spdlog/sinks/basic_file_sink.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
+#include "texture.h"
+#include "time_stretch.h"
 
 // UI
 #include "backends/imgui_impl_opengl3.h"
@@ -44,10 +51,64 @@ std::unique_ptr<std::vector<uint8_t>> Load(std::ifstream &rom) {
   return std::make_unique<std::vector<uint8_t>>(cart);
 }
 
+/* Audio output. The emulation thread writes each frame's samples into the
+ * ring and the SDL callback drains it from the audio thread
+ */
+struct AudioStream {
+  AudioRing ring;
+  // what the device actually runs at, the APU resamples straight to it
+  int sample_rate;
+  // how much we try to keep buffered, in stereo pairs
+  size_t latency;
+  // only touched by the callback, false while the ring refills after running
+  // dry so an underrun is one gap rather than lots of little ones (crackle)
+  bool playing = false;
+};
+
+void AudioCallback(void *userdata, Uint8 *stream, int len) {
+  auto &audio = *static_cast<AudioStream *>(userdata);
+  auto *out = reinterpret_cast<int16_t *>(stream);
+  const size_t frames = static_cast<size_t>(len) / 4;
+  size_t read = 0;
+  if (!audio.playing && audio.ring.Fill() >= audio.latency) {
+    audio.playing = true;
+  }
+  if (audio.playing) {
+    read = audio.ring.Read(out, frames);
+    if (read < frames) audio.playing = false;
+  }
+  std::fill(out + read * 2, out + frames * 2, 0);
+}
+
+/**
+ * Dynamic rate control: run the APU slightly fast when the ring is below
+ * the target latency and slightly slow when it's above, by at most
+ * kMaxRateDelta. The emulator is paced by vsync or the frame limiter rather
+ * than by the audio device, so the two clocks never quite agree. This keeps
+ * the buffer level steady without ever having to drop or repeat samples,
+ * which would be audible. A 0.5% pitch change is small enough to go
+ * unnoticed.
+ * Frames are paced as a whole, so the nominal rate is what plays a frame of
+ * frame_cycles clocks in the time of a real 70224 clock one.
+ * Called before the latest audio goes in, so the fill is the low point the
+ * ring drains to. Stretched audio arrives a whole segment at a time, and
+ * the low point is what has to stay clear of an underrun
+ */
+double AudioRate(const AudioStream &audio, const int frame_cycles) {
+  constexpr double kMaxRateDelta = 0.005;
+  constexpr double kFrameCycles = 70224;
+  const double fill = static_cast<double>(audio.ring.Fill()) /
+                      static_cast<double>(audio.latency);
+  const double delta = std::clamp(1.0 - fill, -1.0, 1.0) * kMaxRateDelta;
+  return audio.sample_rate * kFrameCycles / std::max(frame_cycles, 1) *
+         (1.0 + delta);
+}
+
 /* Various ImGui "modules" here, broken out in to their own individual functions
  */
 // CPU registers and individual stepping options
-void ShowCPUDebug(Gameboy &gb, bool &running) {
+void ShowCPUDebug(Gameboy &gb, bool &running, float &speed,
+                  RunAhead &run_ahead) {
   Registers reg_state = gb.cpu.GetRegisters();
   Flags flag_state = gb.cpu.GetFlags();
   ImGui::Text("Application average %.3f ms/frame (%.1f FPS)",
@@ -83,6 +144,16 @@ void ShowCPUDebug(Gameboy &gb, bool &running) {
       z = gb.cpu.GetFlags().z;
     }
   }
+  // emulated frames per host frame, audio gets stretched to match
+  ImGui::SliderFloat("Speed", &speed, 0.25F, 8.0F, "%.2fx",
+                     ImGuiSliderFlags_Logarithmic);
+  // frames shown ahead of the game, saved for each game as it's changed
+  int run_ahead_frames = run_ahead.GetFrames();
+  if (ImGui::SliderInt("Run-ahead", &run_ahead_frames, 0,
+                       RunAhead::kMaxFrames)) {
+    run_ahead.SetFrames(run_ahead_frames);
+    run_ahead.Save(gb.Game());
+  }
   //  ImGui::EndColumns();
   ImGui::Columns(1);
   // list box printing the last 100 (?) executed instructions
@@ -103,6 +174,21 @@ void ShowPPUDebug(Gameboy &gb, bool &framelimit, bool &ui_draw_bg_map,
   ImGui::Checkbox("Background Map", &ui_draw_bg_map);
   ImGui::Checkbox("Tile Map", &ui_draw_tile_map);
   ImGui::Checkbox("Framelimiter", &framelimit);
+  // 1 renders every frame, 0 turns pixel generation off entirely
+  int render_interval = gb.ppu.GetRenderInterval();
+  if (ImGui::SliderInt("Render every Nth frame", &render_interval, 0, 10)) {
+    gb.ppu.SetRenderInterval(render_interval);
+  }
+  bool pixel_fifo = gb.ppu.GetRenderer() == PPURenderer::kPixelFIFO;
+  if (ImGui::Checkbox("Pixel FIFO renderer", &pixel_fifo)) {
+    gb.ppu.SetRenderer(pixel_fifo ? PPURenderer::kPixelFIFO
+                                  : PPURenderer::kScanline);
+  }
+  // 0 draws each line inline, otherwise frames are drawn on worker threads
+  int render_threads = gb.ppu.GetRenderThreads();
+  if (ImGui::SliderInt("Render threads", &render_threads, 0, 4)) {
+    gb.ppu.SetRenderThreads(render_threads);
+  }
   ImGui::Text("Mode: %.2x", gb.mmu.ReadByte(STAT));
   ImGui::Text("Vblank: %d", gb.ppu.IsVBlank());
   ImGui::Text("lcdc= 0x%.2X", gb.mmu.GetRegister(LCDC));
@@ -245,6 +331,33 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  // Audio, aiming for ~30ms buffered between us and the device
+  AudioStream audio{AudioRing(8192), kAudioSampleRate, 0};
+  SDL_AudioSpec audio_spec{};
+  audio_spec.freq = kAudioSampleRate;
+  audio_spec.format = AUDIO_S16SYS;
+  audio_spec.channels = 2;
+  audio_spec.samples = 256;
+  audio_spec.callback = AudioCallback;
+  audio_spec.userdata = &audio;
+  SDL_AudioSpec obtained_spec{};
+  // take whatever rate the device likes (eg. 44.1kHz) rather than have SDL
+  // resample a second time
+  const SDL_AudioDeviceID audio_device =
+      SDL_OpenAudioDevice(nullptr, 0, &audio_spec, &obtained_spec,
+                          SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if (audio_device == 0) {
+    logger->error("Unable to open audio device: {0}", SDL_GetError());
+  } else {
+    audio.sample_rate = obtained_spec.freq;
+    SDL_PauseAudioDevice(audio_device, 0);
+  }
+  audio.latency = static_cast<size_t>(audio.sample_rate) * 3 / 100;
+  // a host frame's worth of emulated audio, before and after stretching
+  std::vector<int16_t> audio_samples(16384 * 2);
+  std::vector<int16_t> stretched_samples;
+  TimeStretch time_stretch(audio.sample_rate);
+
   // Create window and graphics context
   SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
   SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
@@ -271,46 +384,43 @@ int main(int argc, char **argv) {
   ImGui_ImplSDL2_InitForOpenGL(window, gl_context);
   ImGui_ImplOpenGL3_Init(glsl_version);
 
-  // Set up our game screen display texture
-  GLuint screen_texture;
-  glGenTextures(1, &screen_texture);
-  glBindTexture(GL_TEXTURE_2D, screen_texture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
-                  GL_CLAMP_TO_EDGE); // This is required on WebGL for non
-                                     // power-of-two textures
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); // Same
-
-  // Tile Map and BG Map textures
-  GLuint bg_texture, tile_map_texture;
-  glGenTextures(1, &bg_texture);
-  glBindTexture(GL_TEXTURE_2D, bg_texture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
-                  GL_CLAMP_TO_EDGE); // This is required on WebGL for non
-                                     // power-of-two textures
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); //
-  // Same
-
-  glGenTextures(1, &tile_map_texture);
-  glBindTexture(GL_TEXTURE_2D, tile_map_texture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
-                  GL_CLAMP_TO_EDGE); // This is required on WebGL for non
-                                     // power-of-two textures
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); //
-  // Same
+  // Game screen, Tile Map and BG Map textures. Storage is allocated once
+  // and then streamed to, the screen pixel buffer is reused every frame
+  auto screen_texture =
+      std::make_unique<StreamingTexture>(kScreenWidth, kScreenHeight);
+  auto tile_map_texture =
+      std::make_unique<StreamingTexture>(kTileViewWidth, kTileViewHeight);
+  auto bg_texture = std::make_unique<StreamingTexture>(kBackgroundMapSize,
+                                                       kBackgroundMapSize);
+  std::vector<uint8_t> screen_pixels(kScreenWidth * kScreenHeight * 4);
 
   using namespace std::chrono_literals;
   // A vertical refresh happens every 70224 cycles (17556 clocks) (140448 in GBC
   // double speed mode): 59,7275 Hz
   constexpr auto tickrate = 16.7427ms;
+  // frames emulated per host frame while fast forwarding
+  constexpr float fast_forward_speed = 4.0F;
   SDL_Event event;
   int cycles = 0;
   bool running = false;
+  bool fast_forward = false;
+  // held down, steps back through the rewind history a frame at a time
+  bool rewinding = false;
+  RewindBuffer rewind;
+  // where rewinding's stepped back to, put back after running the frame
+  // that's shown for it
+  StateSnapshot rewound{};
+  RunAhead run_ahead;
+  // F5 starts and stops recording an input movie, kept in <game>.ephm
+  MovieRecorder recorder;
+  const auto stop_recording = [&] {
+    if (!recorder.Recording()) return;
+    recorder.Stop(*gb);
+    logger->info("Saved movie to {0}.ephm", gb->Game());
+  };
+  float speed = 1.0F;
+  // fractional frames owed, whole frames get run once they add up
+  float frame_credit = 0;
   // GUI Checkboxes
   bool framelimit = false;
   bool ui_draw_bg_map = true;
@@ -321,9 +431,64 @@ int main(int argc, char **argv) {
     auto start = std::chrono::high_resolution_clock::now();
     cycles = 0;
     if (running) {
-      cycles += gb->Tick(
-          gb->max_cycles_per_vertical_refresh); // one full screen refresh
-                                                // worth of cycles
+      const float frame_speed = fast_forward ? fast_forward_speed : speed;
+      frame_credit += frame_speed;
+      const int frames = static_cast<int>(frame_credit);
+      frame_credit -= frames;
+      int frame_cycles = 0;
+      int audio_frames = 0;
+      const auto frame_done = [&](Gameboy &gb) {
+        recorder.FrameDone(gb);
+        // read after every frame, the APU only holds on to so much
+        audio_frames += gb.apu.ReadSamples(
+            audio_samples.data() + audio_frames * 2,
+            static_cast<int>(audio_samples.size() / 2) - audio_frames);
+      };
+      // look_ahead for the frame that's shown, nothing else needs it
+      const auto run_frame = [&](const bool look_ahead) {
+        if (look_ahead) {
+          frame_cycles = run_ahead.RunFrame(*gb, frame_done);
+        } else {
+          frame_cycles = gb->Tick(gb->max_cycles_per_vertical_refresh);
+          frame_done(*gb);
+        }
+        cycles += frame_cycles;
+      };
+      if (rewinding) {
+        // a snapshot back for every frame owed, then a frame run from the
+        // last one so there's a picture of it. That frame's undone again,
+        // it was never pushed, so letting go carries on from the snapshot
+        // without a gap in the history. Rewinding has no sound
+        bool stepped = false;
+        for (int i = 0; i < frames; ++i) stepped |= rewind.StepBack(*gb);
+        if (stepped) {
+          gb->Snapshot(rewound);
+          frame_cycles = gb->Tick(gb->max_cycles_per_vertical_refresh);
+          cycles += frame_cycles;
+          gb->Restore(rewound);
+        }
+      } else if (frames > 1) {
+        // only the last frame of the batch is worth rendering
+        const int render_interval = gb->ppu.GetRenderInterval();
+        gb->ppu.SetRenderInterval(0);
+        for (int i = 1; i < frames; ++i) {
+          run_frame(false);
+          rewind.Push(*gb);
+        }
+        gb->ppu.SetRenderInterval(render_interval);
+      }
+      if (frames > 0 && !rewinding) {
+        run_frame(true);
+        rewind.Push(*gb);
+        gb->apu.SetOutputRate(AudioRate(audio, frame_cycles));
+        // keep the pitch where it is whatever the speed
+        stretched_samples.clear();
+        time_stretch.SetTempo(frame_speed);
+        time_stretch.Process(audio_samples.data(), audio_frames,
+                             stretched_samples);
+        audio.ring.Write(stretched_samples.data(),
+                         stretched_samples.size() / 2);
+      }
     }
     while (SDL_PollEvent(&event)) {
       ImGui_ImplSDL2_ProcessEvent(&event);
@@ -342,9 +507,25 @@ int main(int argc, char **argv) {
           logger->info("Saving state");
           break;
         case SDLK_F3:
+          // the movie can't follow a jump like that
+          stop_recording();
           logger->info("Loading state");
           gb->LoadState();
           break;
+        case SDLK_TAB:
+          fast_forward = true;
+          break;
+        case SDLK_BACKSPACE:
+          stop_recording();
+          rewinding = true;
+          break;
+        case SDLK_F5:
+          if (recorder.Recording()) {
+            stop_recording();
+          } else if (recorder.Start(gb->Game() + ".ephm", *gb)) {
+            logger->info("Recording movie");
+          }
+          break;
         case SDLK_z:
           bitmask_clear(joypad[0], INPUT_B);
           break;
@@ -375,6 +556,12 @@ int main(int argc, char **argv) {
         break;
       case SDL_KEYUP:
         switch (event.key.keysym.sym) {
+        case SDLK_TAB:
+          fast_forward = false;
+          break;
+        case SDLK_BACKSPACE:
+          rewinding = false;
+          break;
         case SDLK_z:
           bitmask_set(joypad[0], INPUT_B);
           break;
@@ -408,7 +595,7 @@ int main(int argc, char **argv) {
       }
     }
 
-    gb->HandleInput(joypad);
+    recorder.HandleInput(*gb, joypad);
     ImGui_ImplOpenGL3_NewFrame();
     ImGui_ImplSDL2_NewFrame(window);
     ImGui::NewFrame();
@@ -446,8 +633,13 @@ int main(int argc, char **argv) {
                 if (ImGui::Selectable(p.path().string().c_str())) {
                   auto file = std::ifstream{p.path(), std::ios::binary};
                   auto cart = Load(file);
+                  stop_recording();
                   gb = std::make_unique<Gameboy>(*cart,
                                                  p.path().stem().string());
+                  rewind.Clear();
+                  run_ahead.Load(gb->Game());
+                  tile_map_texture->Invalidate();
+                  bg_texture->Invalidate();
                   running = true;
                 }
               }
@@ -479,41 +671,32 @@ int main(int argc, char **argv) {
       ImGui::EndMainMenuBar();
     }
     ImGui::Begin("Screen");
-    auto pixel_data = gb->ppu.Render().release();
-    glBindTexture(GL_TEXTURE_2D, screen_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 160, 144, 0, GL_RGBA,
-                 GL_UNSIGNED_BYTE, pixel_data);
+    gb->ppu.Render(screen_pixels.data());
+    screen_texture->Update(screen_pixels.data());
     ImVec2 sz = ImGui::GetContentRegionAvail();
-    ImGui::Image((void *)(intptr_t)screen_texture, sz);
-    delete[] pixel_data;
+    ImGui::Image((void *)(intptr_t)screen_texture->Id(), sz);
     ImGui::End();
 
     if (ui_draw_tile_map) {
       (ImGui::Begin("Tile Map"));
-      auto tile_map_data = gb->ppu.RenderTiles().release();
-      glBindTexture(GL_TEXTURE_2D, tile_map_texture);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 128, 192, 0, GL_RGBA,
-                   GL_UNSIGNED_BYTE, tile_map_data);
+      const DebugView &tiles = gb->ppu.RenderTiles();
+      tile_map_texture->Update(tiles.pixels.data(), tiles.version);
       sz = ImGui::GetContentRegionAvail();
-      ImGui::Image((void *)(intptr_t)tile_map_texture, sz);
-      delete[] tile_map_data;
+      ImGui::Image((void *)(intptr_t)tile_map_texture->Id(), sz);
       ImGui::End();
     }
 
     if (ui_draw_bg_map) {
       ImGui::Begin("BG Map");
-      auto bg_map_data = gb->ppu.RenderBackgroundTileMap().release();
-      glBindTexture(GL_TEXTURE_2D, bg_texture);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 256, 0, GL_RGBA,
-                   GL_UNSIGNED_BYTE, bg_map_data);
+      const DebugView &bg_map = gb->ppu.RenderBackgroundTileMap();
+      bg_texture->Update(bg_map.pixels.data(), bg_map.version);
       sz = ImGui::GetContentRegionAvail();
-      ImGui::Image((void *)(intptr_t)bg_texture, sz);
-      delete[] bg_map_data;
+      ImGui::Image((void *)(intptr_t)bg_texture->Id(), sz);
       ImGui::End();
     }
 
     if (ImGui::Begin("CPU Debug")) {
-      ShowCPUDebug(*gb, running);
+      ShowCPUDebug(*gb, running, speed, run_ahead);
     }
     ImGui::End();
 
@@ -554,7 +737,12 @@ int main(int argc, char **argv) {
           if (ImGui::Selectable(p.path().string().c_str())) {
             auto file = std::ifstream{p.path(), std::ios::binary};
             auto cart = Load(file);
+            stop_recording();
             gb = std::make_unique<Gameboy>(*cart, p.path().stem().string());
+            rewind.Clear();
+            run_ahead.Load(gb->Game());
+            tile_map_texture->Invalidate();
+            bg_texture->Invalidate();
             running = true;
           }
         }
@@ -604,11 +792,17 @@ int main(int argc, char **argv) {
       std::this_thread::sleep_for(tickrate - duration_us);
     }
   }
+  stop_recording();
 
+  // textures have to go before the GL context does
+  screen_texture.reset();
+  tile_map_texture.reset();
+  bg_texture.reset();
   ImGui_ImplOpenGL3_Shutdown();
   ImGui_ImplSDL2_Shutdown();
   ImGui::DestroyContext();
 
+  if (audio_device != 0) SDL_CloseAudioDevice(audio_device);
   SDL_GL_DeleteContext(gl_context);
   SDL_DestroyWindow(window);
 
@@ -1,6 +1,8 @@
 #include "mmu.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <vector>
@@ -10,37 +12,148 @@
 #include "ppu.h"
 #include "spdlog/spdlog.h"
 
+namespace {
+// Everything the PPU reads or owns: VRAM, OAM and LCDC through WX
+constexpr bool IsPPUAddress(const uint16_t address) {
+  return (address >= 0x8000 && address <= 0x9FFF) ||
+         (address >= 0xFE00 && address <= 0xFE9F) ||
+         (address >= LCDC && address <= WX);
+}
+}  // namespace
+
 MMU::MMU(std::vector<uint8_t> &cart, const bool boot_rom)
-    : boot_rom_enabled(boot_rom), cartridge_(cart) {
-  Load(cartridge_);
+    : boot_rom_enabled(boot_rom) {
+  Load(cart);
 }
 
 void MMU::Load(std::vector<uint8_t> &c) {
   if (c.empty()) return;
 
-  rom_banks = (32 << cartridge_[0x0148]) / 16;
+  cartridge_size_ = c.size();
+  cart_checksum_ = 14695981039346656037ULL;
+  for (const uint8_t byte : c) {
+    cart_checksum_ = (cart_checksum_ ^ byte) * 1099511628211ULL;
+  }
+  rom_banks = (32 << c[0x0148]) / 16;
   spdlog::get("stdout")->debug("Rom Banks: {0}", rom_banks);
   // TODO: fix ram bank
-  num_ram_banks = external_ram_size_[cartridge_[0x0149]];
+  num_ram_banks = external_ram_size_[c[0x0149]];
   spdlog::get("stdout")->debug("Ram Banks: {0}", num_ram_banks);
-  memory_bank_controller_ = static_cast<CartridgeType>(cartridge_[0x0147]);
-  std::fill(memory_.begin() + 0xA000, memory_.begin() + 0xC000, 0xFF);
-  if (num_ram_banks > 1) {
-    ram_banks_.resize(num_ram_banks);
-  } else {
-    ram_banks_.resize(1);
+  memory_bank_controller_ = static_cast<CartridgeType>(c[0x0147]);
+  std::fill_n(memory_.MutableData(0xA000), kMemoryPageSize, 0xFF);
+  ram_banks_.resize(num_ram_banks > 1 ? num_ram_banks : 1);
+  for (SharedPage &bank : ram_banks_) bank = std::make_shared<MemoryPage>();
+  // break the cart into 8kB pages (two to a bank), that get mapped in as the
+  // ROM and the first switchable bank and are shared by every clone.
+  // Anything past the end of a short cart reads 0
+  const int rom_pages_count = (rom_banks > 2 ? rom_banks : 2) * 2;
+  auto rom_pages = std::make_shared<std::vector<SharedPage>>(rom_pages_count);
+  for (size_t i = 0; i < rom_pages->size(); ++i) {
+    SharedPage &page = (*rom_pages)[i] = std::make_shared<MemoryPage>();
+    const size_t start = i * kMemoryPageSize;
+    if (start < c.size()) {
+      std::copy_n(c.begin() + start,
+                  std::min(kMemoryPageSize, c.size() - start), page->begin());
+    }
   }
-  if (rom_banks <= 2) {
-    std::copy(cartridge_.begin(), cartridge_.end(), memory_.begin());
-  } else {
-    // load the ROM and the first switchable bank, break the cart into it's
-    // individual 8kB banks, and store them for easy usage later
-    cart_rom_banks_.resize(rom_banks);
-    std::copy_n(cartridge_.begin(), 0x8000, memory_.begin());
-    for (int i = 0; i < rom_banks; ++i) {
-      std::copy_n(c.begin() + (0x4000 * i), 0x4000, cart_rom_banks_[i].begin());
+  rom_pages_ = std::move(rom_pages);
+  MapRomBank(1);
+}
+
+void MMU::MapRomBank(const int bank) {
+  rom_bank_ = bank;
+  const std::vector<SharedPage> &pages = *rom_pages_;
+  memory_.MapPage(0x0000, pages[0]);
+  memory_.MapPage(0x2000, pages[1]);
+  memory_.MapPage(0x4000, pages[bank * 2]);
+  memory_.MapPage(0x6000, pages[bank * 2 + 1]);
+}
+
+void MMU::RemapRom() {
+  rom_bank_ = -1;
+  if (!rom_pages_) return;
+  const std::vector<SharedPage> &pages = *rom_pages_;
+  const auto matches = [this, &pages](const uint16_t address, const int page) {
+    return std::memcmp(memory_.Data(address), pages[page]->data(),
+                       kMemoryPageSize) == 0;
+  };
+  if (matches(0x0000, 0) && matches(0x2000, 1)) {
+    for (size_t bank = 0; bank < pages.size() / 2; ++bank) {
+      if (matches(0x4000, bank * 2) && matches(0x6000, bank * 2 + 1)) {
+        MapRomBank(static_cast<int>(bank));
+        return;
+      }
     }
   }
+  spdlog::get("stdout")->warn("State's ROM doesn't match the cartridge");
+}
+
+bool MMU::EchoMirrored() const {
+  return std::memcmp(memory_.Data(0xE000), memory_.Data(0xC000), 0x1E00) == 0;
+}
+
+bool MMU::IsBlank(const MemoryPage &page) {
+  return std::all_of(page.begin(), page.end(),
+                     [](const uint8_t byte) { return byte == 0; });
+}
+
+void MMU::FillSkipped(const bool echo_mirrored) {
+  if (ram_enabled_) {
+    ram_banks_[active_ram_bank_] = memory_.SharePage(0xA000);
+  } else {
+    std::fill_n(memory_.OverwritePage(0xA000), kMemoryPageSize, 0xFF);
+  }
+  if (echo_mirrored) {
+    std::copy_n(memory_.Data(0xC000), 0x1E00, memory_.MutableData(0xE000));
+  }
+  if (rom_pages_) MapRomBank(rom_bank_ >= 0 ? rom_bank_ : 1);
+}
+
+void MMU::Snapshot(MMUState &state, std::vector<SharedPage> &ram_banks) const {
+  std::copy_n(memory_.Data(0x8000), 0x2000, state.memory.begin());
+  std::copy_n(memory_.Data(0xA000), 0x2000, state.memory.begin() + 0x2000);
+  std::copy_n(memory_.Data(0xC000), 0x2000, state.memory.begin() + 0x4000);
+  std::copy_n(memory_.Data(0xE000), 0x2000, state.memory.begin() + 0x6000);
+  state.cart_checksum = cart_checksum_;
+  state.rom_banks = rom_banks;
+  state.num_ram_banks = num_ram_banks;
+  state.rom_bank = rom_bank_;
+  state.active_rom_bank = active_rom_bank_;
+  state.active_ram_bank = active_ram_bank_;
+  state.ram_banking_mode = ram_banking_mode_;
+  state.ram_enabled = ram_enabled_;
+  state.rtc_enabled = rtc_enabled_;
+  state.boot_rom_enabled = boot_rom_enabled;
+  state.cart_ram_modified = cart_ram_modified;
+  state.joypad = joypad;
+  state.divider = divider;
+  ram_banks = ram_banks_;
+}
+
+bool MMU::Restore(const MMUState &state,
+                  const std::vector<SharedPage> &ram_banks) {
+  if (state.cart_checksum != cart_checksum_ || state.rom_banks != rom_banks ||
+      ram_banks.size() != ram_banks_.size()) {
+    return false;
+  }
+  for (uint16_t address = 0x8000, offset = 0; offset < 0x8000;
+       address += 0x2000, offset += 0x2000) {
+    std::copy_n(state.memory.begin() + offset, 0x2000,
+                memory_.OverwritePage(address));
+  }
+  ram_banks_ = ram_banks;
+  if (state.rom_bank >= 0 && rom_pages_) MapRomBank(state.rom_bank);
+  num_ram_banks = state.num_ram_banks;
+  active_rom_bank_ = state.active_rom_bank;
+  active_ram_bank_ = state.active_ram_bank;
+  ram_banking_mode_ = state.ram_banking_mode;
+  ram_enabled_ = state.ram_enabled;
+  rtc_enabled_ = state.rtc_enabled;
+  boot_rom_enabled = state.boot_rom_enabled;
+  cart_ram_modified = state.cart_ram_modified;
+  joypad = state.joypad;
+  divider = state.divider;
+  return true;
 }
 
 void MMU::ShowDebugWindow() {}
@@ -49,11 +162,11 @@ void MMU::SetPPUMode(const uint8_t mode) {
   // invalid mode
   if (mode > 0x03) return;
 
-  bitmask_clear(memory_[STAT], 0x03);
-  bitmask_set(memory_[STAT], mode);
+  bitmask_clear(memory_.At(STAT), 0x03);
+  bitmask_set(memory_.At(STAT), mode);
 }
 
-void MMU::SaveBufferedRAM(std::ofstream &ofs) {
+void MMU::SaveBufferedRAM(std::ostream &ofs) {
   // only save if we would have a battery onboard
   switch (memory_bank_controller_) {
     case CartridgeType::kMBC1wRAMwBattery:
@@ -68,8 +181,7 @@ void MMU::SaveBufferedRAM(std::ofstream &ofs) {
     case CartridgeType::kMBC7wSensorwRumblewRAMwBattery: {
       // TODO: save/load all RAM banks
       if (ram_enabled_) {
-        std::copy(memory_.begin() + 0xA000, memory_.begin() + 0xC000,
-                  ram_banks_[active_ram_bank_].begin());
+        ram_banks_[active_ram_bank_] = memory_.SharePage(0xA000);
         spdlog::get("stdout")->debug("Updating saved ram bank {0}",
                                      active_ram_bank_);
       }
@@ -84,7 +196,7 @@ void MMU::SaveBufferedRAM(std::ofstream &ofs) {
             "SaveBufferedRAM(): Saving ram bank {0} of {1}", i + 1,
             num_ram_banks);
         for (int j = 0; j < 0x2000; ++j) {
-          ofs << ram_banks_[i][j];
+          ofs << (*ram_banks_[i])[j];
         }
       }
       break;
@@ -97,7 +209,7 @@ void MMU::SaveBufferedRAM(std::ofstream &ofs) {
   }
 }
 
-void MMU::LoadBufferedRAM(std::ifstream &ifs) {
+void MMU::LoadBufferedRAM(std::istream &ifs) {
   // only save if we would have a battery onboard
   switch (memory_bank_controller_) {
     case CartridgeType::kMBC1wRAMwBattery:
@@ -113,7 +225,12 @@ void MMU::LoadBufferedRAM(std::ifstream &ifs) {
       std::istreambuf_iterator<char> in_it(ifs);
       std::istreambuf_iterator<char> end;
       for (int i = 0; i < num_ram_banks; ++i) {
-        std::copy(in_it, end, ram_banks_[i].begin());
+        auto bank = std::make_shared<MemoryPage>();
+        for (uint8_t &byte : *bank) {
+          if (in_it == end) break;
+          byte = static_cast<uint8_t>(*in_it++);
+        }
+        ram_banks_[i] = std::move(bank);
       }
       spdlog::get("stdout")->info("LoadBufferedRAM(): Loading {0} ram banks",
                                   num_ram_banks);
@@ -121,8 +238,7 @@ void MMU::LoadBufferedRAM(std::ifstream &ifs) {
       // since apparently the game won't necessarily bank switch on start up
       // TODO: no longer necessary??
       if (ram_enabled_) {
-        std::copy(ram_banks_[active_ram_bank_].begin(),
-                  ram_banks_[active_ram_bank_].end(), memory_.begin() + 0xA000);
+        memory_.MapPage(0xA000, ram_banks_[active_ram_bank_]);
         spdlog::get("stdout")->debug(
             "LoadBufferedRAM(): Copying ram bank {0} to memory",
             active_ram_bank_);
@@ -138,8 +254,19 @@ void MMU::LoadBufferedRAM(std::ifstream &ifs) {
 }
 
 uint8_t MMU::ReadByte(const uint16_t address) {
+  // Nearly every read is an instruction fetch from ROM or a variable/stack
+  // access in WRAM or HRAM, none of which need any of the checks below
+  if (address < 0x8000) {
+    if (boot_rom_enabled && address <= 0xFF) return boot_rom_[address];
+    return cartridge_size_ == 0 ? 0xFF : memory_[address];
+  }
+  if ((address >= 0xC000 && address <= 0xFDFF) ||
+      (address >= 0xFF80 && address <= 0xFFFE)) {
+    return memory_[address];
+  }
+  if (ppu_ && IsPPUAddress(address)) ppu_->CatchUp();
   if (boot_rom_enabled && address <= 0xFF) return boot_rom_[address];
-  if (cartridge_.empty() && address < 0x8000) return 0xFF;
+  if (cartridge_size_ == 0 && address < 0x8000) return 0xFF;
   // PPU mode
   const uint8_t ppu_mode = memory_[STAT] & 0x03;
   // Vram inaccessible during mode 3
@@ -161,26 +288,31 @@ uint8_t MMU::ReadByte(const uint16_t address) {
     return 0;
   }
   /* IO Registers */
+  // Sound registers and wave RAM
+  if (apu_ && address >= NR10 && address <= 0xFF3F) {
+    return apu_->ReadRegister(address);
+  }
   // joypad bits 6 and 7 always return 1
   if (address == P1) {
-    bitmask_set(memory_[address], 0xC0);  // should be C0
+    bitmask_set(memory_.At(address), 0xC0);  // should be C0
   }
   // bit 7 unused and always returns 1, bits 0-2 return 0 when LCD is off
   if (address == STAT) {
-    bitmask_set(memory_[address], 0x80);
+    bitmask_set(memory_.At(address), 0x80);
     if (!bit_check(memory_[LCDC], 7)) {
-      bitmask_clear(memory_[address], 0x03);
+      bitmask_clear(memory_.At(address), 0x03);
     }
   }
   // upper 3 bits always return 1
   if (address == IF) {
-    bitmask_set(memory_[address], 0xE0);
+    bitmask_set(memory_.At(address), 0xE0);
   }
 
   return memory_[address];  // needs more logic regarding certain addresses
 }
 
 void MMU::WriteByte(const uint16_t address, uint8_t value) {
+  if (ppu_ && IsPPUAddress(address)) ppu_->CatchUp();
   if (address == 0xFF50 && value == 0x01) {
     boot_rom_enabled = false;
   }
@@ -191,18 +323,16 @@ void MMU::WriteByte(const uint16_t address, uint8_t value) {
       // load our ram bank back into memory, as it's been re "connected"
       if (ram_enabled_) return;
       ram_enabled_ = true;
-      std::copy(ram_banks_[active_ram_bank_].begin(),
-                ram_banks_[active_ram_bank_].end(), memory_.begin() + 0xA000);
+      memory_.MapPage(0xA000, ram_banks_[active_ram_bank_]);
       spdlog::get("stdout")->debug("Ram enabled, loading bank {0}",
                                    active_ram_bank_);
     } else {
       if (!ram_enabled_) return;
       ram_enabled_ = false;
       // our cart ram has been disconnected, so save it
-      std::copy(memory_.begin() + 0xA000, memory_.begin() + 0xC000,
-                ram_banks_[active_ram_bank_].begin());
+      ram_banks_[active_ram_bank_] = memory_.SharePage(0xA000);
       // then fill the address space with FF
-      std::fill(memory_.begin() + 0xA000, memory_.begin() + 0xC000, 0xFF);
+      std::fill_n(memory_.MutableData(0xA000), kMemoryPageSize, 0xFF);
       spdlog::get("stdout")->debug("Ram disabled, filling sram with ff");
     }
     // spdlog::get("stdout")->debug("Ram enabled: {0}", ram_enabled_);
@@ -321,10 +451,20 @@ void MMU::WriteByte(const uint16_t address, uint8_t value) {
     // spdlog::get("stdout")->debug("Invalid VRam Access @ {0:04X}", address);
     return;
   }
+  if (address <= 0x9FFF) {
+    memory_.At(address) = value;
+    ++vram_generation_;
+    if (address < 0x9800) {
+      tile_generation_[(address - 0x8000) >> 4] = vram_generation_;
+    } else {
+      map_generation_[address - 0x9800] = vram_generation_;
+    }
+    return;
+  }
   if (address >= 0xA000 && address <= 0xBFFF) {
     // No accessing Cartridge (External) RAM unless it's enabled
     if (ram_enabled_) {
-      memory_[address] = value;
+      memory_.At(address) = value;
       cart_ram_modified = true;
     } else {
       spdlog::get("stdout")->debug("Invalid SRam Access @ {0:04X}", address);
@@ -333,13 +473,13 @@ void MMU::WriteByte(const uint16_t address, uint8_t value) {
   }
   // write to "mirror" ram too
   if (address >= 0xC000 && address <= 0xDDFF) {
-    memory_[address] = value;
-    memory_[address + 0x2000] = value;
+    memory_.At(address) = value;
+    memory_.At(address + 0x2000) = value;
     return;
   }
   // Writes to DIV reset it
   if (address == DIV) {
-    Gameboy::SetTimer(0);
+    divider = 0;
     return;
     // spdlog::get("stdout")->debug("Timer divider set to 0");
   }
@@ -348,24 +488,24 @@ void MMU::WriteByte(const uint16_t address, uint8_t value) {
   if (address == P1) {
     // spdlog::get("stdout")->debug("write to P1: {0:02x}", val);
     // clear the 2 selection bits
-    // bitmask_clear(memory_[loc], 0x30);
-    bitmask_set(memory_[address], value);
+    // bitmask_clear(memory_.At(loc), 0x30);
+    bitmask_set(memory_.At(address), value);
     switch ((value >> 4) & 0x03) {
       case 0x01:
         // start, sel, a, b selected
-        bitmask_clear(memory_[address], 0x0f);
-        bitmask_set(memory_[address], Gameboy::joypad[0] & 0xf);
+        bitmask_clear(memory_.At(address), 0x0f);
+        bitmask_set(memory_.At(address), joypad[0] & 0xf);
         break;
       case 0x02:
         // direction pad
-        bitmask_clear(memory_[address], 0x0f);
-        bitmask_set(memory_[address], Gameboy::joypad[1] & 0xf);
+        bitmask_clear(memory_.At(address), 0x0f);
+        bitmask_set(memory_.At(address), joypad[1] & 0xf);
         break;
       case 0x03:
         // any button?
-        bitmask_clear(memory_[address], 0x0f);
-        bitmask_set(memory_[address],
-                    (Gameboy::joypad[0] | Gameboy::joypad[1]) & 0xf);
+        bitmask_clear(memory_.At(address), 0x0f);
+        bitmask_set(memory_.At(address),
+                    (joypad[0] | joypad[1]) & 0xf);
         break;
       default:
         spdlog::get("stdout")->error("Incorrect value in P1: {0:02x}", value);
@@ -381,13 +521,16 @@ void MMU::WriteByte(const uint16_t address, uint8_t value) {
     // val is the MSB of our source xfer address
     const uint16_t src = value << 8;
     // bottom of OEM Ram
-    const uint16_t dest = 0xFE00;
-    for (auto i = 0; i < 160; i += 4) {
-      memory_[dest + i] = memory_[src + i];
-      memory_[dest + (i + 1)] = memory_[src + (i + 1)];
-      memory_[dest + (i + 2)] = memory_[src + (i + 2)];
-      memory_[dest + (i + 3)] = memory_[src + (i + 3)];
-    }
+    uint8_t *dest = memory_.MutableData(0xFE00);
+    // 160 bytes never cross a page from a 256 byte boundary
+    std::copy_n(memory_.Data(src), 160, dest);
+    ++oam_generation_;
+    return;
+  }
+
+  if (address >= 0xFE00 && address <= 0xFE9F) {
+    memory_.At(address) = value;
+    ++oam_generation_;
     return;
   }
 
@@ -398,14 +541,13 @@ void MMU::WriteByte(const uint16_t address, uint8_t value) {
     return;
   }
 
-  // Audio regs
-  if (address >= NR10 && address <= NR52) {
-    // spdlog::get("stdout")->debug("Write to sound register {0:04X} : {1:02X}",
-    //                             address, value);
+  // Audio regs, memory keeps a copy for the debugger
+  if (apu_ && address >= NR10 && address <= 0xFF3F) {
+    apu_->WriteRegister(address, value);
   }
 
-  memory_.at(address) = value;
-  // memory_[loc] = val;
+  memory_.At(address) = value;
+  // memory_.At(loc) = val;
 }
 
 void MMU::SelectRomBank(uint8_t bank) {
@@ -421,24 +563,33 @@ void MMU::SelectRomBank(uint8_t bank) {
     ++bank;  // writing a 0 selects bank 1
   }
 
+  if (!rom_pages_) return;
   bank %= rom_banks;
   // spdlog::get("stdout")->debug("selecting rom bank {0}", bank);
-  std::copy(cart_rom_banks_[bank].begin(), cart_rom_banks_[bank].end(),
-            memory_.begin() + 0x4000);
+  rom_bank_ = bank;
+  memory_.MapPage(0x4000, (*rom_pages_)[bank * 2]);
+  memory_.MapPage(0x6000, (*rom_pages_)[bank * 2 + 1]);
 }
 
 void MMU::SelectRamBank(const uint8_t bank) {
   // save the current ram banks state first
   if (ram_enabled_) {
-    std::copy(memory_.begin() + 0xA000, memory_.begin() + 0xC000,
-              ram_banks_[active_ram_bank_].begin());
+    ram_banks_[active_ram_bank_] = memory_.SharePage(0xA000);
   }
   // should we need this?
   num_ram_banks > 0 ? active_ram_bank_ = bank % num_ram_banks
                     : active_ram_bank_ = 0;
   spdlog::get("stdout")->debug("Selected RAM bank {0}", active_ram_bank_);
-  std::copy(ram_banks_[active_ram_bank_].begin(),
-            ram_banks_[active_ram_bank_].end(), memory_.begin() + 0xA000);
+  // while disabled 0xA000 stays all 0xFF, enabling RAM maps the bank in
+  if (ram_enabled_) {
+    memory_.MapPage(0xA000, ram_banks_[active_ram_bank_]);
+  }
+}
+
+void MMU::InvalidateVram() {
+  ++vram_generation_;
+  tile_generation_.fill(vram_generation_);
+  map_generation_.fill(vram_generation_);
 }
 
 void MMU::SetRegister(uint16_t reg, uint8_t val) {
@@ -448,7 +599,7 @@ void MMU::SetRegister(uint16_t reg, uint8_t val) {
   // to them to reset as appropriate or whatever.
   if (reg < 0xFF00) return;
 
-  memory_[reg] = val;
+  memory_.At(reg) = val;
 }
 
 uint8_t MMU::GetRegister(uint16_t reg) const {
@@ -4,9 +4,12 @@
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <iosfwd>
 #include <memory>
 #include <vector>
 
+#include "paged_memory.h"
+
 enum class CartridgeType {
   kROMOnly = 0,
   kMBC1,
@@ -37,10 +40,37 @@ enum class CartridgeType {
   kHuC3,
   kHuC1wRAMwBattery
 };
+class APU;
+class PPU;
+
+// The MMU's part of Gameboy::Snapshot(), as plain data. The ROM isn't
+// kept, only which bank was switched in and which cart it was, and the
+// cart's RAM banks go alongside
+struct MMUState {
+  // 0x8000 - 0xFFFF
+  std::array<uint8_t, 0x8000> memory;
+  uint64_t cart_checksum;
+  int rom_banks;
+  int num_ram_banks;
+  int rom_bank;
+  uint8_t active_rom_bank;
+  uint8_t active_ram_bank;
+  bool ram_banking_mode;
+  bool ram_enabled;
+  bool rtc_enabled;
+  bool boot_rom_enabled;
+  bool cart_ram_modified;
+  std::array<uint8_t, 2> joypad;
+  uint16_t divider;
+};
+
 class MMU {
 public:
   MMU() = default;
   MMU(std::vector<uint8_t> &cart, bool boot_rom = false);
+  // Copies share all of memory, the ROM and the RAM banks copy on write.
+  // The PPU and APU still need attaching to the copy
+  MMU(const MMU &) = default;
   void ShowDebugWindow();
   void Load(std::vector<uint8_t> &c);
   uint8_t ReadByte(uint16_t address);
@@ -48,35 +78,153 @@ public:
   void SetRegister(uint16_t reg, uint8_t val);
   uint8_t GetRegister(uint16_t reg) const;
   void SetPPUMode(uint8_t mode);
-  void SaveBufferedRAM(std::ofstream &ofs);
-  void LoadBufferedRAM(std::ifstream &ifs);
-  size_t CartridgeSize() const { return cartridge_.size(); }
+  void Snapshot(MMUState &state, std::vector<SharedPage> &ram_banks) const;
+  // false (and nothing restored) if it's of a different cart
+  bool Restore(const MMUState &state,
+               const std::vector<SharedPage> &ram_banks);
+  void SaveBufferedRAM(std::ostream &ofs);
+  void LoadBufferedRAM(std::istream &ifs);
+  size_t CartridgeSize() const { return cartridge_size_; }
   CartridgeType GetCartridgeType() const { return memory_bank_controller_; }
   std::unique_ptr<std::vector<uint8_t>>
   DebugShowMemory(uint16_t start_address, uint16_t end_address) const {
-    std::vector<uint8_t> memory{memory_.begin() + start_address,
-                                memory_.begin() + end_address + 1};
-    return std::make_unique<std::vector<uint8_t>>(memory);
-  }
-  const std::vector<std::array<uint8_t, 0x2000>> *DebugRamBanks() const {
-    return &ram_banks_;
+    auto memory = std::make_unique<std::vector<uint8_t>>();
+    memory->reserve(end_address - start_address + 1);
+    for (int address = start_address; address <= end_address; ++address) {
+      memory->push_back(memory_[address]);
+    }
+    return memory;
   }
+  const std::vector<SharedPage> *DebugRamBanks() const { return &ram_banks_; }
+  // Direct view of VRAM (0x8000 - 0x9FFF) regardless of PPU mode, for the
+  // renderers that need to look at it without going through ReadByte.
+  // Only good until the next write, the page can move
+  const uint8_t *Vram() const { return memory_.Data(0x8000); }
+  // VRAM write tracking. Every write bumps the generation counter and stamps
+  // the tile (16 bytes of tile data) or the map entry it landed in, so
+  // anything caching VRAM contents can tell exactly what's changed since it
+  // last looked.
+  uint32_t VramGeneration() const { return vram_generation_; }
+  uint32_t TileGeneration(int tile) const { return tile_generation_[tile]; }
+  uint32_t MapGeneration(int entry) const { return map_generation_[entry]; }
+  // Mark all of VRAM as modified, eg. after loading a save state
+  void InvalidateVram();
+  // Direct view of OAM (0xFE00 - 0xFE9F) and a counter bumped on every write
+  // or DMA transfer to it
+  const uint8_t *Oam() const { return memory_.Data(0xFE00); }
+  uint32_t OamGeneration() const { return oam_generation_; }
+  void InvalidateOam() { ++oam_generation_; }
+  // The PPU only runs when it has to, it gets caught up whenever VRAM, OAM
+  // or one of its registers is accessed
+  void AttachPPU(PPU *ppu) { ppu_ = ppu; }
+  // Sound registers and wave RAM are handled by the APU
+  void AttachAPU(APU *apu) { apu_ = apu; }
   // total amount of 8kB memory banks we have
   int rom_banks = 0;
   int num_ram_banks = 0;
   bool boot_rom_enabled = true;
   bool cart_ram_modified = false;
-  template <class Archive> void serialize(Archive &archive) {
-    archive(rom_banks, num_ram_banks, cart_ram_modified, memory_, ram_banks_,
+  // Buttons held, active low: start/select/b/a in [0], the d-pad in [1].
+  // P1 reads whichever rows the game has selected
+  std::array<uint8_t, 2> joypad{{0xf, 0xf}};
+  // Counter behind DIV, the register is its upper byte. Writing DIV resets
+  // it, the Gameboy's timer keeps it counting
+  uint16_t divider = 0;
+  // Only what the cart can't give back: the ROM area is left out (just
+  // which bank was in), as are cart RAM while disabled (all 0xFF), echo RAM
+  // while it mirrors WRAM, and RAM banks never written to. Older states
+  // have the whole 64kB and every bank, and rom_banks where these have
+  // kSlimState, so they still load
+  template <class Archive> void save(Archive &archive) const {
+    archive(kSlimState, rom_banks, num_ram_banks, cart_ram_modified,
+            rom_bank_, active_rom_bank_, active_ram_bank_, ram_banking_mode_,
+            ram_enabled_);
+    SaveRange(archive, 0x8000, 0x2000);  // VRAM
+    if (ram_enabled_) SaveRange(archive, 0xA000, 0x2000);
+    SaveRange(archive, 0xC000, 0x2000);  // WRAM
+    const bool echo_mirrored = EchoMirrored();
+    archive(echo_mirrored);
+    if (!echo_mirrored) SaveRange(archive, 0xE000, 0x1E00);
+    SaveRange(archive, 0xFE00, 0x200);  // OAM, IO and HRAM
+    archive(cereal::make_size_tag(
+        static_cast<cereal::size_type>(ram_banks_.size())));
+    for (size_t i = 0; i < ram_banks_.size(); ++i) {
+      // the bank switched in is out of date, it's the one at 0xA000
+      const bool skipped = (ram_enabled_ && i == active_ram_bank_) ||
+                           IsBlank(*ram_banks_[i]);
+      archive(skipped);
+      if (!skipped) {
+        archive(cereal::binary_data(ram_banks_[i]->data(), kMemoryPageSize));
+      }
+    }
+  }
+  template <class Archive> void load(Archive &archive) {
+    int format = 0;
+    archive(format);
+    if (format != kSlimState) {
+      // the same layout as when memory was a std::array and the RAM banks a
+      // std::vector of them
+      rom_banks = format;
+      archive(num_ram_banks, cart_ram_modified, memory_);
+      LoadPages(archive, ram_banks_);
+      archive(active_rom_bank_, active_ram_bank_, ram_banking_mode_,
+              ram_enabled_);
+      RemapRom();
+      return;
+    }
+    archive(rom_banks, num_ram_banks, cart_ram_modified, rom_bank_,
             active_rom_bank_, active_ram_bank_, ram_banking_mode_,
             ram_enabled_);
+    archive(cereal::binary_data(memory_.OverwritePage(0x8000), 0x2000));
+    if (ram_enabled_) {
+      archive(cereal::binary_data(memory_.OverwritePage(0xA000), 0x2000));
+    }
+    archive(cereal::binary_data(memory_.OverwritePage(0xC000), 0x2000));
+    bool echo_mirrored = true;
+    archive(echo_mirrored);
+    if (!echo_mirrored) {
+      archive(cereal::binary_data(memory_.OverwritePage(0xE000), 0x1E00));
+    }
+    archive(cereal::binary_data(memory_.MutableData(0xFE00), 0x200));
+    cereal::size_type banks = 0;
+    archive(cereal::make_size_tag(banks));
+    ram_banks_.resize(static_cast<size_t>(banks));
+    for (SharedPage &bank : ram_banks_) {
+      bank = std::make_shared<MemoryPage>();
+      bool skipped = true;
+      archive(skipped);
+      if (!skipped) archive(cereal::binary_data(bank->data(), kMemoryPageSize));
+    }
+    FillSkipped(echo_mirrored);
   }
 
 private:
-  std::array<uint8_t, 0x10000> memory_{};
-  std::vector<uint8_t> cartridge_{};
-  std::vector<std::array<uint8_t, 0x4000>> cart_rom_banks_{};
-  std::vector<std::array<uint8_t, 0x2000>> ram_banks_{};
+  PagedMemory memory_{};
+  size_t cartridge_size_ = 0;
+  // FNV-1a of the whole cart, what a snapshot is checked against
+  uint64_t cart_checksum_ = 0;
+  // The cart in 8kB pages, bank n is pages 2n and 2n + 1
+  std::shared_ptr<const std::vector<SharedPage>> rom_pages_{};
+  // bank switched in at 0x4000, -1 if the ROM area isn't the cart's
+  int rom_bank_ = -1;
+  void MapRomBank(int bank);
+  // Share the cart's pages again after loading an older state, which has
+  // its own copy of the ROM area but not which bank that was
+  void RemapRom();
+  // First in a state saved by save(), an older one has rom_banks there
+  static constexpr int kSlimState = -1;
+  template <class Archive>
+  void SaveRange(Archive &archive, uint16_t address, size_t size) const {
+    archive(cereal::binary_data(memory_.Data(address), size));
+  }
+  // 0xE000 - 0xFDFF the same as 0xC000 - 0xDDFF, as it nearly always is
+  bool EchoMirrored() const;
+  static bool IsBlank(const MemoryPage &page);
+  // Put back what load() left out of a slim state
+  void FillSkipped(bool echo_mirrored);
+  // Never written in place, a bank is replaced by whatever was mapped in at
+  // 0xA000 when it's switched out
+  std::vector<SharedPage> ram_banks_{};
   uint8_t active_rom_bank_ = 0;
   uint8_t active_ram_bank_ = 0;
   bool ram_banking_mode_{};
@@ -84,6 +232,13 @@ private:
   void SelectRomBank(uint8_t bank);
   void SelectRamBank(uint8_t bank);
   CartridgeType memory_bank_controller_{};
+  PPU *ppu_ = nullptr;
+  APU *apu_ = nullptr;
+  // VRAM write tracking, 384 tiles at 0x8000 and 2 maps of 32x32 at 0x9800
+  uint32_t vram_generation_ = 0;
+  std::array<uint32_t, 384> tile_generation_{};
+  std::array<uint32_t, 2048> map_generation_{};
+  uint32_t oam_generation_ = 0;
   // MBC3
   bool rtc_enabled_{};
   // Memory Banking
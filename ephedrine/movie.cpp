@@ -0,0 +1,609 @@
+#include "movie.h"
+
+#include <algorithm>
+#include <sstream>
+#include <utility>
+
+#include "spdlog/spdlog.h"
+
+namespace {
+constexpr char kMagic[4] = {'E', 'P', 'H', 'M'};
+constexpr uint64_t kVersion = 1;
+// The header's followed by records, each starting with a varint of the
+// frames since the last one << 2 | its kind. An input is followed by its
+// two bytes, a check by its hash (8 bytes, little endian), a keyframe by a
+// varint of its size and the packed snapshot. The end only says how long
+// the movie is
+enum RecordKind { kInput = 0, kCheck = 1, kEnd = 2, kKeyframe = 3 };
+// After the end: the length in frames, how many keyframes, then each one's
+// frame and offset (both as varints of the difference from the last). The
+// file finishes with the index's offset (8 bytes, little endian) and this
+constexpr char kIndexMagic[4] = {'E', 'P', 'H', 'I'};
+constexpr uint64_t kFooterSize = 8 + sizeof(kIndexMagic);
+// nothing's ever going to be this big
+constexpr uint64_t kMaxPacked = 64 << 20;
+
+void PutVarint(std::vector<uint8_t> &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+bool GetVarint(std::istream &in, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    const int byte = in.get();
+    if (byte == std::char_traits<char>::eof()) return false;
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+void PutLE(std::vector<uint8_t> &out, const uint64_t value, const int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out.push_back(static_cast<uint8_t>(value >> (i * 8)));
+  }
+}
+
+bool GetLE(std::istream &in, uint64_t &value, const int bytes) {
+  value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    const int byte = in.get();
+    if (byte == std::char_traits<char>::eof()) return false;
+    value |= static_cast<uint64_t>(byte) << (i * 8);
+  }
+  return true;
+}
+
+bool Skip(std::istream &in, const uint64_t bytes) {
+  in.ignore(static_cast<std::streamsize>(bytes));
+  return static_cast<uint64_t>(in.gcount()) == bytes;
+}
+
+void WriteBytes(std::ofstream &ofs, const std::vector<uint8_t> &bytes) {
+  ofs.write(reinterpret_cast<const char *>(bytes.data()),
+            static_cast<std::streamsize>(bytes.size()));
+}
+
+class Fnv {
+ public:
+  void Add(const uint8_t *data, const size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      hash_ = (hash_ ^ data[i]) * 1099511628211ULL;
+    }
+  }
+  // little endian whatever the host is
+  void Add(const uint64_t value, const int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+      hash_ = (hash_ ^ ((value >> (i * 8)) & 0xFF)) * 1099511628211ULL;
+    }
+  }
+  uint64_t Hash() const { return hash_; }
+
+ private:
+  uint64_t hash_ = 14695981039346656037ULL;
+};
+}  // namespace
+
+uint64_t StateHash(const StateSnapshot &snapshot) {
+  const MachineState &machine = snapshot.machine;
+  Fnv fnv;
+  const Registers &registers = machine.cpu.registers;
+  fnv.Add(registers.af, 2);
+  fnv.Add(registers.bc, 2);
+  fnv.Add(registers.de, 2);
+  fnv.Add(registers.hl, 2);
+  fnv.Add(machine.cpu.sp, 2);
+  fnv.Add(machine.cpu.pc, 2);
+  const Flags &flags = machine.cpu.flags;
+  fnv.Add(flags.z << 3 | flags.n << 2 | flags.h << 1 | flags.c, 1);
+  fnv.Add(machine.cpu.ime << 2 | machine.cpu.halted << 1 |
+              machine.cpu.halt_bug_occurred,
+          1);
+  const MMUState &mmu = machine.mmu;
+  fnv.Add(mmu.memory.data(), mmu.memory.size());
+  fnv.Add(static_cast<uint32_t>(mmu.rom_bank), 4);
+  fnv.Add(mmu.active_rom_bank, 1);
+  fnv.Add(mmu.active_ram_bank, 1);
+  fnv.Add(mmu.ram_banking_mode << 3 | mmu.ram_enabled << 2 |
+              mmu.rtc_enabled << 1 | mmu.boot_rom_enabled,
+          1);
+  fnv.Add(mmu.joypad[0], 1);
+  fnv.Add(mmu.joypad[1], 1);
+  fnv.Add(mmu.divider, 2);
+  fnv.Add(static_cast<uint32_t>(machine.current_screen_cycles), 4);
+  fnv.Add(static_cast<uint32_t>(machine.timer_ticks), 4);
+  fnv.Add(static_cast<uint32_t>(machine.divider_tick_cycles), 4);
+  for (const SharedPage &bank : snapshot.ram_banks) {
+    fnv.Add(bank->data(), bank->size());
+  }
+  return fnv.Hash();
+}
+
+MovieRecorder::~MovieRecorder() {
+  if (!recording_) return;
+  // cut short, but everything up to here can still be played
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Chunk rest;
+    rest.records = std::move(records_);
+    queue_.push_back(std::move(rest));
+  }
+  Finish();
+}
+
+bool MovieRecorder::Start(const std::string &path, Gameboy &gb,
+                          const bool power_on, const int hash_interval,
+                          const int keyframe_interval) {
+  if (recording_) Stop(gb);
+  ofs_.open(path, std::ios::binary | std::ios::trunc);
+  if (!ofs_) {
+    spdlog::get("stdout")->error("Error writing {0}", path);
+    ofs_.clear();
+    return false;
+  }
+  hash_interval_ = std::max(hash_interval, 1);
+  keyframe_interval_ = std::max(keyframe_interval, 0);
+  std::vector<uint8_t> start;
+  if (power_on) {
+    std::ostringstream battery;
+    gb.mmu.SaveBufferedRAM(battery);
+    const std::string bytes = battery.str();
+    start.assign(bytes.begin(), bytes.end());
+  } else {
+    StateSnapshot snapshot;
+    gb.Snapshot(snapshot);
+    codec_.Pack(snapshot, start);
+  }
+  // the header goes out with the first records, the writer does it all
+  records_.assign(kMagic, kMagic + sizeof(kMagic));
+  PutVarint(records_, kVersion);
+  PutVarint(records_, power_on);
+  PutVarint(records_, static_cast<uint64_t>(hash_interval_));
+  PutVarint(records_, start.size());
+  records_.insert(records_.end(), start.begin(), start.end());
+  offset_ = 0;
+  index_.clear();
+  frame_ = 0;
+  last_record_frame_ = 0;
+  input_given_ = false;
+  quit_ = false;
+  worker_ = std::thread(&MovieRecorder::Work, this);
+  recording_ = true;
+  // the only way back to the start of a power on movie without a new
+  // Gameboy
+  if (power_on && keyframe_interval_ > 0) Queue(gb, false, true);
+  return true;
+}
+
+void MovieRecorder::Stop(Gameboy &gb) {
+  if (!recording_) return;
+  // unless FrameDone() just did
+  if (frame_ == 0 || frame_ % hash_interval_ != 0) Queue(gb, true, false);
+  const uint64_t delta = frame_ - last_record_frame_;
+  PutVarint(records_, delta << 2 | kEnd);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Chunk end;
+    end.records = std::move(records_);
+    queue_.push_back(std::move(end));
+  }
+  records_.clear();
+  work_ready_.notify_one();
+  // once the writer's done with it the index is left alone
+  Finish();
+  std::vector<uint8_t> index;
+  PutVarint(index, frame_);
+  PutVarint(index, index_.size());
+  MovieKeyframe last{0, 0};
+  for (const MovieKeyframe &keyframe : index_) {
+    PutVarint(index, keyframe.frame - last.frame);
+    PutVarint(index, keyframe.offset - last.offset);
+    last = keyframe;
+  }
+  PutLE(index, offset_, 8);
+  index.insert(index.end(), kIndexMagic, kIndexMagic + sizeof(kIndexMagic));
+  WriteBytes(ofs_, index);
+  ofs_.close();
+  if (!ofs_) spdlog::get("stdout")->error("Error writing the movie");
+  ofs_.clear();
+}
+
+void MovieRecorder::HandleInput(Gameboy &gb,
+                                const std::array<uint8_t, 2> joypad) {
+  if (recording_) {
+    // with nothing held and nothing changed it does nothing at all, and
+    // giving the same input twice between two frames does nothing more
+    const bool pressed = joypad[0] < 0x0F || joypad[1] < 0x0F;
+    const bool repeat = input_given_ && last_input_ == joypad;
+    if ((pressed || joypad != gb.mmu.joypad) && !repeat) {
+      const uint64_t delta = frame_ - last_record_frame_;
+      PutVarint(records_, delta << 2 | kInput);
+      records_.push_back(joypad[0]);
+      records_.push_back(joypad[1]);
+      last_record_frame_ = frame_;
+      last_input_ = joypad;
+      input_given_ = true;
+    }
+  }
+  gb.HandleInput(joypad);
+}
+
+void MovieRecorder::FrameDone(Gameboy &gb) {
+  if (!recording_) return;
+  ++frame_;
+  input_given_ = false;
+  const bool check = frame_ % hash_interval_ == 0;
+  const bool keyframe =
+      keyframe_interval_ > 0 && frame_ % keyframe_interval_ == 0;
+  if (check || keyframe) Queue(gb, check, keyframe);
+}
+
+void MovieRecorder::Queue(Gameboy &gb, const bool check, bool keyframe) {
+  std::unique_ptr<StateSnapshot> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_.size() >= kMaxQueued) keyframe = false;
+    if (!check && !keyframe) return;
+    if (!spare_.empty()) {
+      snapshot = std::move(spare_.back());
+      spare_.pop_back();
+    }
+  }
+  if (!snapshot) snapshot = std::make_unique<StateSnapshot>();
+  // the snapshot's all the emulation waits for, the writer hashes and
+  // packs it
+  gb.Snapshot(*snapshot);
+  Chunk chunk;
+  chunk.records = std::move(records_);
+  chunk.snapshot = std::move(snapshot);
+  chunk.frame = frame_;
+  chunk.delta = frame_ - last_record_frame_;
+  chunk.check = check;
+  chunk.keyframe = keyframe;
+  records_.clear();
+  last_record_frame_ = frame_;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(chunk));
+  }
+  work_ready_.notify_one();
+}
+
+void MovieRecorder::Finish() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  work_ready_.notify_one();
+  worker_.join();
+  recording_ = false;
+}
+
+void MovieRecorder::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_ready_.wait(lock, [this] { return quit_ || !queue_.empty(); });
+    // only once everything's written
+    if (queue_.empty()) return;
+    Chunk chunk = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    Write(chunk);
+    lock.lock();
+    if (chunk.snapshot) spare_.push_back(std::move(chunk.snapshot));
+  }
+}
+
+void MovieRecorder::Write(Chunk &chunk) {
+  written_ = std::move(chunk.records);
+  if (chunk.snapshot) {
+    uint64_t delta = chunk.delta;
+    if (chunk.check) {
+      PutVarint(written_, delta << 2 | kCheck);
+      PutLE(written_, StateHash(*chunk.snapshot), 8);
+      delta = 0;
+    }
+    if (chunk.keyframe) {
+      index_.push_back(MovieKeyframe{chunk.frame, offset_ + written_.size()});
+      codec_.Pack(*chunk.snapshot, packed_);
+      PutVarint(written_, delta << 2 | kKeyframe);
+      PutVarint(written_, packed_.size());
+    }
+  }
+  WriteBytes(ofs_, written_);
+  offset_ += written_.size();
+  if (chunk.keyframe) {
+    WriteBytes(ofs_, packed_);
+    offset_ += packed_.size();
+  }
+  // so there's as much as possible to play if it's cut short
+  ofs_.flush();
+}
+
+bool MoviePlayer::Open(const std::string &path) {
+  path_ = path;
+  ifs_.close();
+  ifs_.clear();
+  ifs_.open(path, std::ios::binary);
+  if (!ifs_) {
+    spdlog::get("stdout")->error("Couldn't open {0}", path);
+    return false;
+  }
+  char magic[sizeof(kMagic)] = {};
+  uint64_t version = 0;
+  uint64_t power_on = 0;
+  uint64_t hash_interval = 0;
+  uint64_t start_size = 0;
+  if (!ifs_.read(magic, sizeof(magic)) ||
+      !std::equal(magic, magic + sizeof(magic), kMagic) ||
+      !GetVarint(ifs_, version) || version != kVersion ||
+      !GetVarint(ifs_, power_on) || !GetVarint(ifs_, hash_interval) ||
+      !GetVarint(ifs_, start_size) || start_size > kMaxPacked) {
+    spdlog::get("stdout")->error("{0} isn't a movie", path);
+    return false;
+  }
+  power_on_ = power_on != 0;
+  start_.resize(start_size);
+  if (!ifs_.read(reinterpret_cast<char *>(start_.data()),
+                 static_cast<std::streamsize>(start_size))) {
+    spdlog::get("stdout")->error("{0} isn't a movie", path);
+    return false;
+  }
+  data_offset_ = static_cast<uint64_t>(ifs_.tellg());
+  ifs_.seekg(0, std::ios::end);
+  const auto file_size = static_cast<uint64_t>(ifs_.tellg());
+  if (!ReadIndex(file_size)) Scan();
+  ifs_.clear();
+  status_ = Status::kFinished;
+  return true;
+}
+
+bool MoviePlayer::ReadIndex(const uint64_t file_size) {
+  truncated_ = false;
+  index_.clear();
+  if (file_size < data_offset_ + kFooterSize) return false;
+  ifs_.seekg(static_cast<std::streamoff>(file_size - kFooterSize));
+  uint64_t index_offset = 0;
+  char magic[sizeof(kIndexMagic)] = {};
+  if (!GetLE(ifs_, index_offset, 8) || !ifs_.read(magic, sizeof(magic)) ||
+      !std::equal(magic, magic + sizeof(magic), kIndexMagic) ||
+      index_offset < data_offset_ || index_offset > file_size - kFooterSize) {
+    return false;
+  }
+  ifs_.seekg(static_cast<std::streamoff>(index_offset));
+  uint64_t frames = 0;
+  uint64_t count = 0;
+  if (!GetVarint(ifs_, frames) || frames > UINT32_MAX ||
+      !GetVarint(ifs_, count) || count > frames) {
+    return false;
+  }
+  MovieKeyframe last{0, 0};
+  for (uint64_t i = 0; i < count; ++i) {
+    uint64_t frame = 0;
+    uint64_t offset = 0;
+    if (!GetVarint(ifs_, frame) || !GetVarint(ifs_, offset)) return false;
+    frame += last.frame;
+    offset += last.offset;
+    if (frame > frames || offset < data_offset_ || offset >= index_offset) {
+      index_.clear();
+      return false;
+    }
+    last = MovieKeyframe{static_cast<uint32_t>(frame), offset};
+    index_.push_back(last);
+  }
+  frames_ = static_cast<uint32_t>(frames);
+  return true;
+}
+
+void MoviePlayer::Scan() {
+  index_.clear();
+  ifs_.clear();
+  ifs_.seekg(static_cast<std::streamoff>(data_offset_));
+  uint64_t frame = 0;
+  // as far as there's a whole record
+  uint64_t readable = 0;
+  while (true) {
+    const auto offset = static_cast<uint64_t>(ifs_.tellg());
+    uint64_t record = 0;
+    if (!GetVarint(ifs_, record)) break;
+    frame += record >> 2;
+    if (frame > UINT32_MAX) break;
+    bool whole = true;
+    switch (record & 0x03) {
+      case kInput:
+        whole = Skip(ifs_, 2);
+        break;
+      case kCheck:
+        whole = Skip(ifs_, 8);
+        break;
+      case kEnd:
+        frames_ = static_cast<uint32_t>(frame);
+        truncated_ = false;
+        return;
+      case kKeyframe: {
+        uint64_t size = 0;
+        whole = GetVarint(ifs_, size) && size <= kMaxPacked && Skip(ifs_, size);
+        if (whole) {
+          index_.push_back(MovieKeyframe{static_cast<uint32_t>(frame), offset});
+        }
+        break;
+      }
+    }
+    if (!whole) break;
+    readable = frame;
+  }
+  frames_ = static_cast<uint32_t>(readable);
+  truncated_ = true;
+  spdlog::get("stdout")->warn("{0} was cut short, it plays up to frame {1}",
+                              path_, frames_);
+}
+
+bool MoviePlayer::Start(Gameboy &gb) {
+  status_ = Status::kFinished;
+  if (power_on_) {
+    if (!start_.empty()) {
+      std::istringstream battery{std::string(start_.begin(), start_.end())};
+      gb.mmu.LoadBufferedRAM(battery);
+    }
+  } else {
+    if (!codec_.Unpack(start_.data(), start_.size(), scratch_)) {
+      spdlog::get("stdout")->error(
+          "The movie's start state is damaged or from another build");
+      return false;
+    }
+    if (!gb.Restore(scratch_)) return false;
+  }
+  ifs_.clear();
+  ifs_.seekg(static_cast<std::streamoff>(data_offset_));
+  frame_ = 0;
+  next_ = Record{};
+  status_ = Status::kPlaying;
+  return Peek();
+}
+
+bool MoviePlayer::Peek() {
+  uint64_t record = 0;
+  if (!GetVarint(ifs_, record) ||
+      next_.frame + (record >> 2) > UINT32_MAX) {
+    if (truncated_) {
+      // as good as the end
+      next_ = Record{kEnd, std::max(next_.frame, frames_)};
+      return true;
+    }
+    status_ = Status::kDamaged;
+    return false;
+  }
+  next_.kind = static_cast<int>(record & 0x03);
+  next_.frame += static_cast<uint32_t>(record >> 2);
+  return true;
+}
+
+bool MoviePlayer::Apply(Gameboy &gb) {
+  bool whole = true;
+  switch (next_.kind) {
+    case kInput: {
+      const int low = ifs_.get();
+      const int high = ifs_.get();
+      whole = static_cast<bool>(ifs_);
+      if (whole) {
+        gb.HandleInput({static_cast<uint8_t>(low), static_cast<uint8_t>(high)});
+      }
+      break;
+    }
+    case kCheck: {
+      whole = GetLE(ifs_, expected_, 8);
+      if (!whole) break;
+      gb.Snapshot(scratch_);
+      got_ = StateHash(scratch_);
+      if (got_ != expected_) {
+        status_ = Status::kDiverged;
+        return false;
+      }
+      break;
+    }
+    case kKeyframe: {
+      uint64_t size = 0;
+      whole = GetVarint(ifs_, size) && size <= kMaxPacked && Skip(ifs_, size);
+      break;
+    }
+    default:
+      return false;
+  }
+  if (!whole) {
+    status_ = truncated_ ? Status::kFinished : Status::kDamaged;
+    return false;
+  }
+  return Peek();
+}
+
+MoviePlayer::Status MoviePlayer::RunFrame(Gameboy &gb) {
+  if (status_ != Status::kPlaying) return status_;
+  if (frame_ >= frames_) {
+    status_ = Status::kFinished;
+    return status_;
+  }
+  // the input given before this frame
+  while (next_.frame == frame_ && next_.kind != kEnd) {
+    if (!Apply(gb)) return status_;
+  }
+  gb.Tick(gb.max_cycles_per_vertical_refresh);
+  ++frame_;
+  while (next_.frame == frame_ && next_.kind != kInput) {
+    if (next_.kind == kEnd) break;
+    if (!Apply(gb)) return status_;
+  }
+  if (next_.frame < frame_) {
+    status_ = Status::kDamaged;
+  } else if (frame_ >= frames_) {
+    status_ = Status::kFinished;
+  }
+  return status_;
+}
+
+bool MoviePlayer::RestoreKeyframe(Gameboy &gb, const MovieKeyframe &keyframe) {
+  ifs_.clear();
+  ifs_.seekg(static_cast<std::streamoff>(keyframe.offset));
+  uint64_t record = 0;
+  uint64_t size = 0;
+  if (!GetVarint(ifs_, record) || (record & 0x03) != kKeyframe ||
+      !GetVarint(ifs_, size) || size > kMaxPacked) {
+    return false;
+  }
+  packed_.resize(size);
+  if (!ifs_.read(reinterpret_cast<char *>(packed_.data()),
+                 static_cast<std::streamsize>(size)) ||
+      !codec_.Unpack(packed_.data(), packed_.size(), scratch_) ||
+      !gb.Restore(scratch_)) {
+    return false;
+  }
+  frame_ = keyframe.frame;
+  next_ = Record{kKeyframe, keyframe.frame};
+  status_ = Status::kPlaying;
+  return Peek();
+}
+
+bool MoviePlayer::Seek(Gameboy &gb, const uint32_t frame) {
+  if (frame > frames_) return false;
+  // the last keyframe before it, so there's at least a frame to see, or
+  // the one at the start
+  auto keyframe = std::upper_bound(
+      index_.begin(), index_.end(), frame,
+      [](const uint32_t a, const MovieKeyframe &b) { return a < b.frame; });
+  if (keyframe != index_.begin() && frame > 0 &&
+      std::prev(keyframe)->frame == frame) {
+    --keyframe;
+  }
+  // one that's damaged (or from another build) is no use, the one before
+  // it gets there too, just more slowly
+  bool restored = false;
+  while (!restored && keyframe != index_.begin()) {
+    --keyframe;
+    restored = RestoreKeyframe(gb, *keyframe);
+    if (!restored) {
+      spdlog::get("stdout")->warn(
+          "Couldn't restore the keyframe at frame {0} (damaged, or from "
+          "another build?), trying the one before",
+          keyframe->frame);
+    }
+  }
+  if (!restored) {
+    if (power_on_ && frame_ != 0) {
+      spdlog::get("stdout")->error(
+          "Can't go back to the start of a power on movie without keyframes");
+      return false;
+    }
+    if (!Start(gb)) return false;
+  }
+  const int render_interval = gb.ppu.GetRenderInterval();
+  gb.ppu.SetRenderInterval(0);
+  while (frame_ + 1 < frame && RunFrame(gb) == Status::kPlaying) {
+  }
+  gb.ppu.SetRenderInterval(render_interval);
+  if (frame_ < frame) RunFrame(gb);
+  return frame_ == frame && (status_ == Status::kPlaying ||
+                             status_ == Status::kFinished);
+}
@@ -0,0 +1,185 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gb.h"
+#include "snapshot_codec.h"
+
+/**
+ * Input movies, everything it takes to play a session back exactly: the
+ * state it started from, every input and when, and a hash of the state
+ * every so many frames (and at the end) to tell a playback that's gone its
+ * own way. Input only ever goes in between frames, so a frame number pins
+ * down exactly when.
+ *
+ * Every so often there's a keyframe too, a packed snapshot (see
+ * SnapshotCodec), and an index of them goes on the end once recording's
+ * done. Seeking restores the keyframe before and runs on from there, so
+ * it costs the same in a movie hours long as in one a minute long.
+ *
+ * The file is written as it's recorded, a movie cut short (eg. by a crash)
+ * plays back as far as it got, the index gets rebuilt by reading through
+ * it. A movie started from power on only keeps the battery RAM the game
+ * started with, so it plays back on any build (bar seeking, keyframes are
+ * only good for the build that took them), eg. to check an optimisation
+ * hasn't changed anything. Otherwise the start is a packed snapshot too.
+ */
+
+// FNV-1a of everything the game can see: CPU registers, 0x8000 - 0xFFFF,
+// the cart's RAM banks and which are mapped, and the timers. Not the PPU or
+// APU's internals, which depend on how the frontend's drawing and playing
+// things, and not laid out like MachineState, so builds can be compared
+uint64_t StateHash(const StateSnapshot &snapshot);
+
+// Where a keyframe's record starts in the file
+struct MovieKeyframe {
+  uint32_t frame;
+  uint64_t offset;
+};
+
+class MovieRecorder {
+ public:
+  static constexpr int kDefaultHashInterval = 60;
+  // a seek runs at most this many frames, well under 50 ms worth
+  // unrendered. Up to about 10KB a keyframe, 30MB an hour
+  static constexpr int kDefaultKeyframeInterval = 60;
+  MovieRecorder() = default;
+  MovieRecorder(const MovieRecorder &) = delete;
+  MovieRecorder &operator=(const MovieRecorder &) = delete;
+  // Writes out whatever's been recorded, without an end if not stopped
+  ~MovieRecorder();
+  // power_on for a console that hasn't run yet, so the movie can start the
+  // same way. Otherwise it starts from a snapshot of wherever gb is. A
+  // keyframe_interval of 0 leaves them out. false if path can't be written
+  bool Start(const std::string &path, Gameboy &gb, bool power_on = false,
+             int hash_interval = kDefaultHashInterval,
+             int keyframe_interval = kDefaultKeyframeInterval);
+  // Finishes the movie with a check of the state it's stopped in and the
+  // index, blocking until it's all written
+  void Stop(Gameboy &gb);
+  bool Recording() const { return recording_; }
+  // Use in place of Gameboy::HandleInput(), it passes the input on and
+  // records it while recording
+  void HandleInput(Gameboy &gb, std::array<uint8_t, 2> joypad);
+  // Call after every frame run, eg. from RunAhead's FrameSink
+  void FrameDone(Gameboy &gb);
+
+ private:
+  // Keyframes waiting to be written. Past this the writer's fallen behind
+  // and they get left out rather than holding up the emulation
+  static constexpr size_t kMaxQueued = 8;
+  // What the emulation thread hands the writer: records already coded,
+  // then a snapshot to check and/or keep as a keyframe
+  struct Chunk {
+    std::vector<uint8_t> records{};
+    std::unique_ptr<StateSnapshot> snapshot{};
+    uint32_t frame = 0;
+    // frames since the last record, for the snapshot's
+    uint32_t delta = 0;
+    bool check = false;
+    bool keyframe = false;
+  };
+  void Queue(Gameboy &gb, bool check, bool keyframe);
+  void Work();
+  void Write(Chunk &chunk);
+  // Waits for the writer to finish everything queued
+  void Finish();
+  bool recording_ = false;
+  int hash_interval_ = kDefaultHashInterval;
+  int keyframe_interval_ = kDefaultKeyframeInterval;
+  uint32_t frame_ = 0;
+  uint32_t last_record_frame_ = 0;
+  // the last input recorded, if it was since the last frame
+  bool input_given_ = false;
+  std::array<uint8_t, 2> last_input_{};
+  std::vector<uint8_t> records_{};
+  // only the writer touches these while it's running
+  std::ofstream ofs_{};
+  uint64_t offset_ = 0;
+  std::vector<MovieKeyframe> index_{};
+  SnapshotCodec codec_{};
+  std::vector<uint8_t> written_{};
+  std::vector<uint8_t> packed_{};
+  std::mutex mutex_;
+  std::condition_variable work_ready_;
+  std::deque<Chunk> queue_{};
+  // spent snapshots, to take the next ones into without allocating
+  std::vector<std::unique_ptr<StateSnapshot>> spare_{};
+  bool quit_ = false;
+  std::thread worker_{};
+};
+
+class MoviePlayer {
+ public:
+  enum class Status { kPlaying, kFinished, kDiverged, kDamaged };
+  // Reads the header and the index (or rebuilds it), not the rest.
+  // false, logging why, if it isn't a movie
+  bool Open(const std::string &path);
+  // Puts gb in the movie's starting state, false if it can't be (another
+  // game, or a snapshot from another build). For a power on movie gb has
+  // to be a new, unnamed Gameboy
+  bool Start(Gameboy &gb);
+  // Run a frame with the recorded input, then check the state if there's a
+  // hash for it. Stops there for good at the end, the first divergence or
+  // anything unreadable
+  Status RunFrame(Gameboy &gb);
+  // Get to frame as quickly as possible: from the last keyframe before it
+  // that can be restored, or the start if there isn't one, running the
+  // rest unrendered bar the last. Power on movies have a keyframe at the
+  // start, without it (or with them all damaged or from another build) they
+  // can only go forward from the start. false, with the state left wherever
+  // it got to, if it can't be
+  bool Seek(Gameboy &gb, uint32_t frame);
+  // Frames run so far, and how long the movie is. Cut short, it's as far
+  // as it's readable
+  uint32_t Frame() const { return frame_; }
+  uint32_t Frames() const { return frames_; }
+  size_t Keyframes() const { return index_.size(); }
+  // The hash recorded and the one got for the check that failed
+  uint64_t Expected() const { return expected_; }
+  uint64_t Got() const { return got_; }
+
+ private:
+  struct Record {
+    int kind = 0;
+    uint32_t frame = 0;
+  };
+  // The header of the next record into next_
+  bool Peek();
+  // Read the record next_ is the header of, and the header after it
+  bool Apply(Gameboy &gb);
+  bool RestoreKeyframe(Gameboy &gb, const MovieKeyframe &keyframe);
+  bool ReadIndex(uint64_t file_size);
+  // Rebuild the index of a movie that has none, reading through it all
+  void Scan();
+  std::string path_{};
+  std::ifstream ifs_{};
+  bool power_on_ = false;
+  std::vector<uint8_t> start_{};
+  uint64_t data_offset_ = 0;
+  std::vector<MovieKeyframe> index_{};
+  uint32_t frames_ = 0;
+  // never finished recording, it ends where it stops being readable
+  bool truncated_ = false;
+  Status status_ = Status::kFinished;
+  uint32_t frame_ = 0;
+  Record next_{};
+  uint64_t expected_ = 0;
+  uint64_t got_ = 0;
+  SnapshotCodec codec_{};
+  std::vector<uint8_t> packed_{};
+  StateSnapshot scratch_{};
+};
+
+#endif  // !MOVIE_H
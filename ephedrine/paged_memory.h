@@ -0,0 +1,138 @@
+#ifndef PAGED_MEMORY_H
+#define PAGED_MEMORY_H
+
+#include <array>
+#include <cereal/cereal.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// 8kB, the size of a RAM bank and of every region in the memory map (ROM
+// banks are two)
+constexpr size_t kMemoryPageSize = 0x2000;
+using MemoryPage = std::array<uint8_t, kMemoryPageSize>;
+using SharedPage = std::shared_ptr<MemoryPage>;
+
+/**
+ * The 64kB address space as 8 pages that can be shared, so that copying it
+ * (see Gameboy::Clone()) only copies pointers. After a copy neither side
+ * owns any of its pages any more, a page is only copied by whichever side
+ * writes to it first. Pages can also be mapped in from elsewhere, eg. the
+ * cartridge's ROM banks, and are never written to unless owned.
+ *
+ * Reads go through operator[] and never copy anything, writes through At()
+ * or MutableData(). Serialized it's the same 65536 bytes as a std::array.
+ */
+class PagedMemory {
+ public:
+  static constexpr int kPages = 0x10000 / kMemoryPageSize;
+  PagedMemory() {
+    for (int i = 0; i < kPages; ++i) {
+      pages_[i] = std::make_shared<MemoryPage>();
+      data_[i] = pages_[i]->data();
+    }
+  }
+  // Shares every page, the copy is made when it's first written to
+  PagedMemory(const PagedMemory &other)
+      : pages_(other.pages_), data_(other.data_), owned_(0) {
+    other.owned_ = 0;
+  }
+  PagedMemory &operator=(const PagedMemory &other) {
+    pages_ = other.pages_;
+    data_ = other.data_;
+    owned_ = 0;
+    other.owned_ = 0;
+    return *this;
+  }
+  uint8_t operator[](const uint16_t address) const {
+    return data_[address / kMemoryPageSize][address % kMemoryPageSize];
+  }
+  uint8_t &At(const uint16_t address) {
+    return MutablePage(address / kMemoryPageSize)[address % kMemoryPageSize];
+  }
+  // Contiguous up to the end of the address's page
+  const uint8_t *Data(const uint16_t address) const {
+    return &data_[address / kMemoryPageSize][address % kMemoryPageSize];
+  }
+  uint8_t *MutableData(const uint16_t address) {
+    return &MutablePage(address / kMemoryPageSize)[address % kMemoryPageSize];
+  }
+  // MutableData() for a whole page that's about to be overwritten, a shared
+  // page is swapped for a new one rather than copied
+  uint8_t *OverwritePage(const uint16_t address) {
+    const int page = address / kMemoryPageSize;
+    if (!(owned_ & (1U << page))) {
+      pages_[page] = std::make_shared<MemoryPage>();
+      data_[page] = pages_[page]->data();
+      owned_ |= 1U << page;
+    }
+    return data_[page];
+  }
+  // The page behind address, to be kept elsewhere (eg. a RAM bank switched
+  // out) without copying it. From now on it's shared
+  SharedPage SharePage(const uint16_t address) {
+    const int page = address / kMemoryPageSize;
+    owned_ &= ~(1U << page);
+    return pages_[page];
+  }
+  // Put page in at address (which should be on a page boundary), shared
+  void MapPage(const uint16_t address, SharedPage page) {
+    const int index = address / kMemoryPageSize;
+    data_[index] = page->data();
+    pages_[index] = std::move(page);
+    owned_ &= ~(1U << index);
+  }
+  template <class Archive>
+  void save(Archive &archive) const {
+    for (const uint8_t *page : data_) {
+      archive(cereal::binary_data(page, kMemoryPageSize));
+    }
+  }
+  template <class Archive>
+  void load(Archive &archive) {
+    for (int i = 0; i < kPages; ++i) {
+      archive(cereal::binary_data(MutablePage(i), kMemoryPageSize));
+    }
+  }
+
+ private:
+  uint8_t *MutablePage(const int page) {
+    if (!(owned_ & (1U << page))) {
+      // could be the last user, but checking use_count() isn't safe with
+      // the other side on another thread, so always copy
+      pages_[page] = std::make_shared<MemoryPage>(*pages_[page]);
+      data_[page] = pages_[page]->data();
+      owned_ |= 1U << page;
+    }
+    return data_[page];
+  }
+  std::array<SharedPage, kPages> pages_{};
+  // pages_[n]->data(), saves chasing the shared_ptr on every access
+  std::array<uint8_t *, kPages> data_{};
+  // bit n set when nothing else can see page n. Copying from a const
+  // PagedMemory still gives its pages away
+  mutable uint8_t owned_ = 0xFF;
+};
+
+// A bank list serialized as a std::vector<std::array<uint8_t, 0x2000>>
+template <class Archive>
+void SavePages(Archive &archive, const std::vector<SharedPage> &pages) {
+  archive(cereal::make_size_tag(static_cast<cereal::size_type>(pages.size())));
+  for (const SharedPage &page : pages) {
+    archive(cereal::binary_data(page->data(), kMemoryPageSize));
+  }
+}
+
+template <class Archive>
+void LoadPages(Archive &archive, std::vector<SharedPage> &pages) {
+  cereal::size_type size = 0;
+  archive(cereal::make_size_tag(size));
+  pages.resize(static_cast<size_t>(size));
+  for (SharedPage &page : pages) {
+    page = std::make_shared<MemoryPage>();
+    archive(cereal::binary_data(page->data(), kMemoryPageSize));
+  }
+}
+
+#endif  // !PAGED_MEMORY_H
@@ -0,0 +1,258 @@
+// Dot accurate renderer for mode 3, modelling the background fetcher and the
+// background/sprite FIFOs the way the DMG does. Selected with
+// PPU::SetRenderer(PPURenderer::kPixelFIFO)
+#include "bit_utility.h"
+#include "gb.h"
+#include "ppu.h"
+
+namespace {
+// The first tile fetch of every line is thrown away by the hardware, so
+// nothing comes out of the FIFO for this many dots. Along with the 6 dots of
+// the real first fetch, that's the 12 dots on top of the 160 pixels in the
+// shortest possible mode 3 (172 dots)
+constexpr int kInitialFetchDots = 7;
+// Sprite tile fetch, after the background fetcher finishes its current tile
+constexpr int kSpriteFetchDots = 6;
+}  // namespace
+
+void PPU::UpdatePixelFifo(const uint8_t current_ly) {
+  if (current_ly >= 144 || hblank_ || current_scanline_cycles_ < 80) return;
+
+  if (!finished_current_line_) {
+    if (!fifo_.active) {
+      StartFifoLine(current_ly);
+      SetMode(kPPUModeLCDTransfer);
+    }
+    // catch up to where the rest of the system is
+    if (!RunPixelFifo(current_scanline_cycles_ - 80)) return;
+    finished_current_line_ = true;
+  }
+  // H Blank
+  SetMode(kPPUModeHBlank);
+  hblank_ = true;
+}
+
+void PPU::StartFifoLine(const uint8_t current_ly) {
+  FifoState &f = fifo_;
+  const uint8_t lcdc = mmu_.GetRegister(LCDC);
+  if (current_ly == 0) {
+    f.window_y_triggered = false;
+    f.window_line = 0;
+  }
+  // the window only starts on lines at or below WY, once it's matched it
+  // stays that way for the rest of the frame
+  if (bit_check(lcdc, 5) && current_ly == mmu_.GetRegister(WY)) {
+    f.window_y_triggered = true;
+  }
+  f.bg_head = 0;
+  f.bg_size = 0;
+  f.obj_head = 0;
+  f.obj_size = 0;
+  f.fetcher_step = 0;
+  f.fetcher_dots = 0;
+  f.fetch_x = 0;
+  f.fetching_window = false;
+  f.dots = 0;
+  f.lx = 0;
+  // fine scroll, the first SCX % 8 pixels get dropped
+  f.discard = mmu_.GetRegister(SCX) & 0x07;
+  f.next_sprite = 0;
+  f.sprite_dots = 0;
+  f.active = true;
+  // force the palettes to be looked up
+  f.bgp = ~mmu_.GetRegister(BGP);
+}
+
+void PPU::UpdateFifoPalettes() {
+  FifoState &f = fifo_;
+  const uint8_t bgp = mmu_.GetRegister(BGP);
+  const uint8_t obp0 = mmu_.GetRegister(OBP0);
+  const uint8_t obp1 = mmu_.GetRegister(OBP1);
+  if (bgp == f.bgp && obp0 == f.obp0 && obp1 == f.obp1) return;
+  for (uint8_t i = 0; i < 4; ++i) {
+    f.bg_colors[i] = GetColor(i);
+    f.obj_colors[0][i] = GetSpriteColor(i, false);
+    f.obj_colors[1][i] = GetSpriteColor(i, true);
+  }
+  f.bgp = bgp;
+  f.obp0 = obp0;
+  f.obp1 = obp1;
+}
+
+/**
+ * Fetch the next sprite in visible_sprites_ (which is in priority order) and
+ * mix it into the sprite FIFO. Pixels already there belong to a higher
+ * priority sprite, so only transparent ones are replaced
+ */
+void PPU::FetchFifoSprite() {
+  FifoState &f = fifo_;
+  const Sprite &s = visible_sprites_[f.next_sprite++];
+  const uint8_t lcdc = mmu_.GetRegister(LCDC);
+  const uint8_t current_ly = mmu_.GetRegister(LY);
+  const int height = bit_check(lcdc, 2) ? 16 : 8;
+  int row = current_ly - (s.y - 16);
+  if (bit_check(s.flags, 6)) row = height - 1 - row;
+  // 8x16 sprites ignore bit 0 of the tile number
+  const uint8_t tile = height == 16 ? s.tile & 0xFE : s.tile;
+  const uint8_t *data = mmu_.Vram() + tile * 16 + row * 2;
+  const uint8_t tile_low = data[0];
+  const uint8_t tile_high = data[1];
+  const bool x_flipped = bit_check(s.flags, 5);
+  const PixelSource source =
+      bit_check(s.flags, 4) ? PixelSource::ogp1 : PixelSource::ogp0;
+  const bool background_priority = bit_check(s.flags, 7);
+
+  // sprites hanging off the left edge lose their leftmost pixels
+  const int skip = s.x < 8 ? 8 - s.x : 0;
+  for (int i = skip; i < 8; ++i) {
+    const int bit = x_flipped ? i : 7 - i;
+    const uint8_t colour =
+        (((tile_high >> bit) & 1U) << 1) | ((tile_low >> bit) & 1U);
+    const int pos = i - skip;
+    const int slot = (f.obj_head + pos) & 7;
+    if (pos >= f.obj_size) {
+      f.obj[slot] = PixelFIFO{colour, source, background_priority};
+      ++f.obj_size;
+    } else if (f.obj[slot].tile == 0) {
+      f.obj[slot] = PixelFIFO{colour, source, background_priority};
+    }
+  }
+}
+
+/**
+ * Run the fetcher and FIFOs until target_dots dots into mode 3, or until all
+ * 160 pixels of the line are out. Returns true once the line is complete
+ */
+bool PPU::RunPixelFifo(const int target_dots) {
+  FifoState &f = fifo_;
+  if (!f.active) return true;
+
+  // registers are sampled once per catch up, which is at most one
+  // instruction behind the CPU
+  const uint8_t lcdc = mmu_.GetRegister(LCDC);
+  const uint8_t current_ly = mmu_.GetRegister(LY);
+  const uint8_t scx = mmu_.GetRegister(SCX);
+  const uint8_t scy = mmu_.GetRegister(SCY);
+  const int wx = mmu_.GetRegister(WX);
+  // on DMG clearing LCDC bit 0 blanks both the background and the window
+  const bool bg_enabled = bit_check(lcdc, 0);
+  const bool window_enabled = bg_enabled && bit_check(lcdc, 5);
+  const bool sprites_enabled = bit_check(lcdc, 1);
+  const int sprite_count = static_cast<int>(visible_sprites_.size());
+  const uint8_t *vram = mmu_.Vram();
+  UpdateFifoPalettes();
+  OwnScreen();
+  std::array<Pixel, 160> &line = (*screen_)[current_ly];
+
+  while (f.dots < target_dots) {
+    ++f.dots;
+    if (f.dots <= kInitialFetchDots) continue;
+
+    // a sprite fetch stalls everything else
+    if (f.sprite_dots > 0) {
+      if (--f.sprite_dots == 0) FetchFifoSprite();
+      continue;
+    }
+
+    // background/window fetcher
+    if (f.fetcher_step < 3 && ++f.fetcher_dots == 2) {
+      f.fetcher_dots = 0;
+      switch (f.fetcher_step) {
+        case 0: {
+          int map_address;
+          if (f.fetching_window) {
+            map_address = (bit_check(lcdc, 6) ? 0x1C00 : 0x1800) +
+                          ((f.window_line / 8) * 32) + (f.fetch_x & 31);
+          } else {
+            const uint8_t ybase = scy + current_ly;
+            map_address = (bit_check(lcdc, 3) ? 0x1C00 : 0x1800) +
+                          ((ybase / 8) * 32) + (((scx / 8) + f.fetch_x) & 31);
+          }
+          f.tile_num = vram[map_address];
+          break;
+        }
+        case 1:
+        case 2: {
+          const int tile_row =
+              f.fetching_window ? f.window_line % 8 : (scy + current_ly) % 8;
+          int tile_address;
+          if (bit_check(lcdc, 4)) {
+            tile_address = f.tile_num * 16;
+          } else {
+            tile_address = 0x1000 + static_cast<int8_t>(f.tile_num) * 16;
+          }
+          tile_address += tile_row * 2;
+          if (f.fetcher_step == 1) {
+            f.tile_low = vram[tile_address];
+          } else {
+            f.tile_high = vram[tile_address + 1];
+          }
+          break;
+        }
+        default:
+          break;
+      }
+      ++f.fetcher_step;
+    }
+    // pushes only happen into an empty FIFO
+    if (f.fetcher_step == 3 && f.bg_size == 0) {
+      for (int bit = 7; bit >= 0; --bit) {
+        const uint8_t colour =
+            bg_enabled ? (((f.tile_high >> bit) & 1U) << 1) |
+                             ((f.tile_low >> bit) & 1U)
+                       : 0;
+        f.bg[(f.bg_head + f.bg_size++) & 15] = colour;
+      }
+      ++f.fetch_x;
+      f.fetcher_step = 0;
+    }
+    if (f.bg_size == 0) continue;
+
+    // Window start. The FIFO is thrown away and the fetcher starts again
+    // from the window's first tile
+    if (window_enabled && f.window_y_triggered && !f.fetching_window &&
+        f.discard == 0 && f.lx + 7 >= wx) {
+      f.fetching_window = true;
+      f.bg_size = 0;
+      f.fetch_x = 0;
+      f.fetcher_step = 0;
+      f.fetcher_dots = 0;
+      // WX below 7 pushes the window partly off the left edge
+      if (f.lx == 0 && wx < 7) f.discard = 7 - wx;
+      continue;
+    }
+
+    // Sprite start, once the fetcher has finished the tile it's on
+    if (sprites_enabled && f.discard == 0 && f.next_sprite < sprite_count &&
+        visible_sprites_[f.next_sprite].x <= f.lx + 8) {
+      if (f.fetcher_step == 3) f.sprite_dots = kSpriteFetchDots;
+      continue;
+    }
+
+    // shift a pixel out to the LCD
+    const uint8_t colour = f.bg[f.bg_head];
+    f.bg_head = (f.bg_head + 1) & 15;
+    --f.bg_size;
+    if (f.discard > 0) {
+      --f.discard;
+      continue;
+    }
+    Pixel pixel = f.bg_colors[colour];
+    if (f.obj_size > 0) {
+      const PixelFIFO &obj = f.obj[f.obj_head];
+      f.obj_head = (f.obj_head + 1) & 7;
+      --f.obj_size;
+      if (obj.tile != 0 && (!obj.background_priority || colour == 0)) {
+        pixel = f.obj_colors[obj.source == PixelSource::ogp1][obj.tile];
+      }
+    }
+    line[f.lx++] = pixel;
+
+    if (f.lx == 160) {
+      f.active = false;
+      if (f.fetching_window) ++f.window_line;
+      return true;
+    }
+  }
+  return false;
+}
@@ -1,14 +1,44 @@
 #include "ppu.h"
+#include <algorithm>
 #include <queue>
 #include "bit_utility.h"
 #include "gb.h"
 #include "spdlog/spdlog.h"
 
-PPU::PPU(MMU &mmu) : mmu_(mmu), pixels_() {
+PPU::PPU(MMU &mmu) : mmu_(mmu), screen_(std::make_shared<Screen>()) {
   mmu_.WriteByte(LCDC, 0x91);
   mmu_.WriteByte(STAT, 0x85);
 }
 
+// The registers are already in mmu, they came along with the rest of memory
+PPU::PPU(PPU &other, MMU &mmu)
+    : finished_current_screen(other.finished_current_screen),
+      mmu_(mmu),
+      current_scanline_cycles_(other.current_scanline_cycles_),
+      pending_cycles_(other.pending_cycles_),
+      next_event_(other.next_event_),
+      finished_current_line_(other.finished_current_line_),
+      oam_search_finished_(other.oam_search_finished_),
+      vblank_(other.vblank_),
+      hblank_(other.hblank_),
+      renderer_(other.renderer_),
+      fifo_(other.fifo_),
+      render_interval_(other.render_interval_),
+      frame_count_(other.frame_count_),
+      render_current_frame_(other.render_current_frame_),
+      visible_sprites_(other.visible_sprites_),
+      sprite_table_(other.sprite_table_),
+      line_sprites_(other.line_sprites_),
+      line_sprite_count_(other.line_sprite_count_),
+      sprite_table_generation_(other.sprite_table_generation_),
+      sprite_table_height_(other.sprite_table_height_) {
+  other.FlushLines();
+  screen_ = other.screen_;
+  screen_owned_ = false;
+  other.screen_owned_ = false;
+  // the background plane and debug views get rebuilt from VRAM when needed
+}
+
 std::unique_ptr<std::vector<Sprite>> PPU::GetAllSprites() const {
   auto sprites{std::make_unique<std::vector<Sprite>>()};
   for (int i = 0xFE00; i < 0xFE9C; i += 4U) {
@@ -68,49 +98,109 @@ std::unique_ptr<std::vector<uint8_t>> PPU::RenderSprite(Sprite &s) const {
   return sprite_pixels;
 }
 
+/**
+ * Parse OAM into our sprite table and bucket the sprites by the lines they
+ * cover. Hardware scans OAM in order during mode 2 and takes the first 10
+ * sprites whose Y range covers the line (X doesn't matter, even an X of 0
+ * uses up a slot). On DMG the sprite with the smaller X then wins where
+ * sprites overlap, with OAM order breaking ties.
+ */
+void PPU::BuildSpriteTable(const uint8_t height) {
+  const uint8_t *oam = mmu_.Oam();
+  line_sprite_count_.fill(0);
+  for (int i = 0; i < 40; ++i) {
+    Sprite &s = sprite_table_[i];
+    s.y = oam[i * 4];
+    s.x = oam[i * 4 + 1];
+    s.tile = oam[i * 4 + 2];
+    s.flags = oam[i * 4 + 3];
+    s.oam_addr = 0xFE00 + i * 4;
+    // lines covered are y - 16 up to y - 16 + height
+    for (int line = s.y - 16; line < s.y - 16 + height; ++line) {
+      if (line < 0 || line >= kScreenHeight) continue;
+      if (line_sprite_count_[line] < 10) {
+        line_sprites_[line][line_sprite_count_[line]++] = i;
+      }
+    }
+  }
+  // sort each line into priority order, stable so OAM order breaks ties
+  for (int line = 0; line < kScreenHeight; ++line) {
+    auto begin = line_sprites_[line].begin();
+    std::stable_sort(begin, begin + line_sprite_count_[line],
+                     [this](const uint8_t a, const uint8_t b) {
+                       return sprite_table_[a].x < sprite_table_[b].x;
+                     });
+  }
+  sprite_table_generation_ = mmu_.OamGeneration();
+  sprite_table_height_ = height;
+}
+
 void PPU::OAMSearch() {
-  // OAM DMA XFER
   // reset our data from the prev line (if any)
   visible_sprites_.clear();
   const uint8_t current_ly = mmu_.ReadByte(LY);
-  // TODO: if sprites enabled?
-  // loop through our (up to) 40 sprites in the OAM table
-  for (int i = 0xFE00; i <= 0xFE9C; i += 4U) {
-    Sprite s{s.y = mmu_.ReadByte(i), s.x = mmu_.ReadByte(i + 1),
-             s.tile = mmu_.ReadByte(i + 2), s.flags = mmu_.ReadByte(i + 3),
-             s.oam_addr = i};
-    // sprite off screen
-    if (s.y <= 0 || s.y >= 160) continue;
-    // part of this sprite is on our line
-    // sprite height ??
-    // 8x8 or 8x16
-    uint8_t height;
-    const uint8_t lcdc = mmu_.ReadByte(LCDC);
-    bit_check(lcdc, 2) ? height = 16 : height = 8;
-    if (s.x != 0 &&
-        ((current_ly + 16 >= s.y) && (current_ly + 16 < s.y + height)) &&
-        visible_sprites_.size() < 10) {
-      visible_sprites_.push_back(s);
-      /*  spdlog::get("stdout")->debug(
-            "Visible sprite: x: {0} y: {1}, tile: {2},flags_: {3:02X}, oam addr:
-         "
-            "{4:04X}",
-            s.x, s.y, s.tile, s.flags, s.oam_addr);*/
+  // 8x8 or 8x16
+  const uint8_t height = bit_check(mmu_.ReadByte(LCDC), 2) ? 16 : 8;
+  if (sprite_table_height_ != height ||
+      sprite_table_generation_ != mmu_.OamGeneration()) {
+    BuildSpriteTable(height);
+  }
+  if (current_ly < kScreenHeight) {
+    for (int i = 0; i < line_sprite_count_[current_ly]; ++i) {
+      visible_sprites_.push_back(sprite_table_[line_sprites_[current_ly][i]]);
     }
-    // spdlog::get("stdout")->debug("visible_sprites_ sz: {0}",
-    // visible_sprites_.size());
   }
 
   oam_search_finished_ = true;
 }
 
 void PPU::PixelTransfer() {
-  uint8_t lcdc = mmu_.ReadByte(LCDC);
-  uint8_t current_ly = mmu_.ReadByte(LY);
+  OwnScreen();
+  LineState line;
+  CaptureLine(line);
+  DrawLine(line, mmu_.Vram());
+  finished_current_line_ = true;
+}
+
+/**
+ * Snapshot the registers and sprites the current line is drawn with. Also
+ * where the background plane gets synced, at the start of each frame
+ */
+void PPU::CaptureLine(LineState &line) {
+  line.ly = mmu_.GetRegister(LY);
+  line.lcdc = mmu_.GetRegister(LCDC);
+  line.scx = mmu_.GetRegister(SCX);
+  line.scy = mmu_.GetRegister(SCY);
+  line.wx = mmu_.GetRegister(WX);
+  line.wy = mmu_.GetRegister(WY);
+  line.bgp = mmu_.GetRegister(BGP);
+  line.obp0 = mmu_.GetRegister(OBP0);
+  line.obp1 = mmu_.GetRegister(OBP1);
+  line.use_bg_plane = false;
+  if (bit_check(line.lcdc, 0)) {
+    if (line.ly == 0) SyncBackgroundPlane(line.lcdc);
+    line.use_bg_plane = bg_plane_valid_ &&
+                        bg_plane_generation_ == mmu_.VramGeneration() &&
+                        ((bg_plane_lcdc_ ^ line.lcdc) & 0x18) == 0;
+  }
+  line.sprite_count = static_cast<int>(visible_sprites_.size());
+  std::copy(visible_sprites_.begin(), visible_sprites_.end(),
+            line.sprites.begin());
+}
+
+/**
+ * Generate one line of pixels. Only looks at the snapshot, the given copy of
+ * VRAM (0x8000 - 0x9FFF) and the background plane, so it's safe to run off
+ * the emulation thread
+ */
+void PPU::DrawLine(const LineState &line, const uint8_t *vram) {
+  Screen &pixels = *screen_;
+  const uint8_t lcdc = line.lcdc;
+  const uint8_t current_ly = line.ly;
   // bg pixel xfer, if bit 0 of LCDC is set (bg enable)
   if (bit_check(lcdc, 0)) {
-    uint8_t scx = mmu_.ReadByte(SCX);
-    uint8_t scy = mmu_.ReadByte(SCY);
+    const uint8_t scx = line.scx;
+    const uint8_t scy = line.scy;
     // what line are we on?
     uint8_t ybase = scy + current_ly;
     // find current bg map position
@@ -119,87 +209,96 @@ void PPU::PixelTransfer() {
     // leftmost bg address (to help with screen wrap)
     uint16_t bg_map_base =
         (0x9800 | (bit_check(lcdc, 3) << 10) | ((ybase & 0xf8) << 2));
-    // which tells us the current bg map tile number
-    // leftmost?
-    uint8_t tile_num = mmu_.ReadByte(bg_map_address);
-    // which we can use to grab the actual tile bytes
-    // grab the first byte and discard (like real h/w?)
+    uint8_t tile_num;
     uint16_t tileset;
     uint16_t tileaddr;
-    if (bit_check(lcdc, 4)) {
-      tileset = 0x8000;
-      tileaddr = tileset + (tile_num * 16);
-    } else {
-      tileset = 0x9000;
-      tileaddr = tileset + (static_cast<int8_t>(tile_num) * 16);
-    }
-    uint8_t tile_low = mmu_.ReadByte(tileaddr);
-    uint8_t tile_high = mmu_.ReadByte(tileaddr + 1);
+    uint8_t tile_low;
+    uint8_t tile_high;
     std::queue<uint8_t> p{};
-    // background (20 tiles wide)
-    while (p.size() < 160) {
-      tile_num = mmu_.ReadByte(bg_map_address);
-      // which
+    Pixel colors[4];
+    for (uint8_t i = 0; i < 4; ++i) colors[i] = BackgroundColor(line.bgp, i);
+    if (line.use_bg_plane) {
+      // Nothing in VRAM or the map/tile data selects has changed since the
+      // plane was synced, so the line is just a (wrapped) copy out of it.
+      // Scroll changes mid frame still land, since SCX/SCY are read per line
+      const uint8_t *row = &bg_plane_[ybase * kBackgroundMapSize];
+      for (int i = 0; i < 160; ++i) {
+        pixels[current_ly][i] = colors[row[(scx + i) & 0xFF]];
+      }
+    } else {
+      // VRAM or LCDC was changed mid frame, fetch this line the slow way
+
+      // which tells us the current bg map tile number
+      // leftmost?
+      tile_num = vram[bg_map_address - 0x8000];
+      // which we can use to grab the actual tile bytes
+      // grab the first byte and discard (like real h/w?)
       if (bit_check(lcdc, 4)) {
+        tileset = 0x8000;
         tileaddr = tileset + (tile_num * 16);
       } else {
+        tileset = 0x9000;
         tileaddr = tileset + (static_cast<int8_t>(tile_num) * 16);
       }
-      // get the right vertical row of the tile
-      tileaddr = tileaddr + ((ybase % 8) * 2);
-      tile_low = mmu_.ReadByte(tileaddr);
-      tile_high = mmu_.ReadByte(tileaddr + 1);
-      for (int bit = 7; bit >= 0; --bit) {
-        const uint8_t bit_low = bit_check(tile_low, bit);
-        const uint8_t bit_high = (tile_high >> bit) & 1U;
-        const uint8_t palette = (bit_high << 1) | bit_low;
-        p.push(palette);
+      // background (20 tiles wide)
+      while (p.size() < 160) {
+        tile_num = vram[bg_map_address - 0x8000];
+        // which
+        if (bit_check(lcdc, 4)) {
+          tileaddr = tileset + (tile_num * 16);
+        } else {
+          tileaddr = tileset + (static_cast<int8_t>(tile_num) * 16);
+        }
+        // get the right vertical row of the tile
+        tileaddr = tileaddr + ((ybase % 8) * 2);
+        tile_low = vram[tileaddr - 0x8000];
+        tile_high = vram[tileaddr + 1 - 0x8000];
+        for (int bit = 7; bit >= 0; --bit) {
+          const uint8_t bit_low = bit_check(tile_low, bit);
+          const uint8_t bit_high = (tile_high >> bit) & 1U;
+          const uint8_t palette = (bit_high << 1) | bit_low;
+          p.push(palette);
 
-        if (p.size() == 160) break;
-      }
-      // first tile so compensate for any horizontal scrolling
-      if (p.size() <= 8) {
-        for (int x = 0; x < (scx % 8); ++x) {
-          p.pop();
+          if (p.size() == 160) break;
         }
-      }
-      bg_map_address += 1;
+        // first tile so compensate for any horizontal scrolling
+        if (p.size() <= 8) {
+          for (int x = 0; x < (scx % 8); ++x) {
+            p.pop();
+          }
+        }
+        bg_map_address += 1;
 
-      // horizontal screen wrap
-      if (bg_map_address > bg_map_base + 0x1F) bg_map_address = bg_map_base;
-    }
+        // horizontal screen wrap
+        if (bg_map_address > bg_map_base + 0x1F) bg_map_address = bg_map_base;
+      }
 
-    // push all background pixels on this row to the "lcd"
-    for (int i = 0; i < 160; ++i) {
-      Pixel pixel = GetColor(p.front());
-      pixels_[current_ly][i] = pixel;
-      p.pop();
+      // push all background pixels on this row to the "lcd"
+      for (int i = 0; i < 160; ++i) {
+        pixels[current_ly][i] = colors[p.front()];
+        p.pop();
+      }
     }
 
     // if window enabled, render
     if (bit_check(lcdc, 5)) {
       std::queue<uint8_t> empty{};
       std::swap(p, empty);
-      uint8_t window_x_scroll = mmu_.ReadByte(WX);
-      uint8_t window_y_scroll = mmu_.ReadByte(WY);
+      const uint8_t window_x_scroll = line.wx;
+      const uint8_t window_y_scroll = line.wy;
       if (current_ly >= window_y_scroll) {
         uint8_t effective_scanline = current_ly - window_y_scroll;
         uint16_t window_tile_map = 0x9800 | bit_check(lcdc, 6) << 10 |
                                    (effective_scanline & 0xf8) << 2;
-        tile_num = mmu_.ReadByte(window_tile_map);
         // which we can use to grab the actual tile bytes
         if (bit_check(lcdc, 4)) {
           tileset = 0x8000;
-          tileaddr = tileset + (tile_num * 16);
         } else {
           tileset = 0x9000;
-          tileaddr = tileset + (static_cast<int8_t>(tile_num) * 16);
         }
-        tile_low = mmu_.ReadByte(tileaddr);
-        tile_high = mmu_.ReadByte(tileaddr + 1);
 
         while (p.size() < (160)) {
-          tile_num = mmu_.ReadByte(window_tile_map);
+          tile_num = vram[window_tile_map - 0x8000];
           // which
           if (bit_check(lcdc, 4)) {
             tileaddr = tileset + (tile_num * 16);
@@ -208,8 +307,8 @@ void PPU::PixelTransfer() {
           }
           // get the right vertical row of the tile
           tileaddr = tileaddr + effective_scanline % 8 * 2;
-          tile_low = mmu_.ReadByte(tileaddr);
-          tile_high = mmu_.ReadByte(tileaddr + 1);
+          tile_low = vram[tileaddr - 0x8000];
+          tile_high = vram[tileaddr + 1 - 0x8000];
           for (int bit = 7; bit >= 0; --bit) {
             uint8_t bit_low = bit_check(tile_low, bit);
             uint8_t bit_high = (tile_high >> bit) & 1U;
@@ -226,10 +325,9 @@ void PPU::PixelTransfer() {
 
       int count = p.size();
       for (int i = 0; i < count; ++i) {
-        Pixel pixel = GetColor(p.front());
         int x_pos = (window_x_scroll - 7) + i;
         if (x_pos >= 0 && x_pos < 160) {
-          pixels_[current_ly][x_pos] = pixel;
+          pixels[current_ly][x_pos] = colors[p.front()];
         }
         p.pop();
       }
@@ -241,28 +339,33 @@ void PPU::PixelTransfer() {
       // used for calculating the distance between y flipped sprite tiles
       uint8_t height;
       bit_check(lcdc, 2) ? height = 2 : height = 1;
-      std::vector<Pixel> row{};
-      for (const Sprite &s : visible_sprites_) {
+      std::array<Pixel, 8> row{};
+      // sprites are in priority order, so the first sprite with an opaque
+      // pixel at a position owns it, whether or not it ends up behind the
+      // background
+      std::array<bool, 160> claimed{};
+      for (int i = 0; i < line.sprite_count; ++i) {
+        const Sprite &s = line.sprites[i];
         tileaddr = 0x8000 + (s.tile * 16);
         uint8_t row_num = (current_ly - (s.y - 16)) * 2;
         // Flip across the Y axis (upside down)
         if (bit_check(s.flags, 6)) {
           tileaddr = 0x8000 + (((s.tile + height) * 16) - 1);
           tileaddr -= row_num;
-          tile_low = mmu_.ReadByte(tileaddr - 1);
-          tile_high = mmu_.ReadByte(tileaddr);
+          tile_low = vram[tileaddr - 1 - 0x8000];
+          tile_high = vram[tileaddr - 0x8000];
         } else {
           tileaddr += row_num;
-          tile_low = mmu_.ReadByte(tileaddr);
-          tile_high = mmu_.ReadByte(tileaddr + 1);
+          tile_low = vram[tileaddr - 0x8000];
+          tile_high = vram[tileaddr + 1 - 0x8000];
         }
 
+        const uint8_t obp = bit_check(s.flags, 4) ? line.obp1 : line.obp0;
         for (int bit = 7; bit >= 0; --bit) {
           uint8_t bit_low = bit_check(tile_low, bit);
           uint8_t bit_high = bit_check(tile_high, bit);
           uint8_t palette = (bit_high << 1) | bit_low;
-          Pixel pixel = GetSpriteColor(palette, bit_check(s.flags, 4));
-          row.push_back(pixel);
+          row[7 - bit] = SpriteColor(obp, palette);
         }
         // x flipping
         if (bit_check(s.flags, 5)) {
@@ -273,23 +376,169 @@ void PPU::PixelTransfer() {
         // if bit is 1, sprite behind BG colors 1-3
         bool sprite_bg_priority = bit_check(s.flags, 7);
         for (Pixel &p : row) {
-          if (p.a == 0 || x_pos < 0 || x_pos >= 160) {
+          if (p.a == 0 || x_pos < 0 || x_pos >= 160 || claimed[x_pos]) {
             ++x_pos;
             continue;
           }
-          if ((sprite_bg_priority && pixels_[current_ly][x_pos].palette == 0) ||
+          claimed[x_pos] = true;
+          if ((sprite_bg_priority && pixels[current_ly][x_pos].palette == 0) ||
               !sprite_bg_priority) {
-            pixels_[current_ly][x_pos] = p;
+            pixels[current_ly][x_pos] = p;
           }
           ++x_pos;
         }
-        row.clear();
       }
     }
   }
+}
+
+/**
+ * Capture the current line for the workers to draw later. A copy of VRAM is
+ * only taken when it was written since the previous captured line
+ */
+void PPU::QueueLine() {
+  const uint8_t current_ly = mmu_.GetRegister(LY);
+  // a new frame (or the LCD was switched back on part way through the last
+  // one), anything still pending has to be drawn before it's overwritten
+  if (captured_lines_ > 0 &&
+      current_ly <= frame_lines_[captured_lines_ - 1].ly) {
+    FlushLines();
+    captured_lines_ = 0;
+    dispatched_lines_ = 0;
+    vram_copy_count_ = 0;
+  }
+  // normally idle by now, but VRAM copies can't move while they're reading
+  workers_->Wait();
+  OwnScreen();
+  if (vram_copy_count_ == 0 ||
+      vram_copy_generation_ != mmu_.VramGeneration()) {
+    if (vram_copy_count_ == static_cast<int>(vram_copies_.size())) {
+      vram_copies_.emplace_back();
+    }
+    std::copy(mmu_.Vram(), mmu_.Vram() + 0x2000,
+              vram_copies_[vram_copy_count_++].begin());
+    vram_copy_generation_ = mmu_.VramGeneration();
+  }
+  LineState &line = frame_lines_[captured_lines_++];
+  CaptureLine(line);
+  line.vram = vram_copy_count_ - 1;
   finished_current_line_ = true;
 }
 
+/**
+ * Hand every captured line that hasn't been drawn yet to the workers and
+ * wait for them, so pixels_ is complete up to the current line
+ */
+void PPU::FlushLines() {
+  if (!workers_) return;
+  DispatchLines();
+  workers_->Wait();
+}
+
+/**
+ * Start the workers on the captured lines that haven't been drawn yet,
+ * without waiting for them
+ */
+void PPU::DispatchLines() {
+  if (dispatched_lines_ == captured_lines_) return;
+  const int first = dispatched_lines_;
+  workers_->Start(captured_lines_ - first, [this, first](const int i) {
+    const LineState &line = frame_lines_[first + i];
+    DrawLine(line, vram_copies_[line.vram].data());
+  });
+  dispatched_lines_ = captured_lines_;
+}
+
+void PPU::Snapshot(PPUState &state) const {
+  state.finished_current_screen = finished_current_screen;
+  state.current_scanline_cycles = current_scanline_cycles_;
+  state.pending_cycles = pending_cycles_;
+  state.next_event = next_event_;
+  state.finished_current_line = finished_current_line_;
+  state.oam_search_finished = oam_search_finished_;
+  state.vblank = vblank_;
+  state.hblank = hblank_;
+  state.fifo = fifo_;
+  state.visible_sprite_count = static_cast<int>(visible_sprites_.size());
+  std::copy(visible_sprites_.begin(), visible_sprites_.end(),
+            state.visible_sprites.begin());
+}
+
+void PPU::Restore(const PPUState &state) {
+  // lines captured since belong to a different timeline
+  FlushLines();
+  captured_lines_ = 0;
+  dispatched_lines_ = 0;
+  vram_copy_count_ = 0;
+  finished_current_screen = state.finished_current_screen;
+  current_scanline_cycles_ = state.current_scanline_cycles;
+  pending_cycles_ = state.pending_cycles;
+  next_event_ = state.next_event;
+  finished_current_line_ = state.finished_current_line;
+  oam_search_finished_ = state.oam_search_finished;
+  vblank_ = state.vblank;
+  hblank_ = state.hblank;
+  fifo_ = state.fifo;
+  visible_sprites_.assign(
+      state.visible_sprites.begin(),
+      state.visible_sprites.begin() + state.visible_sprite_count);
+}
+
+void PPU::SetRenderThreads(const int threads) {
+  FlushLines();
+  captured_lines_ = 0;
+  dispatched_lines_ = 0;
+  vram_copy_count_ = 0;
+  workers_.reset();
+  if (threads > 0) workers_ = std::make_unique<RenderWorkers>(threads);
+}
+
+/**
+ * Bring the cached background plane up to date with VRAM. Only map entries
+ * that were written, or that point at tile data that was written, since the
+ * last sync get decoded again, unless the map or tile data select changed
+ */
+void PPU::SyncBackgroundPlane(const uint8_t lcdc) {
+  const uint32_t generation = mmu_.VramGeneration();
+  const bool full_redraw = !bg_plane_valid_ || ((bg_plane_lcdc_ ^ lcdc) & 0x18);
+  if (!full_redraw && bg_plane_generation_ == generation) return;
+  bg_plane_.resize(kBackgroundMapSize * kBackgroundMapSize);
+
+  const int map = bit_check(lcdc, 3) ? 0x400 : 0;
+  const uint8_t *vram = mmu_.Vram();
+  for (int entry = 0; entry < 1024; ++entry) {
+    const uint8_t tile_num = vram[0x1800 + map + entry];
+    uint16_t tile_address;
+    if (bit_check(lcdc, 4)) {
+      tile_address = 0x8000 + (tile_num * 16);
+    } else {
+      tile_address = 0x9000 + (static_cast<int8_t>(tile_num) * 16);
+    }
+    if (!full_redraw && mmu_.MapGeneration(map + entry) <= bg_plane_generation_ &&
+        mmu_.TileGeneration((tile_address - 0x8000) >> 4) <=
+            bg_plane_generation_) {
+      continue;
+    }
+    const uint8_t *tile = vram + (tile_address - 0x8000);
+    uint8_t *dest = &bg_plane_[(entry / 32) * 8 * kBackgroundMapSize +
+                               (entry % 32) * 8];
+    for (int y = 0; y < 8; ++y) {
+      const uint8_t tile_low = tile[y * 2];
+      const uint8_t tile_high = tile[y * 2 + 1];
+      for (int bit = 7; bit >= 0; --bit) {
+        const uint8_t bit_low = (tile_low >> bit) & 1U;
+        const uint8_t bit_high = (tile_high >> bit) & 1U;
+        dest[7 - bit] = (bit_high << 1) | bit_low;
+      }
+      dest += kBackgroundMapSize;
+    }
+  }
+
+  bg_plane_generation_ = generation;
+  bg_plane_lcdc_ = lcdc;
+  bg_plane_valid_ = true;
+}
+
 void PPU::SetMode(const uint8_t mode) const {
   mmu_.SetPPUMode(mode);
   // set STAT interrupt flag?
@@ -300,7 +549,10 @@ void PPU::SetMode(const uint8_t mode) const {
  * color according to the current palette_ settings
  */
 Pixel PPU::GetColor(const uint8_t tile) const {
-  auto bgp = mmu_.ReadByte(BGP);
+  return BackgroundColor(mmu_.ReadByte(BGP), tile);
+}
+
+Pixel PPU::BackgroundColor(uint8_t bgp, const uint8_t tile) const {
   Pixel pixel{};
 
   switch (tile) {
@@ -336,11 +588,10 @@ Pixel PPU::GetColor(const uint8_t tile) const {
 }
 
 Pixel PPU::GetSpriteColor(const uint8_t tile, const bool obp_select) const {
-  // uint8_t obp;
-  uint8_t obp = mmu_.ReadByte(OBP0);
-  if (obp_select) {
-    obp = mmu_.ReadByte(OBP1);
-  }
+  return SpriteColor(mmu_.ReadByte(obp_select ? OBP1 : OBP0), tile);
+}
+
+Pixel PPU::SpriteColor(uint8_t obp, const uint8_t tile) const {
   Pixel pixel{};
 
   switch (tile) {
@@ -377,6 +628,38 @@ Pixel PPU::GetSpriteColor(const uint8_t tile, const bool obp_select) const {
   return pixel;
 }
 
+void PPU::SetRenderInterval(int interval) {
+  interval = interval < 0 ? 0 : interval;
+  if (interval == render_interval_) return;
+  render_interval_ = interval;
+  // frame_count_ carries on, so switching rendering off for a few frames
+  // and back (eg. run ahead, every frame) keeps to every nth frame shown.
+  // Meant to be called between frames
+  render_current_frame_ =
+      render_interval_ > 0 && frame_count_ % render_interval_ == 0;
+  next_event_ = 0;
+}
+
+/**
+ * Scanline position (in cycles) at which Update() next has work to do, see
+ * AddCycles(). Has to match the conditions in Update()
+ */
+int PPU::NextEvent() const {
+  // LY is held at 0 while the LCD is off, so keep stepping
+  if (!bit_check(mmu_.GetRegister(LCDC), 7)) return 0;
+  if (mmu_.GetRegister(LY) >= 144) return 456;
+  if (!oam_search_finished_) return 0;
+  if (renderer_ == PPURenderer::kPixelFIFO && render_current_frame_) {
+    // the FIFO runs every instruction through mode 3 so that register
+    // writes land on the right dot
+    if (!finished_current_line_ && !fifo_.active) return 80;
+    return hblank_ ? 456 : 0;
+  }
+  if (!finished_current_line_) return 80;
+  if (!hblank_) return 80 + 172;
+  return 456;
+}
+
 /**
  * Refresh LCD one scan line at a time
  * Once LY = 144, V-blank until 153 then reset LY to 0 and repeat
@@ -392,6 +675,7 @@ void PPU::Update(int cycles) {
   if (!bit_check(lcdc, 7)) {
     mmu_.WriteByte(LY, 0);
     current_scanline_cycles_ = 0;
+    fifo_.active = false;
     // fill "screen" with pixels whiter than our lightest palette color?
     /*auto white_pixel = Pixel{};
     white_pixel.r = 255;
@@ -407,19 +691,33 @@ void PPU::Update(int cycles) {
 
   if (!oam_search_finished_ && current_scanline_cycles_ <= 80 &&
       current_ly < 144) {
-    OAMSearch();
+    // skipped frames still go through the modes, just without the work
+    if (render_current_frame_) {
+      OAMSearch();
+    } else {
+      oam_search_finished_ = true;
+    }
     SetMode(kPPUModeOAMSearch);
   }
-  if (!finished_current_line_ && current_scanline_cycles_ >= 80 &&
-      current_scanline_cycles_ <= (80 + 172) && current_ly < 144) {
-    PixelTransfer();
-    SetMode(kPPUModeLCDTransfer);
-  }
-  if (!hblank_ && current_scanline_cycles_ >= (80 + 172) &&
-      current_scanline_cycles_ < 456 && current_ly < 144) {
-    // H Blank
-    SetMode(kPPUModeHBlank);
-    hblank_ = true;
+  if (renderer_ == PPURenderer::kPixelFIFO && render_current_frame_) {
+    // mode 3 (and so the start of H Blank) is timed by the FIFO itself
+    UpdatePixelFifo(current_ly);
+  } else {
+    if (!finished_current_line_ && current_scanline_cycles_ >= 80 &&
+        current_scanline_cycles_ <= (80 + 172) && current_ly < 144) {
+      if (render_current_frame_) {
+        workers_ ? QueueLine() : PixelTransfer();
+      } else {
+        finished_current_line_ = true;
+      }
+      SetMode(kPPUModeLCDTransfer);
+    }
+    if (!hblank_ && current_scanline_cycles_ >= (80 + 172) &&
+        current_scanline_cycles_ < 456 && current_ly < 144) {
+      // H Blank
+      SetMode(kPPUModeHBlank);
+      hblank_ = true;
+    }
   }
   if (current_scanline_cycles_ >= 456) {
     // inc Ly (next line)
@@ -445,6 +743,9 @@ void PPU::Update(int cycles) {
       hblank_ = false;
       oam_search_finished_ = false;
       finished_current_line_ = false;
+      // drop a line the FIFO didn't get to finish (renderer switched, frame
+      // skipped part way through)
+      fifo_.active = false;
     }
     if (current_ly == 144 && !vblank_) {
       // v blank (set bit 0 of 0xFF0F)
@@ -453,6 +754,8 @@ void PPU::Update(int cycles) {
       mmu_.WriteByte(IF, int_flag);
       SetMode(kPPUModeVBlank);
       vblank_ = true;
+      // the frame's lines get drawn while the CPU carries on through V Blank
+      if (workers_) DispatchLines();
     }
 
     if (current_ly > 153) {
@@ -463,6 +766,9 @@ void PPU::Update(int cycles) {
       mmu_.WriteByte(STAT, stat);*/
       vblank_ = false;
       finished_current_screen = true;
+      if (render_interval_ > 0) ++frame_count_;
+      render_current_frame_ =
+          render_interval_ > 0 && frame_count_ % render_interval_ == 0;
     }
   }
 
@@ -473,12 +779,10 @@ void PPU::Update(int cycles) {
  * Convert our internal graphics representation to a simple
  * pixel array for use by SDL or whatever
  */
-std::unique_ptr<uint8_t[]> PPU::Render() const {
-  auto pixels = std::make_unique<uint8_t[]>(160 * 144 * 4);
-  // TODO: use std lib algos (copy?) to speed things up?
-
+void PPU::Render(uint8_t *pixels) {
+  FlushLines();
   int count = 0;
-  for (const auto &pixel : this->pixels_) {
+  for (const auto &pixel : *screen_) {
     for (const auto &x : pixel) {
       pixels[count] = x.r;
       pixels[count + 1] = x.g;
@@ -487,91 +791,121 @@ std::unique_ptr<uint8_t[]> PPU::Render() const {
       count += 4;
     }
   }
-  return pixels;
 }
 
 /**
- * Render the whole background tile map
+ * Decode one 8x8 tile (from its raw VRAM address) into RGBA pixels at dest.
+ * stride is the width of the destination in bytes
  */
-std::unique_ptr<uint8_t[]> PPU::RenderBackgroundTileMap() const {
-  auto pixels = std::make_unique<uint8_t[]>(256 * 256 * 4);
-
-  uint16_t tile_address;
-  const uint8_t lcdc = mmu_.ReadByte(LCDC);
-  int count = 0;
+void PPU::DrawTile(const uint16_t tile_address, uint8_t *dest, const int stride,
+                   const Pixel *colors) const {
+  const uint8_t *tile = mmu_.Vram() + (tile_address - 0x8000);
+  for (int y = 0; y < 8; ++y) {
+    const uint8_t tile_low = tile[y * 2];
+    const uint8_t tile_high = tile[y * 2 + 1];
+    uint8_t *row = dest + y * stride;
+    for (int bit = 7; bit >= 0; --bit) {
+      const uint8_t bit_low = (tile_low >> bit) & 1U;
+      const uint8_t bit_high = (tile_high >> bit) & 1U;
+      const Pixel &pixel = colors[(bit_high << 1) | bit_low];
+      row[0] = pixel.r;
+      row[1] = pixel.g;
+      row[2] = pixel.b;
+      row[3] = pixel.a;
+      row += 4;
+    }
+  }
+}
 
+/**
+ * Render the whole background tile map. Only map entries that were written,
+ * or that point at tile data that was written, since the last call get
+ * redrawn. A change of palette or map/tile data select redraws everything
+ */
+const DebugView &PPU::RenderBackgroundTileMap() {
+  DebugView &view = bg_map_view_;
+  const uint8_t lcdc = mmu_.GetRegister(LCDC);
+  const uint8_t bgp = mmu_.GetRegister(BGP);
+  const uint32_t generation = mmu_.VramGeneration();
+  // map select (bit 3) and tile data select (bit 4)
+  const bool full_redraw =
+      !view.valid || view.bgp != bgp || ((view.lcdc ^ lcdc) & 0x18);
+  if (!full_redraw && view.vram_generation == generation) return view;
+
+  view.pixels.resize(kBackgroundMapSize * kBackgroundMapSize * 4);
+  Pixel colors[4];
+  for (uint8_t i = 0; i < 4; ++i) colors[i] = GetColor(i);
+  const int map = bit_check(lcdc, 3) ? 0x400 : 0;
+  const uint8_t *vram = mmu_.Vram();
   // background (32 tiles wide)
-  for (int y = 0; y < 256; ++y) {
-    uint16_t bg_map_address =
-        0x9800 | bit_check(lcdc, 3) << 10 | (y & 0xf8) << 2;
-    for (int x = 0; x < 32; ++x) {
-      const uint8_t tile_num = mmu_.ReadByte(bg_map_address);
-      if (bit_check(lcdc, 4)) {
-        tile_address = 0x8000 + (tile_num * 16);
-      } else {
-        tile_address = 0x9000 + (static_cast<int8_t>(tile_num) * 16);
-      }
-      // get the right vertical row of the tile
-      tile_address = tile_address + ((y % 8) * 2);
-      const uint8_t tile_low = mmu_.ReadByte(tile_address);
-      const uint8_t tile_high = mmu_.ReadByte(tile_address + 1);
-
-      for (int bit = 7; bit >= 0; --bit) {
-        const uint8_t bit_low = (tile_low >> bit) & 1U;
-        const uint8_t bit_high = (tile_high >> bit) & 1U;
-        const uint8_t palette = (bit_high << 1) | bit_low;
-
-        // combine these two bits to get our palette_ code
-        // figure our pixel color here
-        const Pixel pixel = GetColor(palette);
-        pixels[count] = pixel.r;
-        pixels[count + 1] = pixel.g;
-        pixels[count + 2] = pixel.b;
-        pixels[count + 3] = pixel.a;
-        count += 4;
-      }
-      // next tile on this row
-      bg_map_address += 1;
+  for (int entry = 0; entry < 1024; ++entry) {
+    const uint8_t tile_num = vram[0x1800 + map + entry];
+    uint16_t tile_address;
+    if (bit_check(lcdc, 4)) {
+      tile_address = 0x8000 + (tile_num * 16);
+    } else {
+      tile_address = 0x9000 + (static_cast<int8_t>(tile_num) * 16);
+    }
+    if (!full_redraw &&
+        mmu_.MapGeneration(map + entry) <= view.vram_generation &&
+        mmu_.TileGeneration((tile_address - 0x8000) >> 4) <=
+            view.vram_generation) {
+      continue;
     }
+    const int x = (entry % 32) * 8;
+    const int y = (entry / 32) * 8;
+    DrawTile(tile_address,
+             view.pixels.data() + (y * kBackgroundMapSize + x) * 4,
+             kBackgroundMapSize * 4, colors);
   }
 
-  return pixels;
+  view.vram_generation = generation;
+  view.lcdc = lcdc;
+  view.bgp = bgp;
+  view.valid = true;
+  ++view.version;
+  return view;
 }
 
 /**
- * Render the tile data, to aid in debugging
+ * Render the tile data, to aid in debugging. Tiles are laid out in the order
+ * the background sees them with the current tile data select, so in 0x8800
+ * mode the 0x9000 block comes first (tile numbers 0-127) followed by the
+ * 0x8800 block (128-255) and finally the sprite only 0x8000 block
  */
-std::unique_ptr<uint8_t[]> PPU::RenderTiles() const {
-  auto pixels = std::make_unique<uint8_t[]>(128 * 192 * 4);
-
-  uint16_t tile_row = 0;
-  int count = 0;
-
-  for (int y = 0; y < 192; ++y) {
-    for (int x = 0; x < 16; ++x) {
-      // TODO: implement handling other tile map address
-      uint16_t tile_address = 0x8000 + tile_row + (x * 16);
-      tile_address = tile_address + ((y % 8) * 2);
-      const auto tile_low = mmu_.ReadByte(tile_address);
-      const auto tile_high = mmu_.ReadByte(tile_address + 1);
-
-      for (int bit = 7; bit >= 0; --bit) {
-        const uint8_t bit_low = (tile_low >> bit) & 1U;
-        const uint8_t bit_high = (tile_high >> bit) & 1U;
-        const uint8_t palette = (bit_high << 1) | bit_low;
-
-        // combine these two bits to get our palette_ code
-        // figure our pixel color here
-        const Pixel pixel = GetColor(palette);
-        pixels[count] = pixel.r;
-        pixels[count + 1] = pixel.g;
-        pixels[count + 2] = pixel.b;
-        pixels[count + 3] = pixel.a;
-        count += 4;
-      }
+const DebugView &PPU::RenderTiles() {
+  DebugView &view = tile_view_;
+  const uint8_t lcdc = mmu_.GetRegister(LCDC);
+  const uint8_t bgp = mmu_.GetRegister(BGP);
+  const uint32_t generation = mmu_.VramGeneration();
+  const bool full_redraw =
+      !view.valid || view.bgp != bgp || ((view.lcdc ^ lcdc) & 0x10);
+  if (!full_redraw && view.vram_generation == generation) return view;
+
+  view.pixels.resize(kTileViewWidth * kTileViewHeight * 4);
+  Pixel colors[4];
+  for (uint8_t i = 0; i < 4; ++i) colors[i] = GetColor(i);
+  // 128 tile blocks at 0x8000, 0x8800 and 0x9000
+  constexpr int kUnsignedOrder[3] = {0, 1, 2};
+  constexpr int kSignedOrder[3] = {2, 1, 0};
+  const int *block_order =
+      bit_check(lcdc, 4) ? kUnsignedOrder : kSignedOrder;
+  for (int slot = 0; slot < 384; ++slot) {
+    const int tile = block_order[slot / 128] * 128 + slot % 128;
+    if (!full_redraw && mmu_.TileGeneration(tile) <= view.vram_generation) {
+      continue;
     }
-    if (y % 8 == 0 && y != 0) tile_row += 0x0100;
+    const int x = (slot % 16) * 8;
+    const int y = (slot / 16) * 8;
+    DrawTile(0x8000 + tile * 16,
+             view.pixels.data() + (y * kTileViewWidth + x) * 4,
+             kTileViewWidth * 4, colors);
   }
 
-  return pixels;
+  view.vram_generation = generation;
+  view.lcdc = lcdc;
+  view.bgp = bgp;
+  view.valid = true;
+  ++view.version;
+  return view;
 }
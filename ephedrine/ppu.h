@@ -4,7 +4,9 @@
 #include <array>
 #include <cstdint>
 #include <memory>
+#include <vector>
 #include "mmu.h"
+#include "render_workers.h"
 
 // Modes
 constexpr uint8_t kPPUModeHBlank = 0x00;
@@ -12,6 +14,13 @@ constexpr uint8_t kPPUModeVBlank = 0x01;
 constexpr uint8_t kPPUModeOAMSearch = 0x02;
 constexpr uint8_t kPPUModeLCDTransfer = 0x03;
 
+// Output sizes (in pixels) of the screen and the debug views
+constexpr int kScreenWidth = 160;
+constexpr int kScreenHeight = 144;
+constexpr int kTileViewWidth = 128;   // 16 tiles across
+constexpr int kTileViewHeight = 192;  // 24 tiles down
+constexpr int kBackgroundMapSize = 256;
+
 // Sprite Attributes/Flags
 constexpr uint8_t kObjectBackgroundPriority = 0x80;  // bit 7
 constexpr uint8_t kYFlip = 0x40;                     // bit 6
@@ -38,8 +47,106 @@ struct Sprite {
 enum class PixelSource { bgp, ogp0, ogp1 };
 
 struct PixelFIFO {
-  uint8_t tile;
+  uint8_t tile;  // colour index 0-3
   PixelSource source;
+  bool background_priority;  // sprites only, behind BG colours 1-3
+};
+
+// Which renderer generates the pixels during mode 3
+enum class PPURenderer {
+  kScanline,  // whole line in one go at the start of mode 3, fixed length
+  kPixelFIFO  // dot by dot fetcher and FIFOs, variable mode 3 length
+};
+
+// Everything the pixel FIFO renderer needs to carry between dots, kept in
+// fixed size arrays so nothing is allocated while a line is being drawn.
+// See pixel_fifo.cpp
+struct FifoState {
+  // background/window FIFO, a ring buffer of colour indices
+  std::array<uint8_t, 16> bg{};
+  int bg_head = 0;
+  int bg_size = 0;
+  // sprite FIFO, lined up with the next 8 pixels to be pushed to the LCD
+  std::array<PixelFIFO, 8> obj{};
+  int obj_head = 0;
+  int obj_size = 0;
+  // background fetcher, each step takes 2 dots:
+  // 0 tile number, 1 tile data low, 2 tile data high, 3 push to the FIFO
+  int fetcher_step = 0;
+  int fetcher_dots = 0;
+  int fetch_x = 0;
+  uint8_t tile_num = 0;
+  uint8_t tile_low = 0;
+  uint8_t tile_high = 0;
+  bool fetching_window = false;
+  // progress through the current line
+  bool active = false;
+  int dots = 0;
+  int lx = 0;
+  int discard = 0;
+  int next_sprite = 0;
+  int sprite_dots = 0;
+  // the window has its own line counter which only advances on lines it
+  // was actually drawn on
+  bool window_y_triggered = false;
+  int window_line = 0;
+  // palettes, only looked up again when the registers change
+  uint8_t bgp = 0;
+  uint8_t obp0 = 0;
+  uint8_t obp1 = 0;
+  std::array<Pixel, 4> bg_colors{};
+  std::array<std::array<Pixel, 4>, 2> obj_colors{};
+};
+
+// Copy of everything the scanline renderer reads for one line, captured at
+// the start of mode 3. With render threads enabled the pixels are generated
+// from these once the frame is done, see PPU::SetRenderThreads()
+struct LineState {
+  uint8_t ly = 0;
+  uint8_t lcdc = 0;
+  uint8_t scx = 0;
+  uint8_t scy = 0;
+  uint8_t wx = 0;
+  uint8_t wy = 0;
+  uint8_t bgp = 0;
+  uint8_t obp0 = 0;
+  uint8_t obp1 = 0;
+  // the cached background plane was in sync with VRAM for this line
+  bool use_bg_plane = false;
+  // which of the frame's VRAM copies the line was drawn from
+  int vram = 0;
+  int sprite_count = 0;
+  std::array<Sprite, 10> sprites{};
+};
+
+// An RGBA debug view that is kept up to date incrementally from the VRAM
+// write tracking in the MMU, see PPU::RenderTiles()
+struct DebugView {
+  std::vector<uint8_t> pixels{};
+  // bumped every time pixels changes, so uploads can be skipped otherwise
+  uint64_t version = 0;
+  // state this view was last rendered with
+  uint32_t vram_generation = 0;
+  uint8_t lcdc = 0;
+  uint8_t bgp = 0;
+  bool valid = false;
+};
+
+// Where the PPU is up to, as plain data for Gameboy::Snapshot(). Caches
+// (sprite table, background plane) get rebuilt from memory instead, and
+// the screen and render settings are left as they are
+struct PPUState {
+  bool finished_current_screen;
+  int current_scanline_cycles;
+  int pending_cycles;
+  int next_event;
+  bool finished_current_line;
+  bool oam_search_finished;
+  bool vblank;
+  bool hblank;
+  FifoState fifo;
+  int visible_sprite_count;
+  std::array<Sprite, 10> visible_sprites;
 };
 
 enum class PPUMode { kHBlank = 0, kVBlank, kOAMSearch, kLCDTransfer };
@@ -47,18 +154,70 @@ enum class PPUMode { kHBlank = 0, kVBlank, kOAMSearch, kLCDTransfer };
 class PPU {
  public:
   PPU(MMU &mmu);
+  // A copy of other that runs on mmu instead, see Gameboy::Clone(). Lines
+  // other still has waiting on its render threads are finished first, the
+  // copy renders inline and shares the screen until either of them draws
+  PPU(PPU &other, MMU &mmu);
+  PPU(const PPU &) = delete;
+  PPU &operator=(const PPU &) = delete;
   bool finished_current_screen = false;
   // Update the current scanline
   void Update(int cycles);
+  // Catch-up synchronisation. Cycles from the CPU are banked and the PPU is
+  // only stepped once the next mode change, line or interrupt it owns is
+  // due, everything in between would just be counting
+  void AddCycles(int cycles) {
+    if (current_scanline_cycles_ + pending_cycles_ < next_event_) {
+      pending_cycles_ += cycles;
+      return;
+    }
+    current_scanline_cycles_ += pending_cycles_;
+    pending_cycles_ = 0;
+    Update(cycles);
+    next_event_ = NextEvent();
+  }
+  // Bring the PPU up to date, called by the MMU before VRAM, OAM or a PPU
+  // register is accessed. The access might change what's due next, so the
+  // PPU is stepped again on the next instruction
+  void CatchUp() {
+    current_scanline_cycles_ += pending_cycles_;
+    pending_cycles_ = 0;
+    next_event_ = 0;
+  }
+  // Only generate pixels for every nth frame (1 renders every frame, 0 none
+  // at all). Timing, modes, LY/STAT and interrupts carry on regardless, the
+  // screen just keeps showing the last frame rendered. Frames run with
+  // rendering off don't count towards the nth
+  void SetRenderInterval(int interval);
+  int GetRenderInterval() const { return render_interval_; }
+  // Switch between the renderers, takes effect from the next line
+  void SetRenderer(PPURenderer renderer) {
+    // the FIFO draws straight into the screen, so finish any deferred lines
+    FlushLines();
+    renderer_ = renderer;
+    next_event_ = 0;
+  }
+  PPURenderer GetRenderer() const { return renderer_; }
+  // Generate the scanline renderer's pixels on this many worker threads,
+  // after each frame, from per line register snapshots. 0 draws every line
+  // inline on the emulation thread. The output is the same either way
+  void SetRenderThreads(int threads);
+  int GetRenderThreads() const { return workers_ ? workers_->Threads() : 0; }
   constexpr bool IsVBlank() const { return vblank_; }
   constexpr bool IsHBlank() const { return hblank_; }
-  // Turning our internal representation into pixels on screen
-  std::unique_ptr<uint8_t[]> Render() const;
-  std::unique_ptr<uint8_t[]> RenderBackgroundTileMap() const;
-  std::unique_ptr<uint8_t[]> RenderTiles() const;
+  // Turning our internal representation into RGBA pixels on screen.
+  // Callers own the destination buffers so they can be reused every frame
+  void Render(uint8_t *pixels);
+  // Debug views, only the tiles/map entries written since the last call
+  // are redrawn so these are close to free when VRAM is idle
+  const DebugView &RenderBackgroundTileMap();
+  const DebugView &RenderTiles();
   // debugging ui
   std::unique_ptr<std::vector<Sprite>> GetAllSprites() const;
   std::unique_ptr<std::vector<uint8_t>> RenderSprite(Sprite &s) const;
+  void Snapshot(PPUState &state) const;
+  // Anything still being drawn from before is finished first
+  void Restore(const PPUState &state);
   template <class Archive>
   void serialize(Archive &archive) {
     archive(finished_current_screen, current_scanline_cycles_,
@@ -66,11 +225,26 @@ class PPU {
   }
 
  private:
+  using Screen = std::array<std::array<Pixel, 160>, 144>;
   MMU &mmu_;
-  std::array<std::array<Pixel, 160>, 144> pixels_;
+  std::shared_ptr<Screen> screen_;
   // Pixel pixels_[144][160]{}; // 160x144 screen, 4 bytes per pixel
+  // false while screen_ is shared with a clone, see OwnScreen()
+  bool screen_owned_ = true;
+  // Called before anything is drawn, on the emulation thread
+  void OwnScreen() {
+    if (screen_owned_) return;
+    screen_ = std::make_shared<Screen>(*screen_);
+    screen_owned_ = true;
+  }
   Pixel GetColor(uint8_t tile) const;
   Pixel GetSpriteColor(uint8_t tile, bool obp_select) const;
+  Pixel BackgroundColor(uint8_t bgp, uint8_t tile) const;
+  Pixel SpriteColor(uint8_t obp, uint8_t tile) const;
+  void DrawTile(uint16_t tile_address, uint8_t *dest, int stride,
+                const Pixel *colors) const;
+  DebugView bg_map_view_{};
+  DebugView tile_view_{};
   const Pixel palette_[4]{
       {(uint8_t)224, (uint8_t)248, (uint8_t)208, (uint8_t)0xff},  // white
       {(uint8_t)136, (uint8_t)192, (uint8_t)112, (uint8_t)0xff},  // light grey
@@ -78,15 +252,67 @@ class PPU {
       {(uint8_t)8, (uint8_t)24, (uint8_t)32, (uint8_t)0xff}       // black
   };
   void OAMSearch();
+  void BuildSpriteTable(uint8_t height);
   void PixelTransfer();
+  void CaptureLine(LineState &line);
+  void DrawLine(const LineState &line, const uint8_t *vram);
+  // deferred rendering
+  void QueueLine();
+  void FlushLines();
+  void DispatchLines();
+  void SyncBackgroundPlane(uint8_t lcdc);
+  // Pixel FIFO renderer
+  void UpdatePixelFifo(uint8_t current_ly);
+  void StartFifoLine(uint8_t current_ly);
+  bool RunPixelFifo(int target_dots);
+  void FetchFifoSprite();
+  void UpdateFifoPalettes();
   void SetMode(uint8_t mode) const;
+  int NextEvent() const;
   int current_scanline_cycles_ = 0;  // 456 per each individual scan line
+  // catch-up state, cycles not yet applied and the scanline position at
+  // which Update() next has something to do
+  int pending_cycles_ = 0;
+  int next_event_ = 0;
   bool finished_current_line_{};
   bool oam_search_finished_{};
   bool vblank_{};
   bool hblank_{};
+  PPURenderer renderer_ = PPURenderer::kScanline;
+  FifoState fifo_{};
+  // frameskip
+  int render_interval_ = 1;
+  int frame_count_ = 0;
+  bool render_current_frame_ = true;
   // visible sprites for each line
   std::vector<Sprite> visible_sprites_{};
+  // OAM parsed into a sprite table plus a per line index of the (up to) 10
+  // sprites hardware selects for that line, in drawing priority order.
+  // Only rebuilt when OAM is written/DMA'd or the sprite height changes
+  std::array<Sprite, 40> sprite_table_{};
+  std::array<std::array<uint8_t, 10>, 144> line_sprites_{};
+  std::array<uint8_t, 144> line_sprite_count_{};
+  uint32_t sprite_table_generation_ = 0;
+  uint8_t sprite_table_height_ = 0;
+  // Colour indices (0-3) of the whole 256x256 active background map. Synced
+  // with VRAM at the start of each frame, lines are then copied out of it
+  // as long as nothing it depends on changes mid frame. Allocated on the
+  // first sync, not everything renders
+  std::vector<uint8_t> bg_plane_{};
+  uint32_t bg_plane_generation_ = 0;
+  uint8_t bg_plane_lcdc_ = 0;
+  bool bg_plane_valid_ = false;
+  // Deferred rendering. Lines captured this frame, how many have been handed
+  // to the workers so far, and copies of VRAM taken whenever it changed
+  // between captured lines
+  std::array<LineState, 144> frame_lines_{};
+  int captured_lines_ = 0;
+  int dispatched_lines_ = 0;
+  std::vector<std::array<uint8_t, 0x2000>> vram_copies_{};
+  int vram_copy_count_ = 0;
+  uint32_t vram_copy_generation_ = 0;
+  // last so the workers are stopped before anything they use goes away
+  std::unique_ptr<RenderWorkers> workers_{};
 };
 
 #endif  // !PPU_H
@@ -0,0 +1,52 @@
+#include "render_workers.h"
+
+#include <utility>
+
+RenderWorkers::RenderWorkers(const int threads) {
+  for (int i = 0; i < threads; ++i) {
+    threads_.emplace_back(&RenderWorkers::Run, this);
+  }
+}
+
+RenderWorkers::~RenderWorkers() {
+  Wait();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  start_cv_.notify_all();
+  for (std::thread &thread : threads_) thread.join();
+}
+
+void RenderWorkers::Start(const int count, std::function<void(int)> job) {
+  Wait();
+  if (count <= 0) return;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job_ = std::move(job);
+    count_ = count;
+    next_ = 0;
+    remaining_ = count;
+  }
+  start_cv_.notify_all();
+}
+
+void RenderWorkers::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return remaining_ == 0; });
+}
+
+void RenderWorkers::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    start_cv_.wait(lock, [this] { return quit_ || next_ < count_; });
+    if (quit_) return;
+    const int index = next_++;
+    // the batch can't be replaced until remaining_ hits 0, so the job is
+    // safe to call without holding the lock
+    lock.unlock();
+    job_(index);
+    lock.lock();
+    if (--remaining_ == 0) done_cv_.notify_all();
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef RENDER_WORKERS_H
+#define RENDER_WORKERS_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of threads that a batch of independent jobs (eg. the lines of
+ * a frame) can be handed to. Only one batch runs at a time, Start() hands
+ * it out and returns straight away so the caller can get on with something
+ * else until it needs the results and calls Wait().
+ */
+class RenderWorkers {
+ public:
+  explicit RenderWorkers(int threads);
+  RenderWorkers(const RenderWorkers &) = delete;
+  RenderWorkers &operator=(const RenderWorkers &) = delete;
+  ~RenderWorkers();
+  // Run job(0) through job(count - 1) across the workers. Waits for the
+  // previous batch first if it's still going
+  void Start(int count, std::function<void(int)> job);
+  // Block until every job from the last Start() has finished
+  void Wait();
+  int Threads() const { return static_cast<int>(threads_.size()); }
+
+ private:
+  void Run();
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  std::function<void(int)> job_;
+  int count_ = 0;
+  int next_ = 0;
+  int remaining_ = 0;
+  bool quit_ = false;
+};
+
+#endif  // !RENDER_WORKERS_H
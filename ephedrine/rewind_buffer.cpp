@@ -0,0 +1,138 @@
+#include "rewind_buffer.h"
+
+#include <algorithm>
+#include <utility>
+
+RewindBuffer::RewindBuffer(const size_t budget, const int interval)
+    : interval_(std::max(interval, 1)),
+      ring_(budget),
+      worker_(&RewindBuffer::Work, this) {}
+
+RewindBuffer::~RewindBuffer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  work_ready_.notify_one();
+  worker_.join();
+}
+
+void RewindBuffer::Push(Gameboy &gb) {
+  if (++frames_ < interval_) return;
+  frames_ = 0;
+  std::unique_ptr<StateSnapshot> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_.size() >= kMaxQueued) return;
+    if (!spare_.empty()) {
+      snapshot = std::move(spare_.back());
+      spare_.pop_back();
+    }
+  }
+  if (!snapshot) snapshot = std::make_unique<StateSnapshot>();
+  gb.Snapshot(*snapshot);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(snapshot));
+  }
+  work_ready_.notify_one();
+}
+
+bool RewindBuffer::StepBack(Gameboy &gb) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  WaitIdle(lock);
+  if (!newest_ || entries_.empty()) return false;
+  const Entry entry = entries_.back();
+  entries_.pop_back();
+  bytes_used_ -= entry.size;
+  // the newest delta was the last thing written
+  write_offset_ = entry.offset;
+  if (!codec_.Unpack(ring_.data() + entry.offset, entry.size, *newest_,
+                     newest_.get()) ||
+      !gb.Restore(*newest_)) {
+    // nothing older can be got at without this one
+    entries_.clear();
+    bytes_used_ = 0;
+    write_offset_ = 0;
+    spare_.push_back(std::move(newest_));
+    return false;
+  }
+  return true;
+}
+
+void RewindBuffer::Clear() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  WaitIdle(lock);
+  entries_.clear();
+  bytes_used_ = 0;
+  write_offset_ = 0;
+  if (newest_) spare_.push_back(std::move(newest_));
+  frames_ = 0;
+}
+
+size_t RewindBuffer::Depth() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+size_t RewindBuffer::BytesUsed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_used_;
+}
+
+void RewindBuffer::WaitIdle(std::unique_lock<std::mutex> &lock) {
+  work_done_.wait(lock, [this] { return !busy_ && queue_.empty(); });
+}
+
+void RewindBuffer::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_ready_.wait(lock, [this] { return quit_ || !queue_.empty(); });
+    if (quit_) return;
+    std::unique_ptr<StateSnapshot> snapshot = std::move(queue_.front());
+    queue_.pop_front();
+    busy_ = true;
+    lock.unlock();
+    // the one before, as a delta from this one
+    if (newest_) codec_.Pack(*newest_, delta_, snapshot.get());
+    lock.lock();
+    if (newest_) {
+      Store(delta_);
+      spare_.push_back(std::move(newest_));
+    }
+    newest_ = std::move(snapshot);
+    busy_ = false;
+    work_done_.notify_all();
+  }
+}
+
+void RewindBuffer::Store(const std::vector<uint8_t> &delta) {
+  const size_t size = delta.size();
+  if (size > ring_.size()) {
+    // can't be kept, and everything older needs it to be got at
+    entries_.clear();
+    bytes_used_ = 0;
+    write_offset_ = 0;
+    return;
+  }
+  const auto evict_oldest = [this] {
+    bytes_used_ -= entries_.front().size;
+    entries_.pop_front();
+  };
+  if (write_offset_ + size > ring_.size()) {
+    // whatever's left past here is from the last time round, the oldest
+    while (!entries_.empty() && entries_.front().offset >= write_offset_) {
+      evict_oldest();
+    }
+    write_offset_ = 0;
+  }
+  while (!entries_.empty() &&
+         entries_.front().offset < write_offset_ + size &&
+         entries_.front().offset + entries_.front().size > write_offset_) {
+    evict_oldest();
+  }
+  std::copy(delta.begin(), delta.end(), ring_.begin() + write_offset_);
+  entries_.push_back(Entry{write_offset_, size});
+  write_offset_ += size;
+  bytes_used_ += size;
+}
@@ -0,0 +1,83 @@
+#ifndef REWIND_BUFFER_H
+#define REWIND_BUFFER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gb.h"
+#include "snapshot_codec.h"
+
+/**
+ * Rewind history for the player. Every interval frames Push() takes a
+ * snapshot, and a worker thread codes the one before it as an XOR delta
+ * against it (see SnapshotCodec) into a ring of a fixed number of bytes,
+ * so the only snapshot kept whole is the newest. StepBack() undoes the
+ * deltas newest first, restoring each. When the ring's full the oldest
+ * deltas get overwritten, nothing depends on those.
+ *
+ * All Push() costs the emulation thread is taking the snapshot, a couple
+ * of microseconds. At a couple of hundred bytes a frame, 64MB is over an
+ * hour of history.
+ */
+class RewindBuffer {
+ public:
+  static constexpr size_t kDefaultBudget = 64 << 20;
+  explicit RewindBuffer(size_t budget = kDefaultBudget, int interval = 1);
+  RewindBuffer(const RewindBuffer &) = delete;
+  RewindBuffer &operator=(const RewindBuffer &) = delete;
+  ~RewindBuffer();
+  // Call after every frame, every interval'th is snapshotted
+  void Push(Gameboy &gb);
+  // Restore the snapshot before the last one pushed or stepped back to,
+  // false once there's nothing older left
+  bool StepBack(Gameboy &gb);
+  // Forget everything, eg. when a different game's loaded
+  void Clear();
+  // How many steps back there are, and how much of the ring they take up
+  size_t Depth();
+  size_t BytesUsed();
+
+ private:
+  // Snapshots waiting for the worker. Past this it's fallen behind and
+  // frames go unrecorded rather than piling up
+  static constexpr size_t kMaxQueued = 8;
+  struct Entry {
+    size_t offset;
+    size_t size;
+  };
+  void Work();
+  // Wait until everything pushed has been coded into the ring
+  void WaitIdle(std::unique_lock<std::mutex> &lock);
+  void Store(const std::vector<uint8_t> &delta);
+  const int interval_;
+  int frames_ = 0;
+  std::mutex mutex_;
+  std::condition_variable work_ready_;
+  std::condition_variable work_done_;
+  std::deque<std::unique_ptr<StateSnapshot>> queue_{};
+  // spent snapshots, to take the next ones into without allocating
+  std::vector<std::unique_ptr<StateSnapshot>> spare_{};
+  bool busy_ = false;
+  bool quit_ = false;
+  // the newest snapshot, whole. Only the worker touches it (or the codec)
+  // while busy_
+  std::unique_ptr<StateSnapshot> newest_{};
+  SnapshotCodec codec_{};
+  std::vector<uint8_t> delta_{};
+  // deltas, each taking the snapshot after it back to its own, oldest first
+  // from the front of entries_. They're written one after another,
+  // starting back at the beginning when the next won't fit
+  std::vector<uint8_t> ring_;
+  std::deque<Entry> entries_{};
+  size_t write_offset_ = 0;
+  size_t bytes_used_ = 0;
+  std::thread worker_;
+};
+
+#endif  // !REWIND_BUFFER_H
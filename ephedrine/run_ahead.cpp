@@ -0,0 +1,50 @@
+#include "run_ahead.h"
+
+#include <algorithm>
+#include <fstream>
+
+#include "spdlog/spdlog.h"
+
+void RunAhead::SetFrames(const int frames) {
+  frames_ = std::clamp(frames, 0, kMaxFrames);
+}
+
+void RunAhead::Load(const std::string &game) {
+  int frames = 0;
+  if (!game.empty()) {
+    std::ifstream ifs{game + ".runahead"};
+    if (!(ifs >> frames)) frames = 0;
+  }
+  SetFrames(frames);
+}
+
+void RunAhead::Save(const std::string &game) const {
+  if (game.empty()) return;
+  std::ofstream ofs{game + ".runahead"};
+  ofs << frames_ << '\n';
+  if (!ofs) {
+    spdlog::get("stdout")->error("Error writing {0}.runahead", game);
+  }
+}
+
+int RunAhead::RunFrame(Gameboy &gb, const FrameSink &frame_done) {
+  const int frame_cycles = gb.max_cycles_per_vertical_refresh;
+  if (frames_ == 0) {
+    const int cycles = gb.Tick(frame_cycles);
+    if (frame_done) frame_done(gb);
+    return cycles;
+  }
+  const int render_interval = gb.ppu.GetRenderInterval();
+  gb.ppu.SetRenderInterval(0);
+  const int cycles = gb.Tick(frame_cycles);
+  if (frame_done) frame_done(gb);
+  gb.Snapshot(snapshot_);
+  for (int i = 1; i < frames_; ++i) gb.Tick(frame_cycles);
+  // the one that's shown, always rendered unless rendering's off
+  gb.ppu.SetRenderInterval(render_interval);
+  gb.Tick(frame_cycles);
+  // the screen keeps the frame ahead, nothing's run after this
+  gb.Restore(snapshot_);
+  gb.ppu.SetRenderInterval(render_interval);
+  return cycles;
+}
@@ -0,0 +1,44 @@
+#ifndef RUN_AHEAD_H
+#define RUN_AHEAD_H
+
+#include <functional>
+#include <string>
+
+#include "gb.h"
+
+/**
+ * Hides a game's own input lag. Each frame RunFrame() runs the real frame,
+ * unrendered, which is the one that's kept and heard. Then it takes a
+ * snapshot, runs frames ahead with whatever buttons are held now (only the
+ * last one rendered, that's the picture shown) and restores the snapshot.
+ * Games that take a couple of frames to react to a button show the reaction
+ * straight away.
+ *
+ * A displayed frame costs frames + 1 emulated ones, plus a snapshot and a
+ * restore (a few microseconds). How many frames a game needs is up to the
+ * game, so the setting is kept per game.
+ */
+class RunAhead {
+ public:
+  // Called once the real frame's run, before running ahead. The sound has
+  // to be read here, restoring the snapshot drops anything unread
+  using FrameSink = std::function<void(Gameboy &gb)>;
+  static constexpr int kMaxFrames = 4;
+  // 0 turns it off, clamped to kMaxFrames
+  void SetFrames(int frames);
+  int GetFrames() const { return frames_; }
+  // The setting for a game, from/to <game>.runahead next to its battery
+  // save. Loading a game without one turns run-ahead off, an unnamed game's
+  // is never saved
+  void Load(const std::string &game);
+  void Save(const std::string &game) const;
+  // Run the next frame, returning the cycles it took like Gameboy::Tick().
+  // frame_done gets called when it's off too
+  int RunFrame(Gameboy &gb, const FrameSink &frame_done = nullptr);
+
+ private:
+  int frames_ = 0;
+  StateSnapshot snapshot_{};
+};
+
+#endif  // !RUN_AHEAD_H
@@ -0,0 +1,13 @@
+#pragma once
+
+/* SSE2 is part of x86-64 itself (and assumed by MSVC's x64 target), so it
+ * can be used without any extra compiler flags. Everything using it has a
+ * plain C++ fallback for other targets, eg. ARM Macs.
+ * Build with -DEPHEDRINE_NO_SIMD to force the fallback
+ */
+#if !defined(EPHEDRINE_NO_SIMD) &&                     \
+    (defined(__SSE2__) || defined(_M_X64) ||           \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define EPHEDRINE_SSE2 1
+#include <emmintrin.h>
+#endif
@@ -0,0 +1,293 @@
+#include "snapshot_codec.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+// "EPHS"
+constexpr uint32_t kMagic = 0x53485045;
+constexpr uint32_t kDeltaFlag = 1;
+struct Header {
+  uint32_t magic;
+  uint32_t machine_size;
+  uint32_t ram_banks;
+  uint32_t flags;
+  uint64_t cart_checksum;
+  // of the rest of the header and everything after it, see PackedHash()
+  uint64_t hash;
+};
+// The most RAM banks a cart has (128KB, MBC5), anything claiming more is
+// damaged and mustn't get as far as allocating room for them
+constexpr uint32_t kMaxRamBanks = 16;
+// Runs shorter than this are cheaper left in with the literals (Compress()
+// checks for one by hand)
+constexpr size_t kMinRun = 4;
+// Each op starts with a varint of length << 2 | its kind. A run of a
+// repeated byte is followed by the byte, a literal by its bytes
+enum Op { kZeroRun = 0, kRepeatRun = 1, kLiteral = 2 };
+// Echo RAM (0xE000 - 0xFDFF) is coded against 0xC000 - 0xDDFF
+constexpr size_t kEchoSize = 0x1E00;
+constexpr size_t kEchoDistance = 0x2000;
+
+size_t EchoOffset(const MachineState &machine) {
+  return static_cast<size_t>(machine.mmu.memory.data() + 0x6000 -
+                             reinterpret_cast<const uint8_t *>(&machine));
+}
+
+void PutVarint(std::vector<uint8_t> &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+bool GetVarint(const uint8_t *&data, const uint8_t *end, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64 && data < end; shift += 7) {
+    const uint8_t byte = *data++;
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+// Hash of a packed snapshot bar the header's hash (counted as 0), so a
+// damaged one is turned away rather than restoring garbage. FNV-1a 8 bytes
+// at a time, with an xorshift so the top bits feed back into the bottom
+// (otherwise flipping bit 63 of two words in a row cancels out). Every
+// step's a bijection, so any one word changed always shows
+uint64_t PackedHash(const uint8_t *data, const size_t size) {
+  Header header;
+  std::memcpy(&header, data, sizeof(header));
+  header.hash = 0;
+  uint64_t hash = 14695981039346656037ULL;
+  const auto add = [&hash](const uint8_t *bytes, const size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+      uint64_t word;
+      std::memcpy(&word, bytes + i, sizeof(word));
+      hash = (hash ^ word) * 1099511628211ULL;
+      hash ^= hash >> 29;
+    }
+    for (; i < count; ++i) {
+      hash = (hash ^ bytes[i]) * 1099511628211ULL;
+      hash ^= hash >> 29;
+    }
+  };
+  add(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+  add(data + sizeof(header), size - sizeof(header));
+  return hash;
+}
+
+// How many bytes from start on are the same as the first, 8 at a time
+size_t RunLength(const uint8_t *start, const uint8_t *end) {
+  const uint8_t *pos = start + 1;
+  uint64_t pattern;
+  std::memset(&pattern, *start, sizeof(pattern));
+  while (end - pos >= 8) {
+    uint64_t word;
+    std::memcpy(&word, pos, sizeof(word));
+    if (word != pattern) break;
+    pos += 8;
+  }
+  while (pos < end && *pos == *start) ++pos;
+  return static_cast<size_t>(pos - start);
+}
+
+void Compress(const uint8_t *data, const size_t size,
+              std::vector<uint8_t> &out) {
+  const uint8_t *pos = data;
+  const uint8_t *const end = data + size;
+  while (pos < end) {
+    const size_t run = RunLength(pos, end);
+    if (run >= kMinRun || run == static_cast<size_t>(end - pos)) {
+      if (*pos == 0) {
+        PutVarint(out, run << 2 | kZeroRun);
+      } else {
+        PutVarint(out, run << 2 | kRepeatRun);
+        out.push_back(*pos);
+      }
+      pos += run;
+      continue;
+    }
+    // literals up to wherever the next run worth having starts
+    const uint8_t *literal_end = pos + run;
+    while (static_cast<size_t>(end - literal_end) >= kMinRun &&
+           !(literal_end[0] == literal_end[1] &&
+             literal_end[1] == literal_end[2] &&
+             literal_end[2] == literal_end[3])) {
+      ++literal_end;
+    }
+    if (static_cast<size_t>(end - literal_end) < kMinRun) literal_end = end;
+    const size_t length = static_cast<size_t>(literal_end - pos);
+    PutVarint(out, length << 2 | kLiteral);
+    out.insert(out.end(), pos, literal_end);
+    pos = literal_end;
+  }
+}
+
+bool Decompress(const uint8_t *data, const uint8_t *const end,
+                std::vector<uint8_t> &out) {
+  uint8_t *pos = out.data();
+  uint8_t *const out_end = out.data() + out.size();
+  while (data < end) {
+    uint64_t op = 0;
+    if (!GetVarint(data, end, op)) return false;
+    const uint64_t length = op >> 2;
+    if (length > static_cast<uint64_t>(out_end - pos)) return false;
+    switch (op & 0x03) {
+      case kZeroRun:
+        std::fill_n(pos, length, 0);
+        break;
+      case kRepeatRun:
+        if (data == end) return false;
+        std::fill_n(pos, length, *data++);
+        break;
+      case kLiteral:
+        if (length > static_cast<uint64_t>(end - data)) return false;
+        std::copy_n(data, length, pos);
+        data += length;
+        break;
+      default:
+        return false;
+    }
+    pos += length;
+  }
+  return pos == out_end;
+}
+
+// out[i] = a[i] ^ b[i], b may be null for all zeros
+void Xor(uint8_t *out, const uint8_t *a, const uint8_t *b, const size_t size) {
+  if (b == nullptr) {
+    std::copy_n(a, size, out);
+    return;
+  }
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t x, y;
+    std::memcpy(&x, a + i, sizeof(x));
+    std::memcpy(&y, b + i, sizeof(y));
+    x ^= y;
+    std::memcpy(out + i, &x, sizeof(x));
+  }
+  for (; i < size; ++i) out[i] = a[i] ^ b[i];
+}
+}  // namespace
+
+void SnapshotCodec::Pack(const StateSnapshot &snapshot,
+                         std::vector<uint8_t> &out,
+                         const StateSnapshot *reference) {
+  constexpr size_t kMachineSize = sizeof(MachineState);
+  const size_t banks = snapshot.ram_banks.size();
+  // a reference of another game, or with a different number of banks, is
+  // no help
+  if (reference != nullptr &&
+      (reference->machine.mmu.cart_checksum !=
+           snapshot.machine.mmu.cart_checksum ||
+       reference->ram_banks.size() != banks)) {
+    reference = nullptr;
+  }
+  delta_.resize(kMachineSize + banks * kMemoryPageSize);
+  const auto *machine =
+      reinterpret_cast<const uint8_t *>(&snapshot.machine);
+  const auto *base = reference != nullptr
+                         ? reinterpret_cast<const uint8_t *>(
+                               &reference->machine)
+                         : nullptr;
+  const size_t echo = EchoOffset(snapshot.machine);
+  Xor(delta_.data(), machine, base, echo);
+  Xor(delta_.data() + echo, machine + echo, machine + echo - kEchoDistance,
+      kEchoSize);
+  const size_t after_echo = echo + kEchoSize;
+  Xor(delta_.data() + after_echo, machine + after_echo,
+      base != nullptr ? base + after_echo : nullptr,
+      kMachineSize - after_echo);
+  for (size_t i = 0; i < banks; ++i) {
+    uint8_t *const out_bank =
+        delta_.data() + kMachineSize + i * kMemoryPageSize;
+    if (reference != nullptr &&
+        reference->ram_banks[i] == snapshot.ram_banks[i]) {
+      std::fill_n(out_bank, kMemoryPageSize, 0);
+    } else {
+      Xor(out_bank, snapshot.ram_banks[i]->data(),
+          reference != nullptr ? reference->ram_banks[i]->data() : nullptr,
+          kMemoryPageSize);
+    }
+  }
+
+  Header header{kMagic,
+                static_cast<uint32_t>(kMachineSize),
+                static_cast<uint32_t>(banks),
+                reference != nullptr ? kDeltaFlag : 0,
+                snapshot.machine.mmu.cart_checksum,
+                0};
+  out.resize(sizeof(header));
+  std::memcpy(out.data(), &header, sizeof(header));
+  Compress(delta_.data(), delta_.size(), out);
+  header.hash = PackedHash(out.data(), out.size());
+  std::memcpy(out.data(), &header, sizeof(header));
+}
+
+bool SnapshotCodec::Unpack(const uint8_t *data, const size_t size,
+                           StateSnapshot &snapshot,
+                           const StateSnapshot *reference) {
+  constexpr size_t kMachineSize = sizeof(MachineState);
+  Header header;
+  // there's always at least one op after the header, nothing packs to none
+  if (size <= sizeof(header)) return false;
+  std::memcpy(&header, data, sizeof(header));
+  if (header.magic != kMagic || header.machine_size != kMachineSize ||
+      header.ram_banks > kMaxRamBanks ||
+      header.hash != PackedHash(data, size)) {
+    return false;
+  }
+  const size_t banks = header.ram_banks;
+  if (header.flags & kDeltaFlag) {
+    if (reference == nullptr ||
+        reference->machine.mmu.cart_checksum != header.cart_checksum ||
+        reference->ram_banks.size() != banks) {
+      return false;
+    }
+  } else {
+    reference = nullptr;
+  }
+  delta_.resize(kMachineSize + banks * kMemoryPageSize);
+  if (!Decompress(data + sizeof(header), data + size, delta_)) return false;
+
+  // reference can be snapshot itself, every byte's read before it's written
+  auto *machine = reinterpret_cast<uint8_t *>(&snapshot.machine);
+  const auto *base = reference != nullptr
+                         ? reinterpret_cast<const uint8_t *>(
+                               &reference->machine)
+                         : nullptr;
+  const size_t echo = EchoOffset(snapshot.machine);
+  Xor(machine, delta_.data(), base, echo);
+  // WRAM's done by now
+  Xor(machine + echo, delta_.data() + echo, machine + echo - kEchoDistance,
+      kEchoSize);
+  const size_t after_echo = echo + kEchoSize;
+  Xor(machine + after_echo, delta_.data() + after_echo,
+      base != nullptr ? base + after_echo : nullptr,
+      kMachineSize - after_echo);
+  snapshot.ram_banks.resize(banks);
+  for (size_t i = 0; i < banks; ++i) {
+    const uint8_t *const delta_bank =
+        delta_.data() + kMachineSize + i * kMemoryPageSize;
+    // an unchanged bank is shared like any other, banks are never written
+    // to in place, so a changed one is always a new page
+    if (reference != nullptr &&
+        RunLength(delta_bank, delta_bank + kMemoryPageSize) ==
+            kMemoryPageSize &&
+        *delta_bank == 0) {
+      snapshot.ram_banks[i] = reference->ram_banks[i];
+      continue;
+    }
+    auto bank = std::make_shared<MemoryPage>();
+    Xor(bank->data(), delta_bank,
+        reference != nullptr ? reference->ram_banks[i]->data() : nullptr,
+        kMemoryPageSize);
+    snapshot.ram_banks[i] = std::move(bank);
+  }
+  return true;
+}
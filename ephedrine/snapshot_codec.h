@@ -0,0 +1,43 @@
+#ifndef SNAPSHOT_CODEC_H
+#define SNAPSHOT_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "gb.h"
+
+/**
+ * Turns a StateSnapshot into bytes and back, for writing it out or handing
+ * it to another process. The ROM was never part of it, and the rest is run
+ * length coded, so untouched VRAM, blank RAM banks, disabled cart RAM and
+ * the like come to a few bytes each. Echo RAM is coded against the WRAM it
+ * mirrors.
+ *
+ * Given a reference (a snapshot of the same game, eg. the one before), each
+ * byte is coded as its XOR with the reference's, so only what's changed
+ * since takes up any room. Unpacking then needs that same reference, and
+ * can unpack straight over it.
+ *
+ * The machine state goes in as it's laid out in memory, so packed
+ * snapshots only mean anything to the same build of the emulator. They're
+ * hashed, so one damaged on disk gets turned away by Unpack() instead of
+ * being restored.
+ */
+class SnapshotCodec {
+ public:
+  // Replaces out's contents
+  void Pack(const StateSnapshot &snapshot, std::vector<uint8_t> &out,
+            const StateSnapshot *reference = nullptr);
+  // false, with snapshot left in any state, if data is damaged or not a
+  // packed snapshot, or was packed against a reference that isn't given
+  bool Unpack(const uint8_t *data, size_t size, StateSnapshot &snapshot,
+              const StateSnapshot *reference = nullptr);
+
+ private:
+  // the snapshot XORed with the reference, before and after run length
+  // coding. Kept to save reallocating it every time
+  std::vector<uint8_t> delta_{};
+};
+
+#endif  // !SNAPSHOT_CODEC_H
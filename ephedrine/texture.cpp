@@ -0,0 +1,131 @@
+#include "texture.h"
+
+#include <SDL.h>
+
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+namespace {
+// Buffer object entry points aren't exported by every platform's GL
+// library, so grab them from the context the first time we need them
+PFNGLGENBUFFERSPROC gl_gen_buffers = nullptr;
+PFNGLDELETEBUFFERSPROC gl_delete_buffers = nullptr;
+PFNGLBINDBUFFERPROC gl_bind_buffer = nullptr;
+PFNGLBUFFERDATAPROC gl_buffer_data = nullptr;
+PFNGLMAPBUFFERRANGEPROC gl_map_buffer_range = nullptr;
+PFNGLUNMAPBUFFERPROC gl_unmap_buffer = nullptr;
+
+bool LoadBufferFunctions() {
+  if (gl_gen_buffers) return true;
+  gl_gen_buffers = reinterpret_cast<PFNGLGENBUFFERSPROC>(
+      SDL_GL_GetProcAddress("glGenBuffers"));
+  gl_delete_buffers = reinterpret_cast<PFNGLDELETEBUFFERSPROC>(
+      SDL_GL_GetProcAddress("glDeleteBuffers"));
+  gl_bind_buffer = reinterpret_cast<PFNGLBINDBUFFERPROC>(
+      SDL_GL_GetProcAddress("glBindBuffer"));
+  gl_buffer_data = reinterpret_cast<PFNGLBUFFERDATAPROC>(
+      SDL_GL_GetProcAddress("glBufferData"));
+  gl_map_buffer_range = reinterpret_cast<PFNGLMAPBUFFERRANGEPROC>(
+      SDL_GL_GetProcAddress("glMapBufferRange"));
+  gl_unmap_buffer = reinterpret_cast<PFNGLUNMAPBUFFERPROC>(
+      SDL_GL_GetProcAddress("glUnmapBuffer"));
+  if (!gl_gen_buffers || !gl_delete_buffers || !gl_bind_buffer ||
+      !gl_buffer_data || !gl_map_buffer_range || !gl_unmap_buffer) {
+    spdlog::get("stdout")->warn(
+        "Pixel buffer objects unavailable, falling back to direct uploads");
+    gl_gen_buffers = nullptr;
+    return false;
+  }
+  return true;
+}
+
+// Cheap 64 bit hash, 8 bytes at a time. Texture sizes are always a multiple
+// of 8 bytes (width * height * 4 with an even width)
+uint64_t HashPixels(const uint8_t *pixels, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, pixels + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+}  // namespace
+
+StreamingTexture::StreamingTexture(const int width, const int height)
+    : width_(width), height_(height), size_(width * height * 4) {
+  glGenTextures(1, &texture_);
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+                  GL_CLAMP_TO_EDGE);  // This is required on WebGL for non
+                                      // power-of-two textures
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);  // Same
+  // allocate storage once, every later upload is a sub image update
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width_, height_, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, nullptr);
+
+  if (LoadBufferFunctions()) {
+    gl_gen_buffers(kRingSize, pbos_.data());
+    for (const GLuint pbo : pbos_) {
+      gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+      gl_buffer_data(GL_PIXEL_UNPACK_BUFFER, size_, nullptr, GL_STREAM_DRAW);
+    }
+    gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+}
+
+StreamingTexture::~StreamingTexture() {
+  if (gl_gen_buffers) gl_delete_buffers(kRingSize, pbos_.data());
+  glDeleteTextures(1, &texture_);
+}
+
+void StreamingTexture::Update(const uint8_t *pixels) {
+  const uint64_t hash = HashPixels(pixels, size_);
+  if (valid_ && hash == last_hash_) return;
+  Upload(pixels);
+  last_hash_ = hash;
+}
+
+void StreamingTexture::Update(const uint8_t *pixels, const uint64_t version) {
+  if (valid_ && version == last_version_) return;
+  Upload(pixels);
+  last_version_ = version;
+}
+
+void StreamingTexture::Upload(const uint8_t *pixels) {
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  valid_ = true;
+  if (!gl_gen_buffers) {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width_, height_, GL_RGBA,
+                    GL_UNSIGNED_BYTE, pixels);
+    return;
+  }
+
+  // Each upload goes through the next buffer in the ring, so we never have
+  // to wait on the driver to finish with the one it's still reading from.
+  // Invalidating the range lets the driver hand us fresh memory as well.
+  gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, pbos_[next_pbo_]);
+  next_pbo_ = (next_pbo_ + 1) % kRingSize;
+  void *dest = gl_map_buffer_range(
+      GL_PIXEL_UNPACK_BUFFER, 0, size_,
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (dest) {
+    std::memcpy(dest, pixels, size_);
+    gl_unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+    // with a buffer bound the last argument is an offset into it, and the
+    // copy into the texture happens asynchronously
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width_, height_, GL_RGBA,
+                    GL_UNSIGNED_BYTE, nullptr);
+  } else {
+    gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width_, height_, GL_RGBA,
+                    GL_UNSIGNED_BYTE, pixels);
+  }
+  gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
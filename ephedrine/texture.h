@@ -0,0 +1,46 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <SDL_opengl.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * An RGBA8 texture that is allocated once and then streamed to through a
+ * small ring of pixel buffer objects. Uploads are skipped entirely when the
+ * source pixels (or the version handed in by the caller) haven't changed
+ * since the last upload.
+ */
+class StreamingTexture {
+ public:
+  StreamingTexture(int width, int height);
+  StreamingTexture(const StreamingTexture &) = delete;
+  StreamingTexture &operator=(const StreamingTexture &) = delete;
+  ~StreamingTexture();
+  // Upload if the contents differ from what the texture already holds
+  void Update(const uint8_t *pixels);
+  // Upload only if version differs from the last uploaded version
+  void Update(const uint8_t *pixels, uint64_t version);
+  // Force the next Update() to upload, eg. after a new game is loaded
+  void Invalidate() { valid_ = false; }
+  GLuint Id() const { return texture_; }
+  int Width() const { return width_; }
+  int Height() const { return height_; }
+
+ private:
+  static constexpr int kRingSize = 3;
+  void Upload(const uint8_t *pixels);
+  int width_;
+  int height_;
+  size_t size_;
+  GLuint texture_ = 0;
+  std::array<GLuint, kRingSize> pbos_{};
+  int next_pbo_ = 0;
+  bool valid_ = false;
+  uint64_t last_hash_ = 0;
+  uint64_t last_version_ = 0;
+};
+
+#endif  // !TEXTURE_H
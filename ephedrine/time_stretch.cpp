@@ -0,0 +1,145 @@
+#include "time_stretch.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "simd.h"
+
+namespace {
+// Segment, overlap and seek window lengths. Long enough segments to keep
+// low notes intact, short enough that fast forward doesn't sound choppy
+constexpr double kSequenceSeconds = 0.040;
+constexpr double kOverlapSeconds = 0.008;
+constexpr double kSeekSeconds = 0.015;
+// Close enough to real time to pass the input straight through
+constexpr double kUnityTempo = 0.001;
+
+float Dot(const float *a, const float *b, const int count) {
+  int i = 0;
+  float sum = 0;
+#ifdef EPHEDRINE_SSE2
+  __m128 sums = _mm_setzero_ps();
+  for (; i + 4 <= count; i += 4) {
+    const __m128 product = _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    sums = _mm_add_ps(sums, product);
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, sums);
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+  for (; i < count; ++i) sum += a[i] * b[i];
+  return sum;
+}
+
+void Append(const float *samples, const int count, std::vector<int16_t> &out) {
+  for (int i = 0; i < count; ++i) {
+    out.push_back(static_cast<int16_t>(
+        std::clamp(samples[i], -32768.0F, 32767.0F)));
+  }
+}
+}  // namespace
+
+TimeStretch::TimeStretch(const int sample_rate)
+    : sequence_(static_cast<int>(sample_rate * kSequenceSeconds)),
+      overlap_(static_cast<int>(sample_rate * kOverlapSeconds)),
+      seek_(static_cast<int>(sample_rate * kSeekSeconds)),
+      tail_(overlap_ * 2, 0.0F),
+      fade_(overlap_ * 2) {
+  for (int i = 0; i < overlap_; ++i) {
+    const float weight = static_cast<float>(i) / overlap_;
+    fade_[i * 2] = weight;
+    fade_[i * 2 + 1] = weight;
+  }
+}
+
+void TimeStretch::Clear() {
+  input_.clear();
+  position_ = 0;
+  has_tail_ = false;
+}
+
+void TimeStretch::Process(const int16_t *in, const int frames,
+                          std::vector<int16_t> &out) {
+  const bool unity = std::abs(tempo_ - 1.0) < kUnityTempo;
+  if (unity && input_.empty() && !has_tail_) {
+    out.insert(out.end(), in, in + frames * 2);
+    return;
+  }
+  input_.insert(input_.end(), in, in + frames * 2);
+  const int available = static_cast<int>(input_.size() / 2);
+  int start = static_cast<int>(position_);
+  if (unity) {
+    // back to real time, fade the last segment out into the input and then
+    // pass everything through
+    if (start + (has_tail_ ? overlap_ : 0) > available) return;
+    const float *next = &input_[start * 2];
+    const int count = (available - start) * 2;
+    if (has_tail_) {
+      AppendCrossfade(next, out);
+      Append(next + overlap_ * 2, count - overlap_ * 2, out);
+    } else {
+      Append(next, count, out);
+    }
+    Clear();
+    return;
+  }
+  while (start + seek_ + sequence_ <= available) {
+    const int offset = has_tail_ ? BestOffset(&input_[start * 2]) : 0;
+    OutputSegment(&input_[(start + offset) * 2], out);
+    // the segment gave sequence_ - overlap_ pairs of output, which covers
+    // tempo times as much input
+    position_ += (sequence_ - overlap_) * tempo_;
+    start = static_cast<int>(position_);
+  }
+  // drop what no later segment can start in, fast forward can skip past
+  // the end of what's arrived so far
+  const int consumed = std::min(start, available);
+  input_.erase(input_.begin(), input_.begin() + consumed * 2);
+  position_ -= consumed;
+}
+
+void TimeStretch::OutputSegment(const float *segment,
+                                std::vector<int16_t> &out) {
+  const int overlap = overlap_ * 2;
+  const int body = (sequence_ - overlap_) * 2;
+  if (has_tail_) {
+    AppendCrossfade(segment, out);
+    Append(segment + overlap, body - overlap, out);
+  } else {
+    Append(segment, body, out);
+  }
+  std::copy(segment + body, segment + body + overlap, tail_.begin());
+  has_tail_ = true;
+}
+
+void TimeStretch::AppendCrossfade(const float *next,
+                                  std::vector<int16_t> &out) const {
+  for (int i = 0; i < overlap_ * 2; ++i) {
+    const float mixed = tail_[i] + (next[i] - tail_[i]) * fade_[i];
+    out.push_back(
+        static_cast<int16_t>(std::clamp(mixed, -32768.0F, 32767.0F)));
+  }
+}
+
+int TimeStretch::BestOffset(const float *candidates) const {
+  // normalised cross correlation, so louder candidates don't win just for
+  // being louder. The energy under the window slides along with it
+  const int length = overlap_ * 2;
+  double energy = Dot(candidates, candidates, length);
+  int best = 0;
+  double best_score = -1e30;
+  for (int offset = 0; offset < seek_; ++offset) {
+    const float *candidate = candidates + offset * 2;
+    const double correlation = Dot(tail_.data(), candidate, length);
+    const double score = correlation / std::sqrt(std::max(energy, 1.0));
+    if (score > best_score) {
+      best_score = score;
+      best = offset;
+    }
+    for (int i = 0; i < 2; ++i) {
+      energy += candidate[length + i] * candidate[length + i] -
+                candidate[i] * candidate[i];
+    }
+  }
+  return best;
+}
@@ -0,0 +1,55 @@
+#ifndef TIME_STRETCH_H
+#define TIME_STRETCH_H
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Changes how long audio lasts without changing its pitch, so fast forward
+ * and slow motion sound like the game rather than chipmunks or a dying
+ * tape deck. It's WSOLA (waveform similarity overlap-add): the output is
+ * built from fixed length segments of the input, each crossfaded into the
+ * last. Segments are read tempo times further apart in the input than they
+ * end up in the output, and each one is nudged (within a small seek window)
+ * to wherever it lines up best with the tail of the previous segment, so
+ * the crossfades don't smear or cancel out the waveform.
+ * At a tempo of 1 the input is passed straight through.
+ */
+class TimeStretch {
+ public:
+  explicit TimeStretch(int sample_rate);
+  // Input time per output time, 2 plays back twice as fast
+  void SetTempo(double tempo) { tempo_ = tempo; }
+  double GetTempo() const { return tempo_; }
+  // Stretch frames interleaved stereo pairs, appending what can be output
+  // so far to out. Some input is always held back until there's enough to
+  // search a whole segment
+  void Process(const int16_t *in, int frames, std::vector<int16_t> &out);
+  void Clear();
+
+ private:
+  // Offset (in stereo pairs, 0 to seek_ - 1) into candidates that best
+  // continues tail_
+  int BestOffset(const float *candidates) const;
+  // Crossfade tail_ into the start of segment, then append the rest of it
+  // up to its own tail, which gets kept for the next one
+  void OutputSegment(const float *segment, std::vector<int16_t> &out);
+  // Fade from tail_ to the first overlap_ pairs of next
+  void AppendCrossfade(const float *next, std::vector<int16_t> &out) const;
+  // Lengths in stereo pairs
+  int sequence_;
+  int overlap_;
+  int seek_;
+  double tempo_ = 1.0;
+  // Input not yet used up, interleaved, and where the next segment would
+  // start in it (fractional, tempo rarely divides evenly)
+  std::vector<float> input_{};
+  double position_ = 0;
+  // End of the last segment, still to be crossfaded into the next one
+  std::vector<float> tail_{};
+  bool has_tail_ = false;
+  // Fade in weights for the overlap, per interleaved sample
+  std::vector<float> fade_{};
+};
+
+#endif  // !TIME_STRETCH_H